@@ -60,6 +60,11 @@ extern "C" {
 
 		 - TRY_ONCE_LOCK: If you can't grab the lock on the first try,
        return with an error code.
+
+		 Inserts and adaptations (qf_insert_ret, insert_and_extend, qf_adapt,
+		 qf_query_adapt) first find the empty slots their shifts will end
+		 in and lock every region up to them, so an extension that pushes a
+		 long cluster into later regions is safe in every mode.
 	*/
 #define QF_NO_LOCK (0x01)
 #define QF_TRY_ONCE_LOCK (0x02)
@@ -69,6 +74,11 @@ extern "C" {
 		 hashed. */
 #define QF_KEY_IS_HASH (0x08)
 
+	/* Batch calls only: handle the keys in quotient order instead of the
+		 order given, so that neighbouring keys share blocks.  Results still
+		 come back in the order given. */
+#define QF_BATCH_SORT (0x10)
+
 	/******************************************
 		 The CQF defines low-level constructor and destructor operations
 		 that are designed to enable the application to manage the memory
@@ -123,9 +133,122 @@ extern "C" {
 
 	/* Turn on automatic resizing.  Resizing is performed by calling
 		 qf_resize_malloc, so the CQF must meet the requirements of that
-		 function. */
+		 function.
+
+		 A malloc-backed CQF is resized incrementally: the insert that finds
+		 it full only allocates the new table, and every later qf_insert
+		 moves one chunk of the old one.  Lookups check both tables while
+		 that goes on.  qf_remove, qf_insert_ret and the other adaptive
+		 calls move the chunk of their key first and then work on the new
+		 table, qf_compact_extensions sweeps the new table, and explicit
+		 resizes finish the migration before they start.  Indexes returned
+		 while it goes on (ret_index, for qf_get_payload, qf_adapt and so
+		 on) refer to the new table.  Extensions are not carried over;
+		 payloads and reverse map keys are.
+		 Replaced tables are kept until qf_free.  Starting a resize waits for
+		 every lock region to be free once, so don't call qf_insert while
+		 holding qf_lock_buckets (or from a qf_pipeline) on an auto-resizing
+		 CQF. */
 	void qf_set_auto_resize(QF* qf, bool enabled);
 
+	/* How the lock regions are locked.  QF_LOCK_TAS is a test-and-set lock
+		 with exponential backoff, QF_LOCK_TICKET a FIFO ticket lock and
+		 QF_LOCK_MCS a queue lock where each waiter spins on its own node,
+		 which holds up best with many threads on a few hot regions. */
+	enum qf_lock_kind {
+		QF_LOCK_TAS = 0,
+		QF_LOCK_TICKET,
+		QF_LOCK_MCS
+	};
+
+	/* Choose the lock implementation (QF_LOCK_TAS by default).  Call it
+		 right after qf_init, qf_malloc or qf_use, before other threads use
+		 the CQF.  It is carried across resizes. */
+	void qf_set_lock_kind(QF *qf, enum qf_lock_kind kind);
+
+	/* Lock striping.  The slots are split into lock regions of
+		 slots_per_lock slots (a power of 2, at least 64; 2^16 by default).  Inserts and
+		 adapts lock only the regions their shifts reach and queries check only
+		 the regions they read, but removes and qf_lock_buckets lock every
+		 region within cluster_size slots of their buckets, so cluster_size
+		 must be at least the longest cluster the CQF gets (the default, 2^14,
+		 allows for the 95% occupancy limit).  Smaller regions mean less
+		 contention between threads and more locks per operation.  Call it
+		 right after qf_init, qf_malloc or qf_use, before other threads use
+		 the CQF.  It is carried across resizes.  Returns false if the sizes
+		 are invalid. */
+	bool qf_set_lock_regions(QF *qf, uint64_t slots_per_lock, uint64_t
+													 cluster_size);
+
+	/* Choose slots_per_lock for nthreads threads (0 for one per online CPU)
+		 from the size of the CQF: a few regions per thread, but no regions
+		 smaller than 2^12 slots.  Same restrictions as qf_set_lock_regions. */
+	void qf_tune_lock_regions(QF *qf, int nthreads);
+
+	uint64_t qf_get_slots_per_lock(const QF *qf);
+
+	/* Take the locks covering home buckets first..last (see
+		 qf_get_home_bucket) so that a batch of operations on keys homed there
+		 can be applied with QF_NO_LOCK.  Concurrent queries see the whole
+		 batch as a single write.  Returns false if QF_TRY_ONCE_LOCK couldn't
+		 get all the locks. */
+	bool qf_lock_buckets(QF *qf, uint64_t first, uint64_t last, uint8_t flags);
+	void qf_unlock_buckets(QF *qf, uint64_t first, uint64_t last);
+
+	/* Keep a reverse map from stored fingerprints to the keys that were
+		 inserted.  Once it is enabled, qf_insert_ret, insert_and_extend and
+		 qf_adapt keep it up to date, so callers can tell a true positive
+		 from a false positive without maintaining their own table.  The map
+		 is carried across automatic resizes but not explicit ones.  If the
+		 map can't grow, those calls return QF_NO_MEMORY and the key can't be
+		 looked up.
+		 Returns false if the map couldn't be allocated. */
+	bool qf_enable_reverse_map(QF *qf);
+
+	/* Look up the key stored under the fingerprint returned in ret_hash and
+		 ret_hash_len by qf_query or qf_insert_ret.  Returns false if there is
+		 no such fingerprint or the reverse map is not enabled. */
+	bool qf_reverse_lookup(const QF *qf, uint64_t hash, int hash_len, uint64_t
+												 *key);
+	bool qf_reverse_lookup128(const QF *qf, __uint128_t hash, int hash_len,
+														uint64_t *key);
+
+	/* Keep a 64-bit payload for every item, stored in an array parallel to
+		 the slots and moved whenever the remainders are shifted.  New items
+		 get their (unhashed) key as payload, so after enabling payloads the
+		 ret_index returned by qf_query or qf_insert_ret can be used to check
+		 for a false positive with one array read.  The payloads are carried
+		 across automatic resizes but not explicit ones.
+		 Returns false if the array couldn't be allocated. */
+	bool qf_enable_payloads(QF *qf);
+
+	/* Read or overwrite the payload of the item whose first slot is index
+		 (as returned in ret_index). */
+	uint64_t qf_get_payload(const QF *qf, uint64_t index);
+	void qf_set_payload(QF *qf, uint64_t index, uint64_t payload);
+
+	/* Limits on adaptation, checked every time a fingerprint would be
+		 extended (by insert_and_extend, qf_adapt or qf_query_adapt).  A field
+		 left at 0 sets no limit.  When a limit is hit the fingerprint is left
+		 as it is, so the false positive (or, for two colliding inserts, the
+		 shared fingerprint) stays. */
+	typedef struct qf_adapt_policy {
+		uint32_t max_item_ext_slots;	/* extension slots per item */
+		uint32_t max_run_ext_slots;		/* extension slots per run */
+		double max_ext_fraction;			/* extension slots / nslots */
+		double max_occupancy;					/* occupied slots / nslots */
+		/* Only extend a fingerprint on the lazy_threshold-th false positive it
+			 causes.  Doesn't apply to collisions between inserted items. */
+		uint32_t lazy_threshold;
+	} qf_adapt_policy;
+
+	/* Returns false if the false-positive counts couldn't be allocated. */
+	bool qf_set_adapt_policy(QF *qf, const qf_adapt_policy *policy);
+	void qf_get_adapt_policy(const QF *qf, qf_adapt_policy *policy);
+
+	/* Number of slots currently holding extensions. */
+	uint64_t qf_get_num_extension_slots(const QF *qf);
+
 	/***********************************
    Functions for modifying the CQF.
 	***********************************/
@@ -133,6 +256,9 @@ extern "C" {
 #define QF_NO_SPACE (-1)
 #define QF_COULDNT_LOCK (-2)
 #define QF_DOESNT_EXIST (-3)
+/* The item is in the filter, but the reverse map couldn't grow to hold
+ * its key. */
+#define QF_NO_MEMORY (-6)
 	
 	/* Increment the counter for this key/value pair by count. 
 	 * Return value:
@@ -143,9 +269,90 @@ extern "C" {
 	 */
 	int qf_insert(QF *qf, uint64_t key, uint64_t value, uint64_t count, uint8_t
 								flags);
+
+	/* Same as calling qf_insert(qf, keys[i], 0, counts[i], flags) for each
+		 key, but the whole batch is hashed up front and the blocks of later
+		 keys are prefetched while earlier ones are inserted, so the cache
+		 misses of a batch overlap instead of being paid one at a time.
+		 counts may be NULL (every count is 1), and so may results; otherwise
+		 results[i] gets what qf_insert would have returned for keys[i].
+		 With QF_BATCH_SORT the keys are inserted in quotient order.
+		 Return value: the number of keys inserted (results[i] >= 0), or
+		 QF_NO_MEMORY if the batch couldn't be allocated (nothing is
+		 inserted).
+	 */
+	int64_t qf_insert_batch(QF *qf, const uint64_t *keys, const uint64_t
+													*counts, uint64_t n, uint8_t flags, int *results);
+
 	int qf_insert_ret(QF *qf, uint64_t key, uint64_t count, uint64_t *ret_index, uint64_t *ret_hash, int *ret_hash_len, uint8_t flags);
 	int insert_and_extend(QF *qf, uint64_t index, uint64_t key, uint64_t count, uint64_t other_key, uint64_t *ret_hash, uint64_t *ret_other_hash, uint8_t flags);
 
+	/* 128-bit versions of qf_insert_ret and insert_and_extend (and of
+		 qf_query and qf_adapt below).  Keys are hashed to 128 bits with
+		 MurmurHash3 (or taken as 128-bit hashes with QF_KEY_IS_HASH), so a
+		 fingerprint can keep growing past 64 bits, up to 128, before
+		 adaptation runs out of hash bits.  The 64-bit calls stop at 64.
+		 Use one family or the other on a given filter: an item extended
+		 past 64 bits can't be found by the 64-bit calls.  Payloads and the
+		 reverse map keep the low 64 bits of the key. */
+	int qf_insert_ret128(QF *qf, __uint128_t key, uint64_t count, uint64_t *ret_index, __uint128_t *ret_hash, int *ret_hash_len, uint8_t flags);
+	int insert_and_extend128(QF *qf, uint64_t index, __uint128_t key, uint64_t count, __uint128_t other_key, __uint128_t *ret_hash, __uint128_t *ret_other_hash, uint8_t flags);
+
+	/* Give back extension slots that are no longer needed.  Extensions are
+		 only ever added, so once the item that forced an extension is gone
+		 (or the extension was added for a key that was never inserted) the
+		 survivor keeps paying for them.  This sweeps the clusters of at least
+		 nslots slots, starting where the previous call stopped and wrapping
+		 around the end, and trims each item's extensions to the fewest slots
+		 that still tell it apart from the other items in its run.  Call it
+		 with a small nslots from a background thread, or with
+		 qf_get_nslots(qf) to sweep the whole filter.
+		 Return value:
+		    >= 0: number of slots freed.
+		    == QF_COULDNT_LOCK: TRY_ONCE_LOCK has failed to acquire the lock.
+	 */
+	int64_t qf_compact_extensions(QF *qf, uint64_t nslots, uint8_t flags);
+
+	/* Fill an empty CQF with n hashes, as if each had been inserted with
+		 qf_insert(qf, hashes[i], 0, 1, QF_KEY_IS_HASH).  nthreads threads
+		 each sort the hashes of one range of quotients and lay out its runs
+		 in place, so nothing is shifted; only the items that spill over into
+		 the next range are placed afterwards, one range at a time.  The
+		 CQF must not be used by anyone else during the build.  Payloads are
+		 left at 0 and the reverse map is not filled in.
+		 Return value:
+		    >= 0: number of distinct items.
+		    == QF_NO_SPACE: the hashes don't fit (the CQF is reset).
+		    == QF_INVALID: the CQF isn't empty.
+		    == QF_NO_MEMORY: the buffers couldn't be allocated (the CQF is
+		       left empty).
+		 If fewer than nthreads threads can be started, the build runs with
+		 the ones that could.
+	 */
+	int64_t qf_bulk_build(QF *qf, const uint64_t *hashes, uint64_t n, int
+												nthreads);
+
+	/* Fill an empty CQF in one forward pass from n 64-bit hashes that are
+		 already sorted by bucket (the quotient_bits bits above the low
+		 qf_get_bits_per_slot(qf) bits, as qf_insert_ret takes them with
+		 QF_KEY_IS_HASH).  counts may be NULL (every count is 1).  Slots,
+		 metadata words and block offsets are written in order and nothing is
+		 shifted.  Hashes that share a fingerprint get the extension slots
+		 that tell them apart right away, as insert_and_extend would have
+		 given them, and copies of a hash are one item with the counts
+		 summed.  The CQF must not be used by anyone else during the load.
+		 Payloads are set to the hashes; the reverse map is not filled in.
+		 Return value:
+		    >= 0: number of distinct items.
+		    == QF_NO_SPACE: the hashes don't fit (the CQF is reset).
+		    == QF_INVALID: the CQF isn't empty, or the hashes aren't sorted
+		                   (the CQF is reset).
+		    == QF_NO_MEMORY: a bucket's hashes couldn't be gathered (the CQF
+		                     is reset).
+	 */
+	int64_t qf_bulk_load_sorted(QF *qf, const uint64_t *hashes, const uint64_t
+															*counts, uint64_t n);
+
 	/* Set the counter for this key/value pair to count. 
 	 Return value: Same as qf_insert. 
 	 Returns 0 if new count is equal to old count.
@@ -167,6 +374,19 @@ extern "C" {
 	/* Remove all instances of this key/value pair. */
 	int qf_delete_key_value(QF *qf, uint64_t key, uint64_t value, uint8_t flags);
 
+	/* Remove up to count instances of a key inserted with qf_insert_ret
+	 * (or qf_insert_ret128).  The item is matched on its full fingerprint,
+	 * extensions included, and its extension and counter slots are freed
+	 * along with it.  Items that were extended only to tell them apart from
+	 * it are trimmed back.  ret_hash and ret_hash_len are set to the
+	 * fingerprint that was matched.  Only remove keys that were inserted: a
+	 * false positive removes the item it collides with.
+	 * Returns the same values as qf_remove. */
+	int qf_remove_ret(QF *qf, uint64_t key, uint64_t count, uint64_t *ret_hash,
+										int *ret_hash_len, uint8_t flags);
+	int qf_remove_ret128(QF *qf, __uint128_t key, uint64_t count, __uint128_t
+											 *ret_hash, int *ret_hash_len, uint8_t flags);
+
 	/* Remove all instances of this key. */
 	/* NOT IMPLEMENTED YET. */
 	//void qf_delete_key(QF *qf, uint64_t key);
@@ -187,9 +407,69 @@ extern "C" {
 		 key/value pair in the QF.  If it returns 0, then, the key is not
 		 present in the QF. Only returns the first value associated with key
 		 in the QF.  If you want to see others, use an iterator. 
+		 Queries never take locks.  Unless called with QF_NO_LOCK they are
+		 validated against concurrent inserts, adapts and removes and retried
+		 if one of them shifted the run meanwhile.  During an incremental
+		 resize, a query that asks for ret_index first moves its key's chunk
+		 to the new table (taking that table's locks), because indexes
+		 returned during a resize refer to the new table.
 		 May return QF_COULDNT_LOCK if called with QF_TRY_LOCK.  */
 	uint64_t qf_query(const QF *qf, uint64_t key, uint64_t *ret_index, uint64_t *ret_hash, int *ret_hash_len, uint8_t flags);
+
+	/* Same as calling qf_query(qf, keys[i], &index_out[i], &hash_out[i],
+		 &hash_len_out[i], flags) for each key, with the count in
+		 counts_out[i].  The batch is hashed up front and its keys go through
+		 a window of prefetches: the home block's metadata first, and the
+		 slots only for keys whose bucket is occupied, so negatives never
+		 touch slots.  index_out, hash_out and hash_len_out may be NULL, and
+		 are 0 for keys that aren't found.  With QF_BATCH_SORT the keys are
+		 looked up in quotient order.
+		 Return value: the number of keys found, or QF_NO_MEMORY if the batch
+		 couldn't be allocated (nothing is looked up). */
+	int64_t qf_query_batch(const QF *qf, const uint64_t *keys, uint64_t n,
+												 uint64_t *counts_out, uint64_t *index_out, uint64_t
+												 *hash_out, int *hash_len_out, uint8_t flags);
+
 	int qf_adapt(QF *qf, uint64_t index, uint64_t hash, uint64_t other_hash, uint64_t *ret_hash, uint8_t flags);
+	uint64_t qf_query128(const QF *qf, __uint128_t key, uint64_t *ret_index, __uint128_t *ret_hash, int *ret_hash_len, uint8_t flags);
+	int qf_adapt128(QF *qf, uint64_t index, __uint128_t key, __uint128_t other_key, __uint128_t *ret_hash, uint8_t flags);
+
+	/* Apply n false-positive fixes, each as if by qf_adapt(qf, indexes[i],
+		 keys[i], other_keys[i], &ret_hashes[i], flags) returning results[i].
+		 The fixes are sorted by slot and each cluster they land in is decoded
+		 and written back once, so a cluster with many fixes is shifted once.
+		 An item with several fixes is extended once, as far as the longest
+		 of them needs.  ret_hashes gets the new fingerprints, to fix up a
+		 reverse map in bulk; it and results may be NULL.  A fix whose index
+		 no longer holds an item with key's fingerprint gets QF_INVALID.
+		 Return value: the number of fixes with results[i] >= 0, or
+		 QF_NO_MEMORY if the batch couldn't be allocated (nothing is fixed)
+		 or a cluster couldn't be copied (the clusters before it are fixed,
+		 the one it failed on is left as it was). */
+	int64_t qf_adapt_batch(QF *qf, const uint64_t *indexes, const uint64_t
+												 *keys, const uint64_t *other_keys, uint64_t n,
+												 uint64_t *ret_hashes, int *results, uint8_t flags);
+
+	/* Callback for qf_query_adapt.  Stores in key the key that was inserted
+		 for the item whose first slot is index and whose stored fingerprint is
+		 hash (hash_len bits).  Returns false if the key is unknown. */
+	typedef bool (*qf_verify_fn)(void *arg, uint64_t index, uint64_t hash,
+															 int hash_len, uint64_t *key);
+
+	/* Query key and, if the matching item turns out to be a false positive,
+		 extend that item's fingerprint in place so that key stops matching
+		 it.  The inserted key of the matching item comes from verify if it
+		 is not NULL, else from the payloads or the reverse map.  The run is
+		 located once and the lock regions are held for the whole operation.
+		 ret_index, ret_hash and ret_hash_len describe the matching item after
+		 any adaptation.
+		 Return value:
+		    > 0: count of key (also returned when the item can't be verified).
+		    == 0: key is not in the QF.
+		    == QF_COULDNT_LOCK: TRY_ONCE_LOCK has failed to acquire the lock. */
+	int64_t qf_query_adapt(QF *qf, uint64_t key, uint64_t *ret_index, uint64_t
+												 *ret_hash, int *ret_hash_len, qf_verify_fn verify,
+												 void *arg, uint8_t flags);
 
 	/* Return the number of times key has been inserted, with any value,
 		 into qf. */
@@ -221,6 +501,9 @@ extern "C" {
 	enum qf_hashmode qf_get_hashmode(const QF *qf);
 	uint64_t         qf_get_hash_seed(const QF *qf);
 	__uint128_t      qf_get_hash_range(const QF *qf);
+	/* The home bucket (quotient) of key; keys in the same lock region can
+		 only collide with each other and their neighbours' regions. */
+	uint64_t         qf_get_home_bucket(const QF *qf, uint64_t key, uint8_t flags);
 
 	/* Space usage info. */
 	bool     qf_is_auto_resize_enabled(const QF *qf);
@@ -259,7 +542,9 @@ extern "C" {
 
 	/* Initialize an iterator and position it at the smallest index
 	 * containing a key-value pair whose hash is greater than or equal
-	 * to the specified key-value pair.
+	 * to the specified key-value pair.  Runs aren't kept sorted, so in the
+	 * pair's own run this is the pair itself if it is there, and otherwise
+	 * the first larger one in slot order.
 	 * Return value:
 	 *  >= 0: iterator is initialized and position at the returned slot.
 	 *   = QFI_INVALID: iterator has reached end.
@@ -326,6 +611,9 @@ extern "C" {
 
 	void qf_dump(const QF *);
 	void qf_dump_metadata(const QF *qf);
+	/* Lock acquisitions and time spent waiting, over all lock regions.
+		 Only recorded when built with -DLOG_WAIT_TIME. */
+	void qf_dump_wait_times(const QF *qf);
 
 
 #ifdef __cplusplus
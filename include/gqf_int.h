@@ -15,6 +15,7 @@
 
 #include "gqf.h"
 #include "partitioned_counter.h"
+#include "gqf_revmap.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -26,13 +27,22 @@ extern "C" {
    0 (choose size at run-time), 
    8, 16, 32, or 64 (for optimized versions),
    or other integer <= 56 (for compile-time-optimized bit-shifting-based versions)
+   8 and 16 also get a vectorized run scan in qf_query.
+   Override with -DQF_BITS_PER_SLOT=n.
 */
+#ifndef QF_BITS_PER_SLOT
 #define QF_BITS_PER_SLOT 0
+#endif
 
 /* Must be >= 6.  6 seems fastest. */
 #define QF_BLOCK_OFFSET_BITS (6)
 
 #define QF_SLOTS_PER_BLOCK (1ULL << QF_BLOCK_OFFSET_BITS)
+
+/* Default slots per lock region, and the longest cluster the locking
+   assumes (see qf_set_lock_regions). */
+#define NUM_SLOTS_TO_LOCK (1ULL<<16)
+#define CLUSTER_SIZE (1ULL<<14)
 #define QF_METADATA_WORDS_PER_BLOCK ((QF_SLOTS_PER_BLOCK + 63) / 64)
 
 	typedef struct __attribute__ ((__packed__)) qfblock {
@@ -75,6 +85,21 @@ extern "C" {
 		uint64_t locks_acquired_single_attempt;
 	} wait_time_data;
 
+	typedef struct qf_mcs_node {
+		struct qf_mcs_node *volatile next;
+		volatile int locked;
+	} qf_mcs_node;
+
+	/* The lock of one lock region, in a cache line of its own.  Which fields
+	 * are used depends on the qf_lock_kind. */
+	typedef struct __attribute__ ((aligned (64))) qf_region_lock {
+		volatile int lock;							/* QF_LOCK_TAS */
+		volatile uint32_t next_ticket;	/* QF_LOCK_TICKET */
+		volatile uint32_t now_serving;
+		qf_mcs_node *volatile tail;			/* QF_LOCK_MCS */
+		qf_mcs_node *holder;
+	} qf_region_lock;
+
 	typedef struct quotient_filter_runtime_data {
 		file_info f_info;
 		uint32_t auto_resize;
@@ -83,9 +108,30 @@ extern "C" {
 		pc_t pc_ndistinct_elts;
 		pc_t pc_noccupied_slots;
 		uint64_t num_locks;
+		uint64_t slots_per_lock;				/* slots per lock region */
+		uint64_t cluster_size;					/* longest cluster the locking assumes */
 		volatile int metadata_lock;
-		volatile int *locks;
+		enum qf_lock_kind lock_kind;
+		qf_region_lock *locks;
+		volatile uint64_t *versions;	/* seqlock version per lock region */
 		wait_time_data *wait_times;
+		rm_t *reverse_map;		/* NULL unless qf_enable_reverse_map was called */
+		uint64_t *payloads;		/* one per slot; NULL unless qf_enable_payloads was called */
+		uint64_t compact_cursor;	/* where qf_compact_extensions resumes */
+		qf_adapt_policy adapt_policy;
+		rm_t *fp_counts;			/* false positives per fingerprint, for lazy adaptation */
+		volatile int64_t ext_slots;	/* extension slots in use */
+		volatile int64_t occupancy_slack;	/* slots inserts may take before a sync */
+		/* incremental resize (see resize_start in gqf.c) */
+		QF *volatile resize_next;				/* table being migrated into */
+		QF *resize_self;								/* this table's header at the start */
+		volatile uint8_t *resize_chunks;	/* per-chunk state; NULL until writers are drained */
+		uint64_t resize_nchunks;
+		volatile uint64_t resize_cursor;	/* next chunk an insert helps with */
+		volatile uint64_t resize_done;		/* chunks migrated */
+		volatile int resize_lock;				/* serializes starting a resize */
+		volatile int retired;						/* set once the table has been replaced */
+		QF *retired_qf;									/* the table this one replaced */
 	} quotient_filter_runtime_data;
 
 	typedef quotient_filter_runtime_data qfruntime;
@@ -0,0 +1,58 @@
+#ifndef _GQF_PIPELINE_H_
+#define _GQF_PIPELINE_H_
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "gqf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A pipeline delegates all updates of a CQF to a fixed set of owner
+ * threads.  The lock regions are split into one contiguous group per
+ * owner.  Producers only hash the key to find its owner and push the
+ * operation on that owner's queue; they never touch the filter.  Each
+ * owner drains its queue in micro-batches, sorts a batch by home bucket,
+ * takes the batch's region locks once with qf_lock_buckets and applies it
+ * with QF_NO_LOCK.  Since no other owner works in its regions, those locks
+ * and the blocks behind them stay in the owner's cache; only batches at a
+ * group boundary ever wait.
+ *
+ * Queries can run concurrently with the pipeline as usual.  Auto-resize
+ * must be off: a full filter is reported through qf_pipeline_flush. */
+
+typedef struct qf_pipeline qf_pipeline;
+
+/* Start nowners owner threads (fewer if the filter has fewer lock
+ * regions) with room for queue_len pending operations each (rounded up
+ * to a power of 2).  flags is applied to every operation; only
+ * QF_KEY_IS_HASH is meaningful.  Returns NULL if something couldn't be
+ * allocated or started. */
+qf_pipeline *qf_pipeline_create(QF *qf, int nowners, uint64_t queue_len,
+																uint8_t flags);
+
+/* Queue an insert of count copies of key.  Blocks while the owner's queue
+ * is full.  Safe to call from any number of threads. */
+void qf_pipeline_insert(qf_pipeline *p, uint64_t key, uint64_t count);
+
+/* Queue a false positive: key was reported by a query but isn't the key
+ * stored there.  The owner runs qf_query_adapt on it, so the filter needs
+ * payloads or a reverse map. */
+void qf_pipeline_adapt(qf_pipeline *p, uint64_t key);
+
+/* Wait until every operation queued before the call has been applied.
+ * Returns 0, or the first error (e.g. QF_NO_SPACE) an operation hit since
+ * the last flush. */
+int qf_pipeline_flush(qf_pipeline *p);
+
+/* Drain the queues, stop the owners and free the pipeline.  The filter
+ * itself is left alone.  Returns what a final qf_pipeline_flush would. */
+int qf_pipeline_destroy(qf_pipeline *p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _GQF_PIPELINE_H_ */
@@ -0,0 +1,63 @@
+#ifndef _GQF_REVMAP_H_
+#define _GQF_REVMAP_H_
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A reverse map takes the fingerprint the CQF stores for an item (the
+ * quotient, remainder and extension bits returned in ret_hash, plus its
+ * length in bits) back to the key that was inserted.
+ *
+ * All entries live in one flat arena that is probed with linear open
+ * addressing, so a lookup touches one or two cache lines and inserting
+ * an item never calls malloc.  The arena doubles when it is 3/4 full. */
+
+typedef struct reverse_map_entry {
+	__uint128_t fingerprint;	/* up to 128 bits, see qf_insert_ret128 */
+	uint64_t key;
+	uint32_t len;			/* 0 marks an unused entry */
+} rmentry;
+
+typedef struct reverse_map {
+	rmentry *entries;
+	uint64_t capacity;	/* always a power of 2 */
+	uint64_t nentries;
+	volatile int lock;
+} reverse_map;
+
+typedef struct reverse_map rm_t;
+
+#define RM_ERROR -1
+
+/* on success returns 0.
+ * If allocation fails returns RM_ERROR
+ */
+int rm_init(rm_t *rm, uint64_t capacity);
+
+void rm_destructor(rm_t *rm);
+
+/* Adds (or overwrites) the key for fingerprint/len.
+ * If the arena can't grow returns RM_ERROR. */
+int rm_insert(rm_t *rm, __uint128_t fingerprint, uint32_t len, uint64_t key);
+
+bool rm_lookup(const rm_t *rm, __uint128_t fingerprint, uint32_t len,
+							 uint64_t *key);
+
+/* Removes the entry and returns its key in key (if key is not NULL). */
+bool rm_remove(rm_t *rm, __uint128_t fingerprint, uint32_t len, uint64_t *key);
+
+/* Moves the key stored under (old_fingerprint, old_len) to (new_fingerprint,
+ * new_len), e.g. after the CQF extended the item's fingerprint.
+ * Returns RM_ERROR if the old fingerprint was not in the map. */
+int rm_rekey(rm_t *rm, __uint128_t old_fingerprint, uint32_t old_len,
+						 __uint128_t new_fingerprint, uint32_t new_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _GQF_REVMAP_H_ */
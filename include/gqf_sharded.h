@@ -0,0 +1,68 @@
+#ifndef _GQF_SHARDED_H_
+#define _GQF_SHARDED_H_
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "gqf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A sharded filter splits the quotient space of one logical CQF between
+ * 2^k sub-filters by the top k bits of the hash, and places each shard on
+ * a NUMA node (round robin over the nodes in /sys/devices/system/node).
+ * Each shard's memory is allocated and zeroed by a thread bound to the
+ * node's CPUs, so the kernel's first-touch policy puts its pages there.
+ * A shard is an ordinary CQF whose hashes are the rest of the bits, so the
+ * sharded filter has the same false-positive rate as one filter of the
+ * same size.  Threads that mostly work on some shard's keys can be bound
+ * to its node with qf_sharded_bind_thread.
+ *
+ * Shards don't resize: a full shard returns QF_NO_SPACE. */
+
+typedef struct qf_sharded qf_sharded;
+
+/* Create a filter of nslots slots in nshards shards (rounded up to a power
+ * of 2; 0 means one per NUMA node).  The other arguments are as for
+ * qf_malloc.  Returns NULL if the shards are too small or couldn't be
+ * allocated. */
+qf_sharded *qf_sharded_create(uint64_t nslots, uint64_t key_bits, uint64_t
+															value_bits, enum qf_hashmode hash, uint32_t
+															seed, int nshards);
+
+void qf_sharded_destroy(qf_sharded *s);
+
+/* Same as qf_insert, qf_remove and qf_count_key_value, on the shard the
+ * key belongs to. */
+int qf_sharded_insert(qf_sharded *s, uint64_t key, uint64_t value, uint64_t
+											count, uint8_t flags);
+int qf_sharded_remove(qf_sharded *s, uint64_t key, uint64_t value, uint64_t
+											count, uint8_t flags);
+uint64_t qf_sharded_count_key_value(const qf_sharded *s, uint64_t key,
+																		uint64_t value, uint8_t flags);
+
+/* The shard a key/value pair belongs to. */
+int qf_sharded_shard_of(const qf_sharded *s, uint64_t key, uint64_t value,
+												uint8_t flags);
+
+int qf_sharded_num_shards(const qf_sharded *s);
+QF *qf_sharded_get_shard(const qf_sharded *s, int shard);
+
+/* The NUMA node shard was placed on. */
+int qf_sharded_node_of(const qf_sharded *s, int shard);
+
+/* Restrict the calling thread to the CPUs of shard's node.  Returns false
+ * if the affinity couldn't be set. */
+bool qf_sharded_bind_thread(const qf_sharded *s, int shard);
+
+/* Totals over all shards. */
+uint64_t qf_sharded_get_sum_of_counts(const qf_sharded *s);
+uint64_t qf_sharded_get_num_occupied_slots(const qf_sharded *s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _GQF_SHARDED_H_ */
@@ -16,6 +16,7 @@
 
 uint64_t MurmurHash64B ( const void * key, int len, unsigned int seed );
 uint64_t MurmurHash64A ( const void * key, int len, unsigned int seed );
+__uint128_t MurmurHash3_x64_128 ( const void * key, int len, unsigned int seed );
 
 uint64_t hash_64(uint64_t key, uint64_t mask);
 uint64_t hash_64i(uint64_t key, uint64_t mask);
@@ -18,10 +18,15 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
 
 #include "hashutil.h"
 #include "gqf.h"
 #include "gqf_int.h"
+#if (QF_BITS_PER_SLOT == 8 || QF_BITS_PER_SLOT == 16) && (defined(__AVX2__) || defined(__SSE2__))
+#include <immintrin.h>
+#endif
 
 /******************************************************************
  * Code for managing the metadata bits and slots w/o interpreting *
@@ -31,8 +36,8 @@
 #define MAX_VALUE(nbits) ((1ULL << (nbits)) - 1)
 #define BITMASK(nbits)                                    \
   ((nbits) == 64 ? 0xffffffffffffffff : MAX_VALUE(nbits))
-#define NUM_SLOTS_TO_LOCK (1ULL<<16)
-#define CLUSTER_SIZE (1ULL<<14)
+#define BITMASK128(nbits)                                 \
+  ((nbits) >= 128 ? ~(__uint128_t)0 : (((__uint128_t)1 << (nbits)) - 1))
 #define METADATA_WORD(qf,field,slot_index)                              \
   (get_block((qf), (slot_index) /                                       \
              QF_SLOTS_PER_BLOCK)->field[((slot_index)  % QF_SLOTS_PER_BLOCK) / 64])
@@ -57,10 +62,6 @@
 #define DEBUG_DUMP(qf) \
 	do { if (PRINT_DEBUG) qf_dump_metadata(qf); } while (0)
 
-void bp1(QF *qf, uint64_t hash_bucket_index, uint64_t hash_bucket_offset, uint64_t hash_remainder) {
-	return;
-}
-
 static __inline__ unsigned long long rdtsc(void)
 {
 	unsigned hi, lo;
@@ -68,183 +69,305 @@ static __inline__ unsigned long long rdtsc(void)
 	return ( (unsigned long long)lo)|( ((unsigned long long)hi)<<32 );
 }
 
+/* Longest run of pause instructions between attempts at a TAS lock. */
+#define QF_MAX_BACKOFF 1024
+/* Spins before a waiter yields the CPU.  Ticket and MCS locks hand the lock
+ * to one particular waiter, so a preempted waiter would otherwise stall
+ * every thread queued behind it. */
+#define QF_SPINS_BEFORE_YIELD 256
+
+static inline void qf_cpu_relax(uint32_t *spins)
+{
+	if (++*spins % QF_SPINS_BEFORE_YIELD == 0)
+		sched_yield();
+	else
+		__builtin_ia32_pause();
+}
+
+/* MCS queue nodes of the calling thread.  qf_lock_buckets and
+ * lock_for_shift can hold any number of regions at once, so each lock
+ * remembers its holder's node and nodes go back on a per-thread free list
+ * when released.  The first QF_MCS_POOL come from a per-thread array; a
+ * thread that ever holds more allocates the rest and keeps them. */
+#define QF_MCS_POOL 8
+
+static __thread qf_mcs_node qf_mcs_pool[QF_MCS_POOL];
+static __thread int qf_mcs_pool_used;
+static __thread qf_mcs_node *qf_mcs_free;
+
+static inline qf_mcs_node *mcs_node_get(void)
+{
+	qf_mcs_node *node = qf_mcs_free;
+
+	if (node != NULL)
+		qf_mcs_free = node->next;
+	else if (qf_mcs_pool_used < QF_MCS_POOL)
+		node = &qf_mcs_pool[qf_mcs_pool_used++];
+	else {
+		node = (qf_mcs_node *)malloc(sizeof(qf_mcs_node));
+		if (node == NULL) {
+			perror("Couldn't allocate memory for an MCS node.");
+			exit(EXIT_FAILURE);
+		}
+	}
+	return node;
+}
+
+static inline void mcs_node_put(qf_mcs_node *node)
+{
+	node->next = qf_mcs_free;
+	qf_mcs_free = node;
+}
+
+static inline bool tas_lock(volatile int *lock, uint8_t flag)
+{
+	uint32_t backoff = 1, spins = 0, i;
+
+	if (!__sync_lock_test_and_set(lock, 1))
+		return true;
+	if (GET_WAIT_FOR_LOCK(flag) != QF_WAIT_FOR_LOCK)
+		return false;
+	do {
+		do {
+			for (i = 0; i < backoff; i++)
+				qf_cpu_relax(&spins);
+			if (backoff < QF_MAX_BACKOFF)
+				backoff <<= 1;
+		} while (*lock);
+	} while (__sync_lock_test_and_set(lock, 1));
+	return true;
+}
+
+static inline bool ticket_lock(qf_region_lock *l, uint8_t flag)
+{
+	uint32_t ticket, spins = 0;
+
+	if (GET_WAIT_FOR_LOCK(flag) != QF_WAIT_FOR_LOCK) {
+		ticket = l->now_serving;
+		return l->next_ticket == ticket &&
+			__sync_bool_compare_and_swap(&l->next_ticket, ticket, ticket + 1);
+	}
+	ticket = __sync_fetch_and_add(&l->next_ticket, 1);
+	while (__atomic_load_n(&l->now_serving, __ATOMIC_ACQUIRE) != ticket)
+		qf_cpu_relax(&spins);
+	return true;
+}
+
+static inline bool mcs_lock(qf_region_lock *l, qf_mcs_node *node, uint8_t flag)
+{
+	qf_mcs_node *prev;
+	uint32_t spins = 0;
+
+	node->next = NULL;
+	node->locked = 1;
+	if (GET_WAIT_FOR_LOCK(flag) != QF_WAIT_FOR_LOCK)
+		return __sync_bool_compare_and_swap(&l->tail, NULL, node);
+	prev = __atomic_exchange_n(&l->tail, node, __ATOMIC_ACQ_REL);
+	if (prev != NULL) {
+		__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+		while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
+			qf_cpu_relax(&spins);
+	}
+	return true;
+}
+
+static inline void mcs_unlock(qf_region_lock *l, qf_mcs_node *node)
+{
+	qf_mcs_node *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+	uint32_t spins = 0;
+
+	if (next == NULL) {
+		if (__sync_bool_compare_and_swap(&l->tail, node, NULL))
+			return;
+		// a successor swapped itself in but hasn't linked up yet
+		while ((next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL)
+			qf_cpu_relax(&spins);
+	}
+	__atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Try to acquire the lock of region idx once and return even if the lock
+ * is busy.  If spin flag is set, then wait until the lock is available.
+ */
+static inline bool qf_spin_lock_kind(QF *qf, uint64_t idx, uint8_t flag)
+{
+	qf_region_lock *l = &qf->runtimedata->locks[idx];
+
+	switch (qf->runtimedata->lock_kind) {
+		case QF_LOCK_TICKET:
+			return ticket_lock(l, flag);
+		case QF_LOCK_MCS: {
+			qf_mcs_node *node = mcs_node_get();
+			if (!mcs_lock(l, node, flag)) {
+				mcs_node_put(node);
+				return false;
+			}
+			l->holder = node;
+			return true;
+		}
+		default:
+			return tas_lock(&l->lock, flag);
+	}
+}
+
 #ifdef LOG_WAIT_TIME
-static inline bool qf_spin_lock(QF *qf, volatile int *lock, uint64_t idx,
-																uint8_t flag)
+static inline bool qf_spin_lock(QF *qf, uint64_t idx, uint8_t flag)
 {
 	struct timespec start, end;
-	bool ret;
+	bool ret, single;
 
 	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
-	if (GET_WAIT_FOR_LOCK(flag) != QF_WAIT_FOR_LOCK) {
-		ret = !__sync_lock_test_and_set(lock, 1);
-		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	// a first attempt that succeeds counts as uncontended
+	single = qf_spin_lock_kind(qf, idx, flag & ~QF_WAIT_FOR_LOCK);
+	ret = single || (GET_WAIT_FOR_LOCK(flag) == QF_WAIT_FOR_LOCK &&
+									 qf_spin_lock_kind(qf, idx, flag));
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	if (single) {
 		qf->runtimedata->wait_times[idx].locks_acquired_single_attempt++;
 		qf->runtimedata->wait_times[idx].total_time_single += BILLION * (end.tv_sec -
 																												start.tv_sec) +
 			end.tv_nsec - start.tv_nsec;
-	} else {
-		if (!__sync_lock_test_and_set(lock, 1)) {
-			clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
-			qf->runtimedata->wait_times[idx].locks_acquired_single_attempt++;
-			qf->runtimedata->wait_times[idx].total_time_single += BILLION * (end.tv_sec -
+	} else if (ret) {
+		qf->runtimedata->wait_times[idx].total_time_spinning += BILLION * (end.tv_sec -
 																													start.tv_sec) +
 			end.tv_nsec - start.tv_nsec;
-		} else {
-			while (__sync_lock_test_and_set(lock, 1))
-				while (*lock);
-			clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
-			qf->runtimedata->wait_times[idx].total_time_spinning += BILLION * (end.tv_sec -
-																														start.tv_sec) +
-				end.tv_nsec - start.tv_nsec;
-		}
-		ret = true;
 	}
-	qf->runtimedata->wait_times[idx].locks_taken++;
+	if (ret)
+		qf->runtimedata->wait_times[idx].locks_taken++;
 
 	return ret;
-
-	/*start = rdtsc();*/
-	/*if (!__sync_lock_test_and_set(lock, 1)) {*/
-		/*clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);*/
-		/*qf->runtimedata->wait_times[idx].locks_acquired_single_attempt++;*/
-		/*qf->runtimedata->wait_times[idx].total_time_single += BILLION * (end.tv_sec -
-		 * start.tv_sec) + end.tv_nsec - start.tv_nsec;*/
-	/*} else {*/
-		/*while (__sync_lock_test_and_set(lock, 1))*/
-			/*while (*lock);*/
-		/*clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);*/
-		/*qf->runtimedata->wait_times[idx].total_time_spinning += BILLION * (end.tv_sec -
-		 * start.tv_sec) + end.tv_nsec - start.tv_nsec;*/
-	/*}*/
-
-	/*end = rdtsc();*/
-	/*qf->runtimedata->wait_times[idx].locks_taken++;*/
-	/*return;*/
 }
 #else
-/**
- * Try to acquire a lock once and return even if the lock is busy.
- * If spin flag is set, then spin until the lock is available.
- */
-static inline bool qf_spin_lock(volatile int *lock, uint8_t flag)
+static inline bool qf_spin_lock(QF *qf, uint64_t idx, uint8_t flag)
 {
-	if (GET_WAIT_FOR_LOCK(flag) != QF_WAIT_FOR_LOCK) {
-		return !__sync_lock_test_and_set(lock, 1);
-	} else {
-		while (__sync_lock_test_and_set(lock, 1))
-			while (*lock);
-		return true;
+	return qf_spin_lock_kind(qf, idx, flag);
+}
+#endif
+
+static inline void qf_spin_unlock(QF *qf, uint64_t idx)
+{
+	qf_region_lock *l = &qf->runtimedata->locks[idx];
+
+	switch (qf->runtimedata->lock_kind) {
+		case QF_LOCK_TICKET:
+			__atomic_store_n(&l->now_serving, l->now_serving + 1, __ATOMIC_RELEASE);
+			break;
+		case QF_LOCK_MCS: {
+			qf_mcs_node *node = l->holder;
+			mcs_unlock(l, node);
+			mcs_node_put(node);
+			break;
+		}
+		default:
+			__sync_lock_release(&l->lock);
+			break;
 	}
+}
 
-	return false;
+static inline uint64_t lock_region(const QF *qf, uint64_t slot)
+{
+	uint64_t region = slot >> __builtin_ctzll(qf->runtimedata->slots_per_lock);
+	return region < qf->runtimedata->num_locks ? region :
+		qf->runtimedata->num_locks - 1;
 }
-#endif
 
-static inline void qf_spin_unlock(volatile int *lock)
+/* The lock regions qf_lock takes for hash_bucket_index: its own, and
+ * (unless small) every region within cluster_size slots of it, which is
+ * where removes and batches under qf_lock_buckets can reach. */
+static inline void lock_region_range(const QF *qf, uint64_t hash_bucket_index,
+																		 bool small, uint64_t *first, uint64_t
+																		 *last)
 {
-	__sync_lock_release(lock);
-	return;
+	uint64_t cluster_size = qf->runtimedata->cluster_size;
+	uint64_t region = lock_region(qf, hash_bucket_index);
+
+	*first = region;
+	*last = lock_region(qf, hash_bucket_index + cluster_size);
+	if (!small) {
+		if (*last == region)
+			*last = lock_region(qf, (region + 1) * qf->runtimedata->slots_per_lock);
+		if (hash_bucket_index > cluster_size)
+			*first = lock_region(qf, hash_bucket_index - cluster_size - 1);
+	}
 }
 
-static bool qf_lock(QF *qf, uint64_t hash_bucket_index, bool small, uint8_t
-										runtime_lock)
+/* Every lock region has a seqlock version.  The lock holder makes it odd
+ * before shifting any slots in the region and even again before releasing
+ * the lock, so lock-free readers can tell that what they read was torn. */
+static inline void bump_versions(QF *qf, uint64_t first, uint64_t last)
 {
-	uint64_t hash_bucket_lock_offset  = hash_bucket_index % NUM_SLOTS_TO_LOCK;
-	if (small) {
-#ifdef LOG_WAIT_TIME
-		if (!qf_spin_lock(qf, &qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK],
-											hash_bucket_index/NUM_SLOTS_TO_LOCK,
-											runtime_lock))
-			return false;
-		if (NUM_SLOTS_TO_LOCK - hash_bucket_lock_offset <= CLUSTER_SIZE) {
-			if (!qf_spin_lock(qf, &qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK+1],
-												hash_bucket_index/NUM_SLOTS_TO_LOCK+1,
-												runtime_lock)) {
-				qf_spin_unlock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK]);
-				return false;
-			}
-		}
-#else
-		if (!qf_spin_lock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK],
-											runtime_lock))
-			return false;
-		if (NUM_SLOTS_TO_LOCK - hash_bucket_lock_offset <= CLUSTER_SIZE) {
-			if (!qf_spin_lock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK+1],
-												runtime_lock)) {
-				qf_spin_unlock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK]);
-				return false;
-			}
-		}
-#endif
-	} else {
-#ifdef LOG_WAIT_TIME
-		if (hash_bucket_index >= NUM_SLOTS_TO_LOCK && hash_bucket_lock_offset <=
-				CLUSTER_SIZE) {
-			if (!qf_spin_lock(qf,
-												&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK-1],
-												runtime_lock))
-				return false;
-		}
-		if (!qf_spin_lock(qf,
-											&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK],
-											runtime_lock)) {
-			if (hash_bucket_index >= NUM_SLOTS_TO_LOCK && hash_bucket_lock_offset <=
-					CLUSTER_SIZE)
-				qf_spin_unlock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK-1]);
-			return false;
-		}
-		if (!qf_spin_lock(qf, &qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK+1],
-											runtime_lock)) {
-			qf_spin_unlock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK]);
-			if (hash_bucket_index >= NUM_SLOTS_TO_LOCK && hash_bucket_lock_offset <=
-					CLUSTER_SIZE)
-				qf_spin_unlock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK-1]);
-			return false;
-		}
-#else
-		if (hash_bucket_index >= NUM_SLOTS_TO_LOCK && hash_bucket_lock_offset <=
-				CLUSTER_SIZE) {
-			if
-				(!qf_spin_lock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK-1],
-											 runtime_lock))
-				return false;
-		}
-		if (!qf_spin_lock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK],
-											runtime_lock)) {
-			if (hash_bucket_index >= NUM_SLOTS_TO_LOCK && hash_bucket_lock_offset <=
-					CLUSTER_SIZE)
-				qf_spin_unlock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK-1]);
-			return false;
-		}
-		if (!qf_spin_lock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK+1],
-											runtime_lock)) {
-			qf_spin_unlock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK]);
-			if (hash_bucket_index >= NUM_SLOTS_TO_LOCK && hash_bucket_lock_offset <=
-					CLUSTER_SIZE)
-				qf_spin_unlock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK-1]);
+	volatile uint64_t *versions = qf->runtimedata->versions;
+	uint64_t i;
+
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	for (i = first; i <= last; i++)
+		__atomic_store_n(&versions[i], versions[i] + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/* Lock regions first..last.  Everyone locks in ascending order. */
+static bool lock_regions(QF *qf, uint64_t first, uint64_t last, uint8_t
+												 runtime_lock)
+{
+	uint64_t i;
+
+	for (i = first; i <= last; i++) {
+		if (!qf_spin_lock(qf, i, runtime_lock)) {
+			while (i-- > first)
+				qf_spin_unlock(qf, i);
 			return false;
 		}
-#endif
 	}
+	bump_versions(qf, first, last);
 	return true;
 }
 
-static void qf_unlock(QF *qf, uint64_t hash_bucket_index, bool small)
+static void unlock_regions(QF *qf, uint64_t first, uint64_t last)
 {
-	uint64_t hash_bucket_lock_offset  = hash_bucket_index % NUM_SLOTS_TO_LOCK;
-	if (small) {
-		if (NUM_SLOTS_TO_LOCK - hash_bucket_lock_offset <= CLUSTER_SIZE) {
-			qf_spin_unlock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK+1]);
-		}
-		qf_spin_unlock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK]);
-	} else {
-		qf_spin_unlock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK+1]);
-		qf_spin_unlock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK]);
-		if (hash_bucket_index >= NUM_SLOTS_TO_LOCK && hash_bucket_lock_offset <=
-				CLUSTER_SIZE)
-			qf_spin_unlock(&qf->runtimedata->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK-1]);
+	uint64_t i;
+
+	bump_versions(qf, first, last);
+	for (i = last + 1; i-- > first; )
+		qf_spin_unlock(qf, i);
+}
+
+/* Set when this thread's last lock attempt backed off for a resize. */
+static __thread bool qf_resize_backoff;
+
+/* Once a resize has started the table is read-only: writers that got
+ * this far before it started back off here, and their callers retry on
+ * the new table (see resize_retry). */
+static inline bool resizing(const QF *qf)
+{
+	if (__atomic_load_n(&qf->runtimedata->resize_next, __ATOMIC_ACQUIRE) ==
+			NULL)
+		return false;
+	qf_resize_backoff = true;
+	return true;
+}
+
+static bool qf_lock(QF *qf, uint64_t hash_bucket_index, bool small, uint8_t
+										runtime_lock)
+{
+	uint64_t first, last;
+
+	lock_region_range(qf, hash_bucket_index, small, &first, &last);
+	if (!lock_regions(qf, first, last, runtime_lock))
+		return false;
+	if (resizing(qf)) {
+		unlock_regions(qf, first, last);
+		return false;
 	}
+	return true;
+}
+
+static void qf_unlock(QF *qf, uint64_t hash_bucket_index, bool small)
+{
+	uint64_t first, last;
+
+	lock_region_range(qf, hash_bucket_index, small, &first, &last);
+	unlock_regions(qf, first, last);
 }
 
 /*static void modify_metadata(QF *qf, uint64_t *metadata, int cnt)*/
@@ -266,8 +389,66 @@ static void modify_metadata(pc_t *metadata, int cnt)
 	return;
 }
 
+/* Inserts stop at 95% occupancy, but syncing the partitioned counters on
+ * every insert costs more than the insert.  The filter instead keeps a
+ * pool of slots that inserts may still take, which each insert draws its
+ * slots from.  Once it runs dry the counters are synced and the pool is
+ * refilled with half the slack left, which leaves room for the inserts
+ * already under way, so close to the limit every insert syncs them. */
+static bool below_max_occupancy(const QF *qf, uint64_t slots)
+{
+	qfruntime *rt = qf->runtimedata;
+	int64_t limit = qf->metadata->nslots * 0.95;
+
+	if (__atomic_sub_fetch(&rt->occupancy_slack, slots, __ATOMIC_RELAXED) >= 0)
+		return true;
+	int64_t slack = limit - (int64_t)qf_get_num_occupied_slots(qf);
+	if (slack < (int64_t)slots)
+		return false;
+	__atomic_store_n(&rt->occupancy_slack, (slack - slots) / 2,
+									 __ATOMIC_RELAXED);
+	return true;
+}
+
+/* Rank/select kernels the host CPU can run.  Chosen once at load time, so
+ * a single binary uses pdep/tzcnt on BMI2 machines and still runs on hosts
+ * without POPCNT.  The kernels below branch on this rather than calling
+ * through pointers so they stay inlined into run_end and friends. */
+enum qf_cpu_level {
+	QF_CPU_PORTABLE = 0,
+	QF_CPU_POPCNT,
+	QF_CPU_BMI2
+};
+
+static int qf_cpu_level = QF_CPU_PORTABLE;
+
+__attribute__((constructor))
+static void qf_detect_cpu(void)
+{
+	int level = QF_CPU_PORTABLE;
+
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("popcnt")) {
+		level = QF_CPU_POPCNT;
+		if (__builtin_cpu_supports("bmi2"))
+			level = QF_CPU_BMI2;
+	}
+	qf_cpu_level = level;
+}
+
+/* Branch-free SWAR popcount for hosts without the instruction. */
+static inline int popcnt_portable(uint64_t val)
+{
+	val = val - ((val >> 1) & 0x5555555555555555ULL);
+	val = (val & 0x3333333333333333ULL) + ((val >> 2) & 0x3333333333333333ULL);
+	val = (val + (val >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return (val * 0x0101010101010101ULL) >> 56;
+}
+
 static inline int popcnt(uint64_t val)
 {
+	if (qf_cpu_level == QF_CPU_PORTABLE)
+		return popcnt_portable(val);
 	asm("popcnt %[val], %[val]"
 			: [val] "+r" (val)
 			:
@@ -300,11 +481,7 @@ static inline int popcntv(const uint64_t val, int ignore)
 // Bits are numbered from 0
 static inline int bitrank(uint64_t val, int pos) {
 	val = val & ((2ULL << pos) - 1);
-	asm("popcnt %[val], %[val]"
-			: [val] "+r" (val)
-			:
-			: "cc");
-	return val;
+	return popcnt(val);
 }
 
 /**
@@ -430,12 +607,12 @@ static inline uint64_t _select64(uint64_t x, int k)
 // Returns the position of the rank'th 1.  (rank = 0 returns the 1st 1)
 // Returns 64 if there are fewer than rank+1 1s.
 static inline uint64_t bitselect(uint64_t val, int rank) {
-#ifdef __SSE4_2_
-	uint64_t i = 1ULL << rank;
-	asm("pdep %[val], %[mask], %[val]" : [val] "+r" (val) : [mask] "r" (i));
-	asm("tzcnt %[bit], %[index]" : [index] "=r" (i) : [bit] "g" (val) : "cc");
-	return i;
-#endif
+	if (qf_cpu_level == QF_CPU_BMI2) {
+		uint64_t i = 1ULL << rank;
+		asm("pdep %[val], %[mask], %[val]" : [val] "+r" (val) : [mask] "r" (i));
+		asm("tzcnt %[bit], %[index]" : [index] "=r" (i) : [bit] "g" (val) : "cc");
+		return i;
+	}
 	return _select64(val, rank);
 }
 
@@ -577,6 +754,14 @@ static inline void set_slot(const QF *qf, uint64_t index, uint64_t value)
 
 static inline uint64_t run_end(const QF *qf, uint64_t hash_bucket_index);
 
+/* Runend bits of the items in a block.  Counter slots also carry a runend
+ * bit (with their extension bit), which must not be counted as the end of a
+ * run. */
+static inline uint64_t item_runends(const qfblock *b)
+{
+	return b->runends[0] & ~b->extensions[0];
+}
+
 static inline uint64_t block_offset(const QF *qf, uint64_t blockidx)
 {
 	/* If we have extended counters and a 16-bit (or larger) offset
@@ -609,7 +794,7 @@ static inline uint64_t run_end(const QF *qf, uint64_t hash_bucket_index)
 		QF_SLOTS_PER_BLOCK;
 	uint64_t runend_ignore_bits  = bucket_blocks_offset % QF_SLOTS_PER_BLOCK;
 	uint64_t runend_rank         = bucket_intrablock_rank - 1;
-	uint64_t runend_block_offset = bitselectv(get_block(qf, runend_block_index)->runends[0], runend_ignore_bits, runend_rank);
+	uint64_t runend_block_offset = bitselectv(item_runends(get_block(qf, runend_block_index)), runend_ignore_bits, runend_rank);
 	if (runend_block_offset == QF_SLOTS_PER_BLOCK) {
 		if (bucket_blocks_offset == 0 && bucket_intrablock_rank == 0) {
 			/* The block begins in empty space, and this bucket is in that region of
@@ -617,38 +802,35 @@ static inline uint64_t run_end(const QF *qf, uint64_t hash_bucket_index)
 			return hash_bucket_index;
 		} else {
 			do {
-				runend_rank        -= popcntv(get_block(qf, runend_block_index)->runends[0], runend_ignore_bits);
+				runend_rank        -= popcntv(item_runends(get_block(qf, runend_block_index)), runend_ignore_bits);
 				runend_block_index++;
 				runend_ignore_bits  = 0;
-				runend_block_offset = bitselectv(get_block(qf, runend_block_index)->runends[0], runend_ignore_bits, runend_rank);
+				runend_block_offset = bitselectv(item_runends(get_block(qf, runend_block_index)), runend_ignore_bits, runend_rank);
 			} while (runend_block_offset == QF_SLOTS_PER_BLOCK);
 		}
 	}
 
 	uint64_t runend_index = QF_SLOTS_PER_BLOCK * runend_block_index + runend_block_offset;
+	// the run ends with its last item's extension and counter slots, which
+	// may spill past hash_bucket_index
+	while (is_extension(qf, runend_index + 1)) runend_index++;
+	while (is_counter(qf, runend_index + 1)) runend_index++;
 	if (runend_index < hash_bucket_index)
 		return hash_bucket_index;
-	else {
-    while (is_extension(qf, runend_index + 1)) runend_index++;
-    while (is_counter(qf, runend_index + 1)) runend_index++;
+	else
 		return runend_index;
-  }
 }
 
 static inline int offset_lower_bound(const QF *qf, uint64_t slot_index)
 {
 	//printf("%lu\n", slot_index);
-	/*if (slot_index == 613616636) {
-		bp1(qf, 0, 0, 0);
-		return 0;
-	}*/
 	const qfblock * b = get_block(qf, slot_index / QF_SLOTS_PER_BLOCK);
 	const uint64_t slot_offset = slot_index % QF_SLOTS_PER_BLOCK;
 	const uint64_t boffset = b->offset;
 	const uint64_t occupieds = b->occupieds[0] & BITMASK(slot_offset+1);
 	assert(QF_SLOTS_PER_BLOCK == 64);
 	if (boffset <= slot_offset) {
-		const uint64_t runends = (b->runends[0] & ~(b->extensions[0]) & BITMASK(slot_offset)) >> boffset;
+		const uint64_t runends = (item_runends(b) & BITMASK(slot_offset)) >> boffset;
 		//const uint64_t runends = (b->runends[0] & BITMASK(slot_offset)) >> boffset;
 		return popcnt(occupieds) - popcnt(runends);
 	}
@@ -706,6 +888,84 @@ uint64_t find_first_test(QF *qf, uint64_t from) {
 	return find_first_empty_slot(qf, from);
 }
 
+/* Same as find_first_empty_slot, but never looks at slots from limit on.
+ * Returns limit if there is no empty slot before it. */
+static inline uint64_t find_first_empty_slot_before(QF *qf, uint64_t from,
+																										uint64_t limit)
+{
+	do {
+		while (from < limit && is_extension(qf, from)) from++;
+		while (from < limit && is_counter(qf, from)) from++;
+		if (from >= limit)
+			return limit;
+		int t = offset_lower_bound(qf, from);
+		if (t <= 0)
+			break;
+		from = from + t;
+	} while(1);
+	return from;
+}
+
+/* How many slots an operation on an item with hash_bits of hash can add:
+ * its remainder, counter slots for count, and extension slots for it and
+ * the item it collides with. */
+static inline uint64_t shift_slots_bound(const QF *qf, uint64_t count, int
+																				 hash_bits)
+{
+	const uint64_t bits_per_slot = qf->metadata->bits_per_slot;
+	const uint64_t base_bits = qf->metadata->quotient_bits + bits_per_slot;
+	uint64_t ext_slots = hash_bits > (int)base_bits ? (hash_bits - base_bits +
+																									 bits_per_slot - 1) /
+		bits_per_slot : 0;
+	uint64_t count_slots = 1;
+
+	while (count >>= bits_per_slot)
+		count_slots++;
+	return 1 + 2 * ext_slots + count_slots;
+}
+
+/* Lock what an operation that adds up to nslots slots at or after
+ * hash_bucket_index needs: the region of the bucket before it (whose run
+ * end tells where the bucket's run starts), plus every region up to the
+ * nslots'th empty slot, since that is how far the shifts can reach.
+ * Nothing before the bucket is written, so unlike qf_lock this doesn't
+ * depend on cluster_size.  The search only reads regions already held; when it
+ * runs off the end it takes the next region (still in ascending order)
+ * and starts over.  On failure nothing is held.  Release with
+ * unlock_regions(qf, *first, *last). */
+static bool lock_for_shift(QF *qf, uint64_t hash_bucket_index, uint64_t
+													 nslots, uint8_t flags, uint64_t *first, uint64_t
+													 *last)
+{
+	uint64_t xnslots = qf->metadata->xnslots;
+
+	*first = lock_region(qf, hash_bucket_index > 0 ? hash_bucket_index - 1 : 0);
+	*last = lock_region(qf, hash_bucket_index);
+	if (!lock_regions(qf, *first, *last, flags))
+		return false;
+	if (resizing(qf)) {
+		unlock_regions(qf, *first, *last);
+		return false;
+	}
+
+	while (true) {
+		uint64_t limit = (*last + 1) * qf->runtimedata->slots_per_lock;
+		uint64_t end = hash_bucket_index, i;
+		if (limit > xnslots)
+			limit = xnslots;
+		for (i = 0; i < nslots && end < limit; i++)
+			end = find_first_empty_slot_before(qf, end, limit) + 1;
+		// found them all, or the filter is full here and the caller will say so
+		if ((i == nslots && end <= limit) || limit == xnslots)
+			return true;
+		if (!lock_regions(qf, *last + 1, *last + 1, flags)) {
+			unlock_regions(qf, *first, *last);
+			return false;
+		}
+		(*last)++;
+	}
+}
+
 static inline uint64_t shift_into_b(const uint64_t a, const uint64_t b, const int bstart, const int bend, const int amount)
 {
 	const uint64_t a_component = bstart == 0 ? (a >> (64 - amount)) : 0;
@@ -715,6 +975,18 @@ static inline uint64_t shift_into_b(const uint64_t a, const uint64_t b, const in
 	return a_component | b_shifted | (b & b_mask);
 }
 
+/* Move the payloads of slots [first, last] distance slots to the right so
+ * they stay with their remainders. */
+static inline void shift_payloads(QF *qf, uint64_t first, uint64_t last,
+																	uint64_t distance)
+{
+	uint64_t *payloads = qf->runtimedata->payloads;
+	if (payloads == NULL || last + 1 <= first)
+		return;
+	memmove(&payloads[first + distance], &payloads[first],
+					(last + 1 - first) * sizeof(payloads[0]));
+}
+
 #if QF_BITS_PER_SLOT == 8 || QF_BITS_PER_SLOT == 16 || QF_BITS_PER_SLOT == 32 || QF_BITS_PER_SLOT == 64
 
 static inline void shift_remainders(QF *qf, uint64_t start_index, uint64_t empty_index)
@@ -726,6 +998,8 @@ static inline void shift_remainders(QF *qf, uint64_t start_index, uint64_t empty
 
 	assert (start_index <= empty_index && empty_index < qf->metadata->xnslots);
 
+	shift_payloads(qf, start_index, empty_index - 1, 1);
+
 	while (start_block < empty_block) {
 		memmove(&get_block(qf, empty_block)->slots[1], 
 						&get_block(qf, empty_block)->slots[0],
@@ -752,6 +1026,8 @@ static inline void shift_remainders(QF *qf, const uint64_t start_index, const ui
 	int bend = ((empty_index + 1) * qf->metadata->bits_per_slot) % 64;
 	const int bstart = (start_index * qf->metadata->bits_per_slot) % 64;
 
+	shift_payloads(qf, start_index, empty_index - 1, 1);
+
 	while (last_word != first_word) {
 		*REMAINDER_WORD(qf, last_word) = shift_into_b(*REMAINDER_WORD(qf, last_word-1), *REMAINDER_WORD(qf, last_word), 0, bend, qf->metadata->bits_per_slot);
 		last_word--;
@@ -810,6 +1086,28 @@ void qf_dump_metadata(const QF *qf) {
 				 qf->metadata->bits_per_slot);
 }
 
+void qf_dump_wait_times(const QF *qf)
+{
+	static const char *names[] = { "tas", "ticket", "mcs" };
+	printf("Lock kind: %s\n", names[qf->runtimedata->lock_kind]);
+#ifdef LOG_WAIT_TIME
+	uint64_t taken = 0, single = 0, time_single = 0, time_spinning = 0, i;
+	for (i = 0; i < qf->runtimedata->num_locks; i++) {
+		taken += qf->runtimedata->wait_times[i].locks_taken;
+		single += qf->runtimedata->wait_times[i].locks_acquired_single_attempt;
+		time_single += qf->runtimedata->wait_times[i].total_time_single;
+		time_spinning += qf->runtimedata->wait_times[i].total_time_spinning;
+	}
+	printf("Locks taken: %lu First attempt: %lu Contended: %lu\n", taken, single,
+				 taken - single);
+	printf("Avg ns uncontended: %.1f Avg ns contended: %.1f\n",
+				 single ? (double)time_single / single : 0.0,
+				 taken > single ? (double)time_spinning / (taken - single) : 0.0);
+#else
+	printf("Build with -DLOG_WAIT_TIME to record lock wait times.\n");
+#endif
+}
+
 void qf_dump(const QF *qf)
 {
 	uint64_t i;
@@ -842,9 +1140,11 @@ static inline void shift_slots(QF *qf, int64_t first, uint64_t last, uint64_t di
 	int64_t i;
 	if (distance == 1)
 		shift_remainders(qf, first, last+1);
-	else
+	else {
 		for (i = last; i >= first; i--)
 			set_slot(qf, i + distance, get_slot(qf, i));
+		shift_payloads(qf, first, last, distance);
+	}
 }
 
 static inline void shift_runends(QF *qf, int64_t first, uint64_t last, uint64_t distance)
@@ -868,6 +1168,14 @@ static inline void shift_runends(QF *qf, int64_t first, uint64_t last, uint64_t
 	}
 	METADATA_WORD(qf, runends, 64*last_word) = shift_into_b(0, METADATA_WORD(qf, runends, 64*last_word), bstart, bend, distance);
 	METADATA_WORD(qf, extensions, 64*last_word) = shift_into_b(0, METADATA_WORD(qf, extensions, 64*last_word), bstart, bend, distance);
+
+	// When the vacated slots straddle a word boundary, shift_into_b pulls the
+	// bits of the slots just before first into the next word, so clear them.
+	uint64_t i;
+	for (i = first; i < first + distance; i++) {
+		METADATA_WORD(qf, runends, i) &= ~(1ULL << (i % 64));
+		METADATA_WORD(qf, extensions, i) &= ~(1ULL << (i % 64));
+	}
 }
 
 static inline bool make_space(QF *qf, uint64_t insert_index, int ninserts)
@@ -1020,6 +1328,9 @@ static inline int remove_replace_slots_and_shift_remainders_and_runends_and_offs
 
 		if (current_bucket <= current_slot) {
 			set_slot(qf, current_slot, get_slot(qf, current_slot + current_distance));
+			if (qf->runtimedata->payloads != NULL)
+				qf->runtimedata->payloads[current_slot] =
+					qf->runtimedata->payloads[current_slot + current_distance];
 			if (is_runend(qf, current_slot) != 
 					is_runend(qf, current_slot + current_distance))
 				METADATA_WORD(qf, runends, current_slot) ^= 1ULL << (current_slot % 64);
@@ -1080,43 +1391,230 @@ static inline int remove_replace_slots_and_shift_remainders_and_runends_and_offs
 	return ret_current_distance;
 }
 
-/*****************************************************************************
- * Code that uses the above to implement a QF with keys and inline counters. *
- *****************************************************************************/
+/* Decoding and re-encoding whole clusters.  An item is its remainder slot
+ * followed by its extension and counter slots, and the runend bit sits on
+ * the first slot of a run's last item, so dropping slots from the middle of
+ * a cluster can't be done with the shifts above.  Instead the cluster is
+ * decoded into one record per slot, the records are edited, and the cluster
+ * is written back from its first slot, which also rebuilds the runend,
+ * extension and occupied bits and the offsets of the blocks it spans. */
+
+enum cluster_slot_kind {
+	CS_REMAINDER,
+	CS_EXTENSION,
+	CS_COUNTER,
+	CS_DROPPED		/* skipped by cluster_encode */
+};
 
-/* 
-	 Counter format:
-	 0 xs:    <empty string>
-	 1 x:     x
-	 2 xs:    xx
-	 3 0s:    000
-	 >2 xs:   xbc...cx  for x != 0, b < x, c != 0, x
-	 >3 0s:   0c...c00  for c != 0
-	 */ // Note: not needed anymore for the new implementation of counters
-// slots is the address of the back of the array
-// remainder + counter are written into the array right to left
-// returns the address of the start of the remainder + counter
-static inline uint64_t *encode_counter(QF *qf, uint64_t remainder, uint64_t counter, uint64_t *slots)
+typedef struct cluster_slot {
+	uint64_t value;
+	uint64_t payload;
+	uint64_t bucket;	/* home bucket of the item the slot belongs to */
+	uint8_t kind;
+} cluster_slot;
+
+typedef struct qf_cluster {
+	uint64_t start;		/* first slot of the cluster */
+	uint64_t end;			/* last slot of the cluster when it was decoded */
+	uint64_t len;			/* number of records in slots */
+	uint64_t capacity;
+	cluster_slot *slots;
+} qf_cluster;
+
+static inline bool slot_is_free(const QF *qf, uint64_t index)
 {
-	uint64_t digit = remainder;
-	uint64_t base = (1ULL << qf->metadata->bits_per_slot) - 1;
-	uint64_t *p = slots;
-
-	if (counter == 0)
-		return p;
-
-	*--p = remainder;
+	return is_empty(qf, index) && !is_extension(qf, index) && !is_counter(qf,
+																																			 index);
+}
 
-	if (counter == 1)
-		return p;
+/* First slot of the cluster that holds slot index. */
+static inline uint64_t cluster_start(const QF *qf, uint64_t index)
+{
+	while (index > 0 && !slot_is_free(qf, index - 1))
+		index--;
+	return index;
+}
 
-	if (counter == 2) {
-		*--p = remainder;
-		return p;
+static bool cluster_push(qf_cluster *c, uint64_t value, uint64_t payload,
+												 uint64_t bucket, uint8_t kind)
+{
+	if (c->len == c->capacity) {
+		uint64_t capacity = c->capacity ? 2 * c->capacity : QF_SLOTS_PER_BLOCK;
+		cluster_slot *slots = (cluster_slot *)realloc(c->slots, capacity *
+																									sizeof(cluster_slot));
+		if (slots == NULL) {
+			perror("Couldn't allocate memory for a cluster.");
+			return false;
+		}
+		c->slots = slots;
+		c->capacity = capacity;
 	}
+	c->slots[c->len].value = value;
+	c->slots[c->len].payload = payload;
+	c->slots[c->len].bucket = bucket;
+	c->slots[c->len].kind = kind;
+	c->len++;
+	return true;
+}
 
-	if (counter == 3 && remainder == 0) {
-		*--p = remainder;
+/* Decode the cluster that starts at slot start (see cluster_start). */
+static bool cluster_decode(const QF *qf, uint64_t start, qf_cluster *c)
+{
+	const uint64_t *payloads = qf->runtimedata->payloads;
+	uint64_t pos = start, bucket;
+
+	c->start = start;
+	c->len = 0;
+	for (bucket = start; bucket < qf->metadata->xnslots; bucket++) {
+		if (!is_occupied(qf, bucket)) {
+			if (bucket >= pos)
+				break;
+			continue;
+		}
+		// the run of bucket starts right after the previous run
+		bool last_item;
+		do {
+			last_item = is_runend(qf, pos);
+			if (!cluster_push(c, get_slot(qf, pos), payloads ? payloads[pos] : 0,
+												bucket, CS_REMAINDER))
+				return false;
+			pos++;
+			while (pos < qf->metadata->xnslots && is_extension(qf, pos)) {
+				if (!cluster_push(c, get_slot(qf, pos), 0, bucket, CS_EXTENSION))
+					return false;
+				pos++;
+			}
+			while (pos < qf->metadata->xnslots && is_counter(qf, pos)) {
+				if (!cluster_push(c, get_slot(qf, pos), 0, bucket, CS_COUNTER))
+					return false;
+				pos++;
+			}
+		} while (!last_item && pos < qf->metadata->xnslots);
+	}
+	c->end = pos - 1;
+	return true;
+}
+
+/* Zero the slots first..last and their runend and extension bits. */
+static void clear_slots(QF *qf, uint64_t first, uint64_t last)
+{
+	uint64_t i;
+	for (i = first; i <= last; i++) {
+		set_slot(qf, i, 0);
+		if (qf->runtimedata->payloads != NULL)
+			qf->runtimedata->payloads[i] = 0;
+		METADATA_WORD(qf, runends, i) &= ~(1ULL << (i % 64));
+		METADATA_WORD(qf, extensions, i) &= ~(1ULL << (i % 64));
+	}
+}
+
+/* Write the cluster back, dropping CS_DROPPED records and clearing the slots
+ * it no longer covers.  Buckets that lost their last item lose their
+ * occupied bit.  Returns the number of slots freed. */
+static uint64_t cluster_encode(QF *qf, qf_cluster *c)
+{
+	uint64_t *payloads = qf->runtimedata->payloads;
+	uint64_t i, j, n = 0;
+
+	for (i = 0; i < c->len; i++)
+		if (c->slots[i].kind != CS_DROPPED)
+			c->slots[n++] = c->slots[i];
+	c->len = n;
+
+	for (i = c->start; i <= c->end; i++)
+		if (is_occupied(qf, i))
+			METADATA_WORD(qf, occupieds, i) &= ~(1ULL << (i % 64));
+	for (i = c->start / QF_SLOTS_PER_BLOCK + 1; i <= c->end / QF_SLOTS_PER_BLOCK;
+			 i++)
+		get_block(qf, i)->offset = 0;
+
+	uint64_t pos = c->start;
+	for (i = 0; i < c->len; i++) {
+		const cluster_slot *cs = &c->slots[i];
+		bool runend = false;
+		if (cs->kind == CS_REMAINDER) {
+			if (i == 0 || cs->bucket != c->slots[i - 1].bucket) {
+				// the cluster may have split; leave a gap up to the home bucket
+				if (pos < cs->bucket) {
+					clear_slots(qf, pos, cs->bucket - 1);
+					pos = cs->bucket;
+				}
+				METADATA_WORD(qf, occupieds, cs->bucket) |= 1ULL << (cs->bucket % 64);
+			}
+			for (j = i + 1; j < c->len && c->slots[j].kind != CS_REMAINDER; j++);
+			runend = j == c->len || c->slots[j].bucket != cs->bucket;
+		}
+		set_slot(qf, pos, cs->value);
+		if (payloads != NULL)
+			payloads[pos] = cs->kind == CS_REMAINDER ? cs->payload : 0;
+		if (runend || cs->kind == CS_COUNTER)
+			METADATA_WORD(qf, runends, pos) |= 1ULL << (pos % 64);
+		else
+			METADATA_WORD(qf, runends, pos) &= ~(1ULL << (pos % 64));
+		if (cs->kind != CS_REMAINDER)
+			METADATA_WORD(qf, extensions, pos) |= 1ULL << (pos % 64);
+		else
+			METADATA_WORD(qf, extensions, pos) &= ~(1ULL << (pos % 64));
+		pos++;
+
+		// at the end of a run, point the blocks it spills into past it
+		if (i + 1 == c->len || c->slots[i + 1].bucket != cs->bucket) {
+			uint64_t b;
+			for (b = cs->bucket / QF_SLOTS_PER_BLOCK + 1; b <= (pos - 1) /
+					 QF_SLOTS_PER_BLOCK; b++) {
+				uint64_t offset = pos - b * QF_SLOTS_PER_BLOCK;
+				get_block(qf, b)->offset = offset < BITMASK(8*sizeof(qf->blocks[0].offset)) ?
+					offset : BITMASK(8*sizeof(qf->blocks[0].offset));
+			}
+		}
+	}
+
+	if (pos <= c->end)
+		clear_slots(qf, pos, c->end);
+	uint64_t freed = c->end + 1 - c->start - c->len;
+	if (freed > 0)
+		modify_metadata(&qf->runtimedata->pc_noccupied_slots, -(int64_t)freed);
+
+	return freed;
+}
+
+/*****************************************************************************
+ * Code that uses the above to implement a QF with keys and inline counters. *
+ *****************************************************************************/
+
+/* 
+	 Counter format:
+	 0 xs:    <empty string>
+	 1 x:     x
+	 2 xs:    xx
+	 3 0s:    000
+	 >2 xs:   xbc...cx  for x != 0, b < x, c != 0, x
+	 >3 0s:   0c...c00  for c != 0
+	 */ // Note: not needed anymore for the new implementation of counters
+// slots is the address of the back of the array
+// remainder + counter are written into the array right to left
+// returns the address of the start of the remainder + counter
+static inline uint64_t *encode_counter(QF *qf, uint64_t remainder, uint64_t counter, uint64_t *slots)
+{
+	uint64_t digit = remainder;
+	uint64_t base = (1ULL << qf->metadata->bits_per_slot) - 1;
+	uint64_t *p = slots;
+
+	if (counter == 0)
+		return p;
+
+	*--p = remainder;
+
+	if (counter == 1)
+		return p;
+
+	if (counter == 2) {
+		*--p = remainder;
+		return p;
+	}
+
+	if (counter == 3 && remainder == 0) {
+		*--p = remainder;
 		*--p = remainder;
 		return p;    
 	}
@@ -1157,80 +1655,6 @@ void stop() {
 	return;
 }
 
-/* Returns the length of the encoding. 
-REQUIRES: index points to first slot of a counter. */
-static inline uint64_t decode_counter(const QF *qf, uint64_t index, uint64_t
-																			*remainder, uint64_t *count)
-{
-	uint64_t base;
-	uint64_t rem;
-	uint64_t cnt;
-	uint64_t digit;
-	uint64_t end;
-
-	*remainder = rem = get_slot(qf, index);
-
-	if (is_runend(qf, index)) { /* Entire run is "0" */
-		*count = 1; 
-		return index;
-	}
-
-	digit = get_slot(qf, index + 1);
-
-	if (is_runend(qf, index + 1)) {
-		*count = digit == rem ? 2 : 1;
-		return index + (digit == rem ? 1 : 0);
-	}
-
-	if (rem > 0 && digit >= rem) {
-		*count = digit == rem ? 2 : 1;
-		return index + (digit == rem ? 1 : 0);
-	}
-
-	if (rem > 0 && digit == 0 && get_slot(qf, index + 2) == rem) {
-		*count = 3;
-		return index + 2;
-	}
-
-	if (rem == 0 && digit == 0) {
-		if (get_slot(qf, index + 2) == 0) {
-			*count = 3;
-			return index + 2;
-		} else {
-			*count = 2;
-			return index + 1;
-		}
-	}
-
-	cnt = 0;
-	base = (1ULL << qf->metadata->bits_per_slot) - (rem ? 2 : 1);
-
-	end = index + 1;
-	while (digit != rem && !is_runend(qf, end)) {
-		if (digit > rem)
-			digit--;
-		if (digit && rem)
-			digit--;
-		cnt = cnt * base + digit;
-
-		end++;
-		digit = get_slot(qf, end);
-	}
-
-	if (rem) {
-		*count = cnt + 3;
-		return end;
-	}
-
-	if (is_runend(qf, end) || get_slot(qf, end + 1) != 0) {
-		*count = 1;
-		return index;
-	}
-
-	*count = cnt + 4;
-	return end + 1;
-}
-
 /* return the next slot which corresponds to a 
  * different element 
  * */
@@ -1255,11 +1679,31 @@ static inline uint64_t next_slot(QF *qf, uint64_t current) // EDIT: change schem
 	return current;
 }
 
-int match(const QF *qf, int64_t index, uint64_t hash);
+int match(const QF *qf, int64_t index, __uint128_t hash);
 int get_item_info(const QF *qf, uint64_t index, uint64_t *hash, uint64_t *hash_slots_used, uint64_t *count, uint64_t *count_slots_used);
-int get_slot_info(const QF *qf, uint64_t index, uint64_t *ext, int *ext_slots, uint64_t *count, int *count_slots);
+int get_slot_info(const QF *qf, uint64_t index, __uint128_t *ext, int *ext_slots, uint64_t *count, int *count_slots);
 //int qf_adapt(QF *qf, uint64_t index, uint64_t hash, uint64_t other_hash, uint8_t flags);
-int adapt(QF *qf, uint64_t index, uint64_t hash_bucket_index, uint64_t hash, uint64_t other_hash, uint64_t *ret_hash);
+int adapt(QF *qf, uint64_t index, uint64_t hash_bucket_index, __uint128_t hash, __uint128_t other_hash, int hash_bits, bool false_positive, __uint128_t *ret_hash);
+static int adapt_item(QF *qf, uint64_t index, uint64_t hash_bucket_index, int ext_len, __uint128_t hash, __uint128_t other_hash, int hash_bits, bool false_positive, __uint128_t *ret_hash);
+static int extend_item(QF *qf, uint64_t index, __uint128_t hash, uint64_t count, __uint128_t other_hash, uint64_t orig_key, int hash_bits, __uint128_t *ret_hash, __uint128_t *ret_other_hash, uint8_t flags);
+static int remove_item(QF *qf, __uint128_t hash, uint64_t count, __uint128_t *ret_hash, int *ret_hash_len, uint8_t flags);
+static inline uint64_t query(const QF *qf, __uint128_t hash, uint64_t *ret_index, __uint128_t *ret_hash, int *ret_hash_len, uint64_t *scan_end);
+static inline int64_t query_validated(const QF *qf, __uint128_t hash, uint64_t *ret_index, __uint128_t *ret_hash, int *ret_hash_len, uint8_t flags);
+static void resize_complete(QF *qf, QF *cur);
+static void resize_route(QF *qf, QF *cur, __uint128_t hash);
+static void free_retired(qfruntime *rt);
+static int insert_or_count(QF *qf, uint64_t hash, uint64_t key, uint64_t count, uint8_t flags);
+static int insert_or_extend(QF *qf, uint64_t hash, uint64_t key, uint64_t count, uint8_t flags);
+
+/* Whether an operation that returned ret lost a race with the start of a
+ * resize (see qf_lock) and should be run again.  The resize may well have
+ * finished by now, so this asks the thread rather than the table. */
+static inline bool resize_retry(int64_t ret)
+{
+	bool backoff = qf_resize_backoff;
+	qf_resize_backoff = false;
+	return ret == QF_COULDNT_LOCK && backoff;
+}
 
 static inline int insert1(QF *qf, __uint128_t hash, uint8_t runtime_lock)
 {
@@ -1573,58 +2017,276 @@ int frame(QF *qf, int block, int offset, uint64_t time) {
 	return 1;
 }
 
-static inline int insert(QF *qf, uint64_t hash, uint64_t count, uint64_t *ret_index, uint64_t *ret_hash, int *ret_hash_len, uint8_t runtime_lock) // copy of the insert function for modification
-// hash is 64 hashed key bits concatenated with 64 value bits
+/* The adaptive calls keep every bit of the hash above the quotient and
+ * remainder, since that is where extension slots take their bits from.
+ * With QF_HASH_INVERTIBLE only the low key_bits are invertible; the bits
+ * above them come from murmur so that extensions still tell keys apart. */
+static inline uint64_t key_to_hash(const QF *qf, uint64_t key, uint8_t flags)
+{
+	if (GET_KEY_HASH(flags) != QF_KEY_IS_HASH) {
+		if (qf->metadata->hash_mode == QF_HASH_DEFAULT)
+			return MurmurHash64A(((void *)&key), sizeof(key), qf->metadata->seed);
+		else if (qf->metadata->hash_mode == QF_HASH_INVERTIBLE) {
+			uint64_t hash = hash_64(key, BITMASK(qf->metadata->key_bits));
+			if (qf->metadata->key_bits < 64)
+				hash |= MurmurHash64A(((void *)&key), sizeof(key), qf->metadata->seed)
+					<< qf->metadata->key_bits;
+			return hash;
+		}
+	}
+	return key;
+}
+
+/* Same as key_to_hash, for the 128-bit calls. */
+static inline __uint128_t key_to_hash128(const QF *qf, __uint128_t key, uint8_t
+																				 flags)
+{
+	if (GET_KEY_HASH(flags) != QF_KEY_IS_HASH) {
+		__uint128_t hash = MurmurHash3_x64_128(((void *)&key), sizeof(key),
+																					 qf->metadata->seed);
+		if (qf->metadata->hash_mode == QF_HASH_DEFAULT)
+			return hash;
+		else if (qf->metadata->hash_mode == QF_HASH_INVERTIBLE)
+			return hash_64((uint64_t)key, BITMASK(qf->metadata->key_bits)) | (hash <<
+																																 qf->metadata->key_bits);
+	}
+	return key;
+}
+
+/* The hash qf_insert, qf_remove and qf_count_key_value use for a key/value
+ * pair. */
+static inline uint64_t key_value_to_hash(const QF *qf, uint64_t key, uint64_t
+																				 value, uint8_t flags)
+{
+	if (GET_KEY_HASH(flags) != QF_KEY_IS_HASH) {
+		if (qf->metadata->hash_mode == QF_HASH_DEFAULT)
+			key = MurmurHash64A(((void *)&key), sizeof(key),
+													qf->metadata->seed) % qf->metadata->range;
+		else if (qf->metadata->hash_mode == QF_HASH_INVERTIBLE)
+			key = hash_64(key, BITMASK(qf->metadata->key_bits));
+	}
+	return ((key << qf->metadata->value_bits) | (value &
+																							 BITMASK(qf->metadata->value_bits))) % qf->metadata->range;
+}
+
+static inline void set_payload(QF *qf, uint64_t index, uint64_t payload)
+{
+	if (qf->runtimedata->payloads != NULL)
+		qf->runtimedata->payloads[index] = payload;
+}
+
+/* Keep the reverse map (if one is enabled) in step with the fingerprints
+ * stored in the filter.  The map is shared by all lock regions, so it is
+ * always serialized on its own spin lock, even under QF_NO_LOCK: callers
+ * that partition the filter themselves (see qf_lock_buckets) still share
+ * it. */
+static inline void revmap_lock(rm_t *rm)
+{
+	while (__sync_lock_test_and_set(&rm->lock, 1))
+		while (rm->lock);
+}
+
+static inline void revmap_unlock(rm_t *rm)
+{
+	__sync_lock_release(&rm->lock);
+}
+
+/* Returns QF_NO_MEMORY if the map couldn't grow to take the key. */
+static inline int revmap_add(QF *qf, __uint128_t fingerprint, int len,
+														 uint64_t key)
+{
+	rm_t *rm = qf->runtimedata->reverse_map;
+	if (rm == NULL)
+		return 0;
+	revmap_lock(rm);
+	int ret = rm_insert(rm, fingerprint, len, key) < 0 ? QF_NO_MEMORY : 0;
+	revmap_unlock(rm);
+	return ret;
+}
+
+static inline bool revmap_lookup(QF *qf, __uint128_t fingerprint, int len,
+																 uint64_t *key)
+{
+	rm_t *rm = qf->runtimedata->reverse_map;
+	if (rm == NULL)
+		return false;
+	revmap_lock(rm);
+	bool ret = rm_lookup(rm, fingerprint, len, key);
+	revmap_unlock(rm);
+	return ret;
+}
+
+static inline void revmap_rekey(QF *qf, __uint128_t old_fingerprint, int
+																old_len, __uint128_t new_fingerprint, int new_len)
+{
+	rm_t *rm = qf->runtimedata->reverse_map;
+	if (rm == NULL || new_len <= 0)
+		return;
+	revmap_lock(rm);
+	rm_rekey(rm, old_fingerprint, old_len, new_fingerprint, new_len);
+	revmap_unlock(rm);
+}
+
+static inline void revmap_remove(QF *qf, __uint128_t fingerprint, int len)
+{
+	rm_t *rm = qf->runtimedata->reverse_map;
+	if (rm == NULL)
+		return;
+	revmap_lock(rm);
+	rm_remove(rm, fingerprint, len, NULL);
+	revmap_unlock(rm);
+}
+
+/* Length in bits of the fingerprint currently stored for the item at
+ * index. */
+static inline int item_fingerprint_len(const QF *qf, uint64_t index)
+{
+	__uint128_t ext;
+	uint64_t count;
+	int ext_len, count_len;
+	get_slot_info(qf, index, &ext, &ext_len, &count, &count_len);
+	return qf->metadata->quotient_bits + qf->metadata->bits_per_slot *
+		(ext_len + 1);
+}
+
+/* Whether key, hashed or taken as a hash, is the key of the item whose
+ * fingerprint is len bits of fingerprint (payloads can be overwritten and
+ * only keep the low bits of 128-bit keys).  If so its hash goes in hash. */
+static inline bool key_has_fingerprint(const QF *qf, uint64_t key, __uint128_t
+																			 fingerprint, int len, uint64_t *hash)
+{
+	if (len > 64)
+		return false;
+	*hash = key_to_hash(qf, key, 0);
+	if (((*hash ^ fingerprint) & BITMASK(len)) == 0)
+		return true;
+	*hash = key;
+	return ((*hash ^ fingerprint) & BITMASK(len)) == 0;
+}
+
+/* Slots of the counter that holds count (for an item seen count > 1 times). */
+static inline uint64_t counter_slots(const QF *qf, uint64_t count)
+{
+	uint64_t n = 0;
+	for (; count > 0; count >>= qf->metadata->bits_per_slot)
+		n++;
+	return n;
+}
+
+/* Slots a new item seen count times takes: its remainder and its
+ * counter's. */
+static inline uint64_t item_slots(const QF *qf, uint64_t count)
+{
+	return 1 + (count > 1 ? counter_slots(qf, count) : 0);
+}
+
+/* Extension slots adapt_item opens for an item with ext_len of them to tell
+ * hash apart from other_hash (if the policy lets it). */
+static inline uint64_t adapt_slots(const QF *qf, int ext_len, __uint128_t
+																	 hash, __uint128_t other_hash, int hash_bits)
+{
+	const int bits_per_slot = qf->metadata->bits_per_slot;
+	int bits = qf->metadata->quotient_bits + bits_per_slot * (ext_len + 1);
+	uint64_t n = 1;
+
+	if (bits >= hash_bits)
+		return 0;
+	hash >>= bits;
+	other_hash >>= bits;
+	while (((hash ^ other_hash) & BITMASK(bits_per_slot)) == 0 && bits +
+				 bits_per_slot < hash_bits) {
+		n++;
+		bits += bits_per_slot;
+		hash >>= bits_per_slot;
+		other_hash >>= bits_per_slot;
+	}
+	return n;
+}
+
+/* Whether nslots slots can be opened at or after index: each one shifts
+ * into the next empty slot. */
+static inline bool have_empty_slots(QF *qf, uint64_t index, uint64_t nslots)
+{
+	for (; nslots > 0; nslots--, index++) {
+		index = find_first_empty_slot_before(qf, index, qf->metadata->xnslots);
+		if (index >= qf->metadata->xnslots)
+			return false;
+	}
+	return true;
+}
+
+static inline int insert(QF *qf, __uint128_t hash, uint64_t count, uint64_t payload, int hash_bits, uint64_t *ret_index, __uint128_t *ret_hash, int *ret_hash_len, uint8_t runtime_lock) // copy of the insert function for modification
+// hash is 64 hashed key bits concatenated with 64 value bits (hash_bits of it are meaningful)
+// payload is stored alongside the new item if payloads are enabled
 {
 	/* int ret_distance = 0; */
 	uint64_t hash_remainder           = hash & BITMASK(qf->metadata->bits_per_slot);
 	*ret_hash = hash & BITMASK(qf->metadata->quotient_bits + qf->metadata->bits_per_slot);
 	*ret_hash_len = qf->metadata->quotient_bits + qf->metadata->bits_per_slot;
-	uint64_t hash_bucket_index        = (hash % qf->metadata->range) >> qf->metadata->bits_per_slot;
+	uint64_t hash_bucket_index        = (hash & BITMASK(qf->metadata->quotient_bits + qf->metadata->bits_per_slot)) >> qf->metadata->bits_per_slot;
 	uint64_t hash_bucket_block_offset = hash_bucket_index % QF_SLOTS_PER_BLOCK;
 	/*uint64_t hash_bucket_lock_offset  = hash_bucket_index % NUM_SLOTS_TO_LOCK;*/
 	
 	//printf("remainder = %lu   \t index = %lu\n", hash_remainder, hash_bucket_index);
 
+	uint64_t first_region, last_region;
 	if (GET_NO_LOCK(runtime_lock) != QF_NO_LOCK) {
-		if (!qf_lock(qf, hash_bucket_index, /*small*/ false, runtime_lock))
+		uint64_t nslots = shift_slots_bound(qf, count, hash_bits);
+		if (!lock_for_shift(qf, hash_bucket_index, nslots, runtime_lock,
+												&first_region, &last_region))
 			return QF_COULDNT_LOCK;
 	}
 
 	uint64_t runend_index             = run_end(qf, hash_bucket_index);
+	// a new item takes its remainder and its counter's slots
+	uint64_t new_slots = item_slots(qf, count);
+	int ret = 1;
 	
-	if (qf_get_num_occupied_slots(qf) == 4477) {
-		//bp1(qf, hash_bucket_index, hash_bucket_block_offset, hash_remainder);
-	}
-	if (hash_bucket_index / 64 == 839) {
-		if (qf_get_num_occupied_slots(qf) >= 0) bp1(qf, hash_bucket_index, hash_bucket_block_offset, hash_remainder);
-		frame(qf, hash_bucket_index / 64, hash_bucket_block_offset, qf_get_num_occupied_slots(qf));
-	}
 	if (might_be_empty(qf, hash_bucket_index) && runend_index == hash_bucket_index) { /* Empty slot */
+		if (!have_empty_slots(qf, hash_bucket_index, new_slots)) {
+			ret = QF_NO_SPACE;
+			goto out;
+		}
 		// If slot is empty, insert new element and then call the function again to increment the counter
 		set_slot(qf, hash_bucket_index, hash_remainder);
 		METADATA_WORD(qf, runends, hash_bucket_index) |= 1ULL << hash_bucket_block_offset;
 		METADATA_WORD(qf, occupieds, hash_bucket_index) |= 1ULL << hash_bucket_block_offset;
+		set_payload(qf, hash_bucket_index, payload);
+		*ret_index = hash_bucket_index;
 		
 		modify_metadata(&qf->runtimedata->pc_ndistinct_elts, 1);
 		modify_metadata(&qf->runtimedata->pc_noccupied_slots, 1);
 		modify_metadata(&qf->runtimedata->pc_nelts, 1);
 		if (count > 1) {
-			insert_and_extend(qf, hash_bucket_index, hash, count - 1, hash, ret_hash, ret_hash, QF_KEY_IS_HASH | QF_NO_LOCK); // ret_hash and ret_hash_len are placeholders
+			__uint128_t placeholder;
+			int extended = extend_item(qf, hash_bucket_index, hash, count - 1, hash, payload, hash_bits, &placeholder, &placeholder, QF_NO_LOCK);
+			if (extended < 0)
+				ret = extended;
 		}
 		//printf("inserted in slot %lu - empty slot\n", hash_bucket_index);
 	} else { /* Non-empty slot */
 		int64_t runstart_index = hash_bucket_index == 0 ? 0 : run_end(qf, hash_bucket_index - 1) + 1;
 
-		int ret;
 		if (!is_occupied(qf, hash_bucket_index)) { /* Empty bucket, but its slot is taken. */
-			insert_one_slot(qf, hash_bucket_index, runstart_index, hash_remainder);
+			if (!have_empty_slots(qf, hash_bucket_index, new_slots) ||
+					insert_one_slot(qf, hash_bucket_index, runstart_index, hash_remainder) < 0) {
+				ret = QF_NO_SPACE;
+				goto out;
+			}
 			
 			METADATA_WORD(qf, runends, runstart_index) |= 1ULL << (runstart_index % 64);
 			METADATA_WORD(qf, occupieds, hash_bucket_index) |= 1ULL << hash_bucket_block_offset;
+			set_payload(qf, runstart_index, payload);
+			*ret_index = runstart_index;
 			modify_metadata(&qf->runtimedata->pc_ndistinct_elts, 1);
 			modify_metadata(&qf->runtimedata->pc_noccupied_slots, 1);
-			modify_metadata(&qf->runtimedata->pc_nelts, count);
+			modify_metadata(&qf->runtimedata->pc_nelts, 1);
+			if (count > 1) {
+				__uint128_t placeholder;
+				int extended = extend_item(qf, runstart_index, hash, count - 1, hash, payload, hash_bits, &placeholder, &placeholder, QF_NO_LOCK);
+				if (extended < 0)
+					ret = extended;
+			}
 			/* ret_distance = runstart_index - hash_bucket_index; */
 			//printf("inserted in slot %lu - slot taken but not occupied\n", hash_bucket_index); // should search for correct spot
 		} else { /* Non-empty bucket */
@@ -1640,7 +2302,7 @@ static inline int insert(QF *qf, uint64_t hash, uint64_t count, uint64_t *ret_in
           int count_slots = 0;
 					if (get_slot_info(qf, current_index, ret_hash, ret_hash_len, &count_info, &count_slots) <= 0) {
 						if (GET_NO_LOCK(runtime_lock) != QF_NO_LOCK) {
-							qf_unlock(qf, hash_bucket_index, /*small*/ false);
+							unlock_regions(qf, first_region, last_region);
 						}
 						return QF_NO_SPACE;
 					};
@@ -1649,7 +2311,7 @@ static inline int insert(QF *qf, uint64_t hash, uint64_t count, uint64_t *ret_in
           *ret_hash_len = (*ret_hash_len * qf->metadata->bits_per_slot) + qf->metadata->quotient_bits + qf->metadata->bits_per_slot;
 					
 					if (GET_NO_LOCK(runtime_lock) != QF_NO_LOCK) {
-						qf_unlock(qf, hash_bucket_index, /*small*/ false);
+						unlock_regions(qf, first_region, last_region);
 					}
 					return 0;
 				}
@@ -1686,145 +2348,156 @@ static inline int insert(QF *qf, uint64_t hash, uint64_t count, uint64_t *ret_in
 					get_block(qf, i)->offset++;
 				assert(get_block(qf, i)->offset != 0);
 			}*/
-			insert_one_slot(qf, hash_bucket_index, runstart_index, hash_remainder);
+			if (!have_empty_slots(qf, hash_bucket_index, new_slots) ||
+					insert_one_slot(qf, hash_bucket_index, runstart_index, hash_remainder) < 0) {
+				ret = QF_NO_SPACE;
+				goto out;
+			}
+			set_payload(qf, runstart_index, payload);
+			*ret_index = runstart_index;
 			
 			//make_space(qf, runstart_index, 1);
 			//set_slot(qf, runstart_index, hash & BITMASK(qf->metadata->bits_per_slot));
 			modify_metadata(&qf->runtimedata->pc_ndistinct_elts, 1);
 			modify_metadata(&qf->runtimedata->pc_noccupied_slots, 1);
-			modify_metadata(&qf->runtimedata->pc_nelts, count);
+			modify_metadata(&qf->runtimedata->pc_nelts, 1);
 			if (count > 1) {
-				insert_and_extend(qf, hash_bucket_index, hash, count - 1, hash, ret_hash, ret_hash_len, QF_KEY_IS_HASH | QF_NO_LOCK); // ret_hash and ret_hash_len are placeholders
+				__uint128_t placeholder;
+				int extended = extend_item(qf, runstart_index, hash, count - 1, hash, payload, hash_bits, &placeholder, &placeholder, QF_NO_LOCK);
+				if (extended < 0)
+					ret = extended;
 			}
 			//printf("inserted in slot %lu - slot taken and occupied\n", hash_bucket_index);
 		}
 	}
 
+out:
 	if (GET_NO_LOCK(runtime_lock) != QF_NO_LOCK) {
-		qf_unlock(qf, hash_bucket_index, /*small*/ false);
+		unlock_regions(qf, first_region, last_region);
 	}
 
-	return 1;
+	return ret;
 }
 
-int insert_and_extend(QF *qf, uint64_t index, uint64_t key, uint64_t count, uint64_t other_key, uint64_t *ret_hash, uint64_t *ret_other_hash, uint8_t flags)
+// hash and other_hash are already hashed; hash_bits of each are meaningful
+// checks up front that every slot it may open fits, so that it fails with
+// QF_NO_SPACE before writing anything rather than leave the item half done
+static int extend_item(QF *qf, uint64_t index, __uint128_t hash, uint64_t count, __uint128_t other_hash, uint64_t orig_key, int hash_bits, __uint128_t *ret_hash, __uint128_t *ret_other_hash, uint8_t flags)
 {
+	uint64_t first_region, last_region;
 	if (GET_NO_LOCK(flags) != QF_NO_LOCK) {
-		if (!qf_lock(qf, index, /*small*/ false, flags))
+		uint64_t hash_bucket_index = (hash & BITMASK(qf->metadata->quotient_bits + qf->metadata->bits_per_slot)) >> qf->metadata->bits_per_slot;
+		uint64_t nslots = shift_slots_bound(qf, count, hash_bits);
+		if (!lock_for_shift(qf, hash_bucket_index, nslots, flags, &first_region,
+												&last_region))
 			return QF_COULDNT_LOCK;
 	}
-	
-	if (GET_KEY_HASH(flags) != QF_KEY_IS_HASH) {
-		if (qf->metadata->hash_mode == QF_HASH_DEFAULT) {
-			key = MurmurHash64A(((void *)&key), sizeof(key), qf->metadata->seed) % qf->metadata->range;
-			other_key = MurmurHash64A(((void *)&other_key), sizeof(other_key), qf->metadata->seed) % qf->metadata->range;
-		}
-		else if (qf->metadata->hash_mode == QF_HASH_INVERTIBLE) {
-			key = hash_64(key, BITMASK(qf->metadata->key_bits));
-			other_key = hash_64(other_key, BITMASK(qf->metadata->key_bits));
-		}
-	}
-	//uint64_t hash = (key << qf->metadata->value_bits) | (value & BITMASK(qf->metadata->value_bits));
-	//uint64_t other_hash = (other_key << qf->metadata->value_bits) | (other_value & BITMASK(qf->metadata->value_bits));
-  uint64_t hash = key;
-  uint64_t other_hash = other_key;
-	if (hash % qf->metadata->range != other_hash % qf->metadata->range) {
-		printf("%lu\n", qf_get_num_occupied_slots(qf));
-	}
+
 	assert((hash & BITMASK(qf->metadata->quotient_bits + qf->metadata->bits_per_slot)) == (other_hash & BITMASK(qf->metadata->quotient_bits + qf->metadata->bits_per_slot)));
 	
 	int extended_len = 0;
+	__uint128_t ext;
+	uint64_t counter;
+	int ext_len, counter_len;
+	get_slot_info(qf, index, &ext, &ext_len, &counter, &counter_len);
 	
 	if (hash == other_hash) { // same item, increment counter // TODO: check that offset bits are properly set
-		uint64_t ext, counter;
-    int ext_len, counter_len;
-		get_slot_info(qf, index, &ext, &ext_len, &counter, &counter_len);
     uint64_t new_count = counter + count;
+    uint64_t new_slots = counter_slots(qf, new_count);
+    new_slots = new_slots > (uint64_t)counter_len ? new_slots - counter_len : 0;
+    if (!have_empty_slots(qf, index + 1, new_slots)) {
+      extended_len = QF_NO_SPACE;
+      goto out;
+    }
     int i;
     for (i = 0; i < counter_len; i++) {
-      set_slot(qf, index + 1 + ext + i, new_count & BITMASK(qf->metadata->bits_per_slot));
+      set_slot(qf, index + 1 + ext_len + i, new_count & BITMASK(qf->metadata->bits_per_slot));
       new_count >>= qf->metadata->bits_per_slot;
     }
     for (; new_count > 0; i++) {
-      insert_one_slot(qf, (hash >> qf->metadata->bits_per_slot) & BITMASK(qf->metadata->quotient_bits), index + 1 + ext + i, new_count & BITMASK(qf->metadata->bits_per_slot));
-      METADATA_WORD(qf, extensions, index + 1 + ext + i) |= 1ULL << ((index + 1 + ext + i) % QF_SLOTS_PER_BLOCK);
-      METADATA_WORD(qf, runends, index + 1 + ext + i) |= 1ULL << ((index + 1 + ext + i) % QF_SLOTS_PER_BLOCK);
+      if (insert_one_slot(qf, (hash >> qf->metadata->bits_per_slot) & BITMASK(qf->metadata->quotient_bits), index + 1 + ext_len + i, new_count & BITMASK(qf->metadata->bits_per_slot)) < 0) {
+        extended_len = QF_NO_SPACE;
+        goto out;
+      }
+      METADATA_WORD(qf, extensions, index + 1 + ext_len + i) |= 1ULL << ((index + 1 + ext_len + i) % QF_SLOTS_PER_BLOCK);
+      METADATA_WORD(qf, runends, index + 1 + ext_len + i) |= 1ULL << ((index + 1 + ext_len + i) % QF_SLOTS_PER_BLOCK);
+      modify_metadata(&qf->runtimedata->pc_noccupied_slots, 1);
       new_count >>= qf->metadata->bits_per_slot;
     }
 		modify_metadata(&qf->runtimedata->pc_nelts, count);
 	}
 	else { // different items, insert second item and extend both
-		
-		/*if (qf_get_num_occupied_slots(qf) == 6636) {
-			
-		}*/
-		uint64_t hash_bucket_index = (hash % qf->metadata->range) >> qf->metadata->bits_per_slot;
-
-		extended_len = adapt(qf, index, hash_bucket_index, other_hash, hash, ret_other_hash);
-		insert_one_slot(qf, (hash >> qf->metadata->bits_per_slot) & BITMASK(qf->metadata->quotient_bits), index, hash & BITMASK(qf->metadata->bits_per_slot));
-		adapt(qf, index, hash_bucket_index, hash, other_hash, ret_hash);
+		uint64_t hash_bucket_index = (hash & BITMASK(qf->metadata->quotient_bits + qf->metadata->bits_per_slot)) >> qf->metadata->bits_per_slot;
+		uint64_t nslots = adapt_slots(qf, ext_len, other_hash, hash, hash_bits) + 1 +
+			adapt_slots(qf, 0, hash, other_hash, hash_bits) + (count > 1 ?
+																													counter_slots(qf,
+																																				count)
+																													: 0);
+		if (!have_empty_slots(qf, index, nslots)) {
+			extended_len = QF_NO_SPACE;
+			goto out;
+		}
 
+		int other_len = item_fingerprint_len(qf, index);
+		extended_len = adapt(qf, index, hash_bucket_index, other_hash, hash, hash_bits, false, ret_other_hash);
+		if (extended_len < 0)
+			goto out;
+		revmap_rekey(qf, other_hash & BITMASK128(other_len), other_len, *ret_other_hash, extended_len);
+		if (insert_one_slot(qf, hash_bucket_index, index, hash & BITMASK(qf->metadata->bits_per_slot)) < 0) {
+			extended_len = QF_NO_SPACE;
+			goto out;
+		}
+		set_payload(qf, index, orig_key);
 		modify_metadata(&qf->runtimedata->pc_ndistinct_elts, 1);
 		modify_metadata(&qf->runtimedata->pc_noccupied_slots, 1);
 		modify_metadata(&qf->runtimedata->pc_nelts, 1);
+		int new_len = adapt(qf, index, hash_bucket_index, hash, other_hash, hash_bits, false, ret_hash);
+		if (new_len < 0) {
+			extended_len = new_len;
+			goto out;
+		}
+		if (new_len > 0 && revmap_add(qf, *ret_hash, new_len, orig_key) < 0)
+			extended_len = QF_NO_MEMORY;
+
 		if (count > 1) {
-			insert_and_extend(qf, index, key, count - 1, key, ret_hash, ret_other_hash, flags | QF_NO_LOCK); // ret_hash and ret_hash_len are placeholders
+			__uint128_t placeholder;
+			int ret = extend_item(qf, index, hash, count - 1, hash, orig_key, hash_bits, &placeholder, &placeholder, flags | QF_NO_LOCK);
+			if (ret < 0)
+				extended_len = ret;
 		}
 	}
 
+out:
 	if (GET_NO_LOCK(flags) != QF_NO_LOCK) {
-		qf_unlock(qf, index, /*small*/ false);
+		unlock_regions(qf, first_region, last_region);
 	}
 
 	return extended_len;
 }
 
-inline static int _remove(QF *qf, __uint128_t hash, uint64_t count, uint8_t
-													runtime_lock)
+int insert_and_extend(QF *qf, uint64_t index, uint64_t key, uint64_t count, uint64_t other_key, uint64_t *ret_hash, uint64_t *ret_other_hash, uint8_t flags)
 {
-	// hash_remainder is last 7 bits of hash, hash_bucket_index is quotient
-	int ret_numfreedslots = 0;
-	uint64_t hash_remainder           = hash & BITMASK(qf->metadata->bits_per_slot);
-	uint64_t hash_bucket_index        = hash >> qf->metadata->bits_per_slot;
-	uint64_t current_remainder, current_count, current_end;
-	uint64_t new_values[67];
-
-	// Lock mutex
-	if (GET_NO_LOCK(runtime_lock) != QF_NO_LOCK) {
-		if (!qf_lock(qf, hash_bucket_index, /*small*/ false, runtime_lock))
-			return -2;
-	}
-
-	// If slot is empty, don't bother
-	if (!is_occupied(qf, hash_bucket_index))
-		return -1;
-
-	uint64_t original_runstart_index = hash_bucket_index == 0 ? 0 : run_end(qf, hash_bucket_index - 1) + 1;
-	uint64_t current_index = original_runstart_index;
-	int only_item_in_the_run = 0;
-
-	/*Find the counter for this remainder, if one exists.*/
+	__uint128_t hash = 0, other_hash = 0;
+	QF cur;
+	int ret;
 	do {
-		if (match(qf, current_index, hash)) {
-			uint64_t *hash_info, *hash_slots, *count_info, *count_slots;
-			get_item_info(qf, current_index, hash_info, hash_slots, count_info, count_slots);
-			if (count >= *count_info) *count_info = 0;
-			else *count_info -= count;
-			int i;
-			for (i = 0; i < *count_slots; i++) {
-				set_slot(qf, current_index + *hash_slots + i, *count_info & BITMASK(qf->metadata->bits_per_slot));
-				*count_info >>= qf->metadata->bits_per_slot;
-			}
-			break;
-		}
-		current_index = current_index + 1;
-	} while (/*current_remainder < hash_remainder &&*/ !is_runend(qf, current_index));
-
-	if (GET_NO_LOCK(runtime_lock) != QF_NO_LOCK) {
-		qf_unlock(qf, hash_bucket_index, /*small*/ false);
-	}
+		resize_route(qf, &cur, key_to_hash(qf, key, flags));
+		ret = extend_item(&cur, index, key_to_hash(&cur, key, flags), count, key_to_hash(&cur, other_key, flags), key, 64, &hash, &other_hash, flags);
+	} while (resize_retry(ret));
+	*ret_hash = hash;
+	*ret_other_hash = other_hash;
+	return ret;
+}
 
-	return 1;
+int insert_and_extend128(QF *qf, uint64_t index, __uint128_t key, uint64_t count, __uint128_t other_key, __uint128_t *ret_hash, __uint128_t *ret_other_hash, uint8_t flags)
+{
+	QF cur;
+	int ret;
+	do {
+		resize_route(qf, &cur, key_to_hash128(qf, key, flags));
+		ret = extend_item(&cur, index, key_to_hash128(&cur, key, flags), count, key_to_hash128(&cur, other_key, flags), key, 128, ret_hash, ret_other_hash, flags);
+	} while (resize_retry(ret));
+	return ret;
 }
 
 /***********************************************************************
@@ -1852,7 +2525,7 @@ uint64_t qf_init(QF *qf, uint64_t nslots, uint64_t key_bits, uint64_t value_bits
 	assert(key_remainder_bits >= 2);
 
 	bits_per_slot = key_remainder_bits + value_bits;
-	assert (QF_BITS_PER_SLOT == 0 || QF_BITS_PER_SLOT == qf->metadata->bits_per_slot);
+	assert (QF_BITS_PER_SLOT == 0 || QF_BITS_PER_SLOT == bits_per_slot);
 	assert(bits_per_slot > 1);
 #if QF_BITS_PER_SLOT == 8 || QF_BITS_PER_SLOT == 16 || QF_BITS_PER_SLOT == 32 || QF_BITS_PER_SLOT == 64
 	size = nblocks * sizeof(qfblock);
@@ -1893,31 +2566,15 @@ uint64_t qf_init(QF *qf, uint64_t nslots, uint64_t key_bits, uint64_t value_bits
 	qf->metadata->ndistinct_elts = 0;
 	qf->metadata->noccupied_slots = 0;
 
-	qf->runtimedata->num_locks = (qf->metadata->xnslots/NUM_SLOTS_TO_LOCK)+2;
-
-	pc_init(&qf->runtimedata->pc_nelts, (int64_t*)&qf->metadata->nelts, 8, 100);
-	pc_init(&qf->runtimedata->pc_ndistinct_elts, (int64_t*)&qf->metadata->ndistinct_elts, 8, 100);
-	pc_init(&qf->runtimedata->pc_noccupied_slots, (int64_t*)&qf->metadata->noccupied_slots, 8, 100);
+	pc_init(&qf->runtimedata->pc_nelts, (int64_t*)&qf->metadata->nelts, 0, 100);
+	pc_init(&qf->runtimedata->pc_ndistinct_elts, (int64_t*)&qf->metadata->ndistinct_elts, 0, 100);
+	pc_init(&qf->runtimedata->pc_noccupied_slots, (int64_t*)&qf->metadata->noccupied_slots, 0, 100);
 	/* initialize container resize */
 	qf->runtimedata->auto_resize = 0;
 	qf->runtimedata->container_resize = qf_resize_malloc;
 	/* initialize all the locks to 0 */
 	qf->runtimedata->metadata_lock = 0;
-	qf->runtimedata->locks = (volatile int *)calloc(qf->runtimedata->num_locks,
-																					sizeof(volatile int));
-	if (qf->runtimedata->locks == NULL) {
-		perror("Couldn't allocate memory for runtime locks.");
-		exit(EXIT_FAILURE);
-	}
-#ifdef LOG_WAIT_TIME
-	qf->runtimedata->wait_times = (wait_time_data*
-																 )calloc(qf->runtimedata->num_locks+1,
-																				 sizeof(wait_time_data));
-	if (qf->runtimedata->wait_times == NULL) {
-		perror("Couldn't allocate memory for runtime wait_times.");
-		exit(EXIT_FAILURE);
-	}
-#endif
+	qf_set_lock_regions(qf, NUM_SLOTS_TO_LOCK, CLUSTER_SIZE);
 
 	return total_num_bytes;
 }
@@ -1937,21 +2594,7 @@ uint64_t qf_use(QF* qf, void* buffer, uint64_t buffer_len)
 	}
 	/* initialize all the locks to 0 */
 	qf->runtimedata->metadata_lock = 0;
-	qf->runtimedata->locks = (volatile int *)calloc(qf->runtimedata->num_locks,
-																					sizeof(volatile int));
-	if (qf->runtimedata->locks == NULL) {
-		perror("Couldn't allocate memory for runtime locks.");
-		exit(EXIT_FAILURE);
-	}
-#ifdef LOG_WAIT_TIME
-	qf->runtimedata->wait_times = (wait_time_data*
-																 )calloc(qf->runtimedata->num_locks+1,
-																				 sizeof(wait_time_data));
-	if (qf->runtimedata->wait_times == NULL) {
-		perror("Couldn't allocate memory for runtime wait_times.");
-		exit(EXIT_FAILURE);
-	}
-#endif
+	qf_set_lock_regions(qf, NUM_SLOTS_TO_LOCK, CLUSTER_SIZE);
 
 	return sizeof(qfmetadata) + qf->metadata->total_size_in_bytes;
 }
@@ -1960,11 +2603,31 @@ void *qf_destroy(QF *qf)
 {
 	assert(qf->runtimedata != NULL);
 	if (qf->runtimedata->locks != NULL)
-		free((void*)qf->runtimedata->locks);
+		free(qf->runtimedata->locks);
+	if (qf->runtimedata->versions != NULL)
+		free((void*)qf->runtimedata->versions);
 	if (qf->runtimedata->wait_times != NULL)
 		free(qf->runtimedata->wait_times);
 	if (qf->runtimedata->f_info.filepath != NULL)
 		free(qf->runtimedata->f_info.filepath);
+	if (qf->runtimedata->reverse_map != NULL) {
+		rm_destructor(qf->runtimedata->reverse_map);
+		free(qf->runtimedata->reverse_map);
+	}
+	if (qf->runtimedata->payloads != NULL)
+		free(qf->runtimedata->payloads);
+	if (qf->runtimedata->fp_counts != NULL) {
+		rm_destructor(qf->runtimedata->fp_counts);
+		free(qf->runtimedata->fp_counts);
+	}
+	if (qf->runtimedata->resize_next != NULL) {
+		qf_free(qf->runtimedata->resize_next);
+		free(qf->runtimedata->resize_next);
+		free(qf->runtimedata->resize_self);
+	}
+	if (qf->runtimedata->resize_chunks != NULL)
+		free((void*)qf->runtimedata->resize_chunks);
+	free_retired(qf->runtimedata);
 	free(qf->runtimedata);
 
 	return (void*)qf->metadata;
@@ -1976,7 +2639,7 @@ bool qf_malloc(QF *qf, uint64_t nslots, uint64_t key_bits, uint64_t
 	uint64_t total_num_bytes = qf_init(qf, nslots, key_bits, value_bits,
 																		 hash, seed, NULL, 0);
 
-	void *buffer = malloc(total_num_bytes);
+	void *buffer = calloc(total_num_bytes, 1);
 	if (buffer == NULL) {
 		perror("Couldn't allocate memory for the CQF.");
 		exit(EXIT_FAILURE);
@@ -2014,6 +2677,10 @@ void qf_copy(QF *dest, const QF *src)
 	DEBUG_CQF("%s\n","Source CQF");
 	DEBUG_DUMP(src);
 	memcpy(dest->runtimedata, src->runtimedata, sizeof(qfruntime));
+	/* the reverse map, payloads and false-positive counts are owned by src */
+	dest->runtimedata->reverse_map = NULL;
+	dest->runtimedata->payloads = NULL;
+	dest->runtimedata->fp_counts = NULL;
 	memcpy(dest->metadata, src->metadata, sizeof(qfmetadata));
 	memcpy(dest->blocks, src->blocks, src->metadata->total_size_in_bytes);
 	DEBUG_CQF("%s\n","Destination CQF after copy.");
@@ -2027,7 +2694,7 @@ void qf_reset(QF *qf)
 	qf->metadata->noccupied_slots = 0;
 
 #ifdef LOG_WAIT_TIME
-	memset(qf->wait_times, 0,
+	memset(qf->runtimedata->wait_times, 0,
 				 (qf->runtimedata->num_locks+1)*sizeof(wait_time_data));
 #endif
 #if QF_BITS_PER_SLOT == 8 || QF_BITS_PER_SLOT == 16 || QF_BITS_PER_SLOT == 32 || QF_BITS_PER_SLOT == 64
@@ -2040,6 +2707,8 @@ void qf_reset(QF *qf)
 
 int64_t qf_resize_malloc(QF *qf, uint64_t nslots)
 {
+	QF cur;
+	resize_complete(qf, &cur);
 	printf("malloc\n");
 	QF new_qf;
 	if (!qf_malloc(&new_qf, nslots, qf->metadata->key_bits,
@@ -2048,6 +2717,9 @@ int64_t qf_resize_malloc(QF *qf, uint64_t nslots)
 		return -1;
 	if (qf->runtimedata->auto_resize)
 		qf_set_auto_resize(&new_qf, true);
+	qf_set_lock_regions(&new_qf, qf->runtimedata->slots_per_lock,
+											qf->runtimedata->cluster_size);
+	qf_set_lock_kind(&new_qf, qf->runtimedata->lock_kind);
 
 	// copy keys from qf into new_qf
 	QFi qfi;
@@ -2073,6 +2745,8 @@ int64_t qf_resize_malloc(QF *qf, uint64_t nslots)
 
 uint64_t qf_resize(QF* qf, uint64_t nslots, void* buffer, uint64_t buffer_len)
 {
+	QF cur;
+	resize_complete(qf, &cur);
 	QF new_qf;
 	new_qf.runtimedata = (qfruntime *)calloc(sizeof(qfruntime), 1);
 	if (new_qf.runtimedata == NULL) {
@@ -2090,6 +2764,9 @@ uint64_t qf_resize(QF* qf, uint64_t nslots, void* buffer, uint64_t buffer_len)
 
 	if (qf->runtimedata->auto_resize)
 		qf_set_auto_resize(&new_qf, true);
+	qf_set_lock_regions(&new_qf, qf->runtimedata->slots_per_lock,
+											qf->runtimedata->cluster_size);
+	qf_set_lock_kind(&new_qf, qf->runtimedata->lock_kind);
 
 	// copy keys from qf into new_qf
 	QFi qfi;
@@ -2111,110 +2788,766 @@ uint64_t qf_resize(QF* qf, uint64_t nslots, void* buffer, uint64_t buffer_len)
 	return init_size;
 }
 
-void qf_set_auto_resize(QF* qf, bool enabled)
+/* Incremental resize.  When qf_insert finds a malloc-backed, auto-resizing
+ * filter full, resize_start allocates a table twice the size and hangs it
+ * off runtimedata->resize_next.  From then on the old table is read-only:
+ * writers that get there first are drained by a sweep over the region
+ * locks, and later ones find resize_next set once they hold their locks
+ * and go to the new table instead.  The old buckets are copied over in
+ * chunks of QF_RESIZE_CHUNK, one per insert (resize_help), on demand for
+ * removes and the adaptive calls (resize_move_hash), or all at once for
+ * explicit resizes (resize_complete).  A bucket
+ * b of the old table becomes buckets 2b and 2b+1 of the new one, so a
+ * chunk only ever lands in its own part of the new table.  Lookups ask
+ * both tables while a chunk is pending.  Once the last chunk is done,
+ * resize_finish points the QF header at the new table.  Operations that
+ * started against the old table may still be reading it, so it is kept
+ * (read-only, linked from retired_qf) until qf_free, and every operation
+ * works on a snapshot of the header (resize_snapshot) rather than on the
+ * header itself. */
+
+/* Old buckets per migration chunk. */
+#define QF_RESIZE_CHUNK (4 * QF_SLOTS_PER_BLOCK)
+
+enum qf_resize_chunk_state {
+	QF_CHUNK_PENDING = 0,
+	QF_CHUNK_MOVING,
+	QF_CHUNK_DONE
+};
+
+/* Copies qf's header into cur, waiting out a resize_finish that is halfway
+ * through replacing it.  resize_finish marks the old table retired before
+ * it touches the header, so a copy whose table isn't retired is all old. */
+static inline void resize_snapshot(const QF *qf, QF *cur)
 {
-	if (enabled)
-		qf->runtimedata->auto_resize = 1;
-	else
-		qf->runtimedata->auto_resize = 0;
+	uint32_t spins = 0;
+
+	while (true) {
+		cur->runtimedata = __atomic_load_n(&qf->runtimedata, __ATOMIC_ACQUIRE);
+		cur->metadata = __atomic_load_n(&qf->metadata, __ATOMIC_ACQUIRE);
+		cur->blocks = __atomic_load_n(&qf->blocks, __ATOMIC_ACQUIRE);
+		if (!__atomic_load_n(&cur->runtimedata->retired, __ATOMIC_ACQUIRE))
+			return;
+		qf_cpu_relax(&spins);
+	}
 }
 
-/*
-key - 
-*/
-int qf_insert_ret(QF *qf, uint64_t key, uint64_t count, uint64_t *ret_index, uint64_t *ret_hash, int *ret_hash_len, uint8_t flags)
+/* The chunk of the old table that hash's bucket belongs to.  next has one
+ * more quotient bit, so its bucket is the old one times two plus a bit. */
+static inline uint64_t resize_chunk_of(const QF *next, uint64_t hash)
 {
-	// We fill up the CQF up to 95% load factor.
-	// This is a very conservative check.
-	if (qf_get_num_occupied_slots(qf) >= qf->metadata->nslots * 0.95) {
-		if (qf->runtimedata->auto_resize) {
-			/*fprintf(stdout, "Resizing the CQF.\n");*/
-			if (qf->runtimedata->container_resize(qf, qf->metadata->nslots * 2) < 0)
-			{
-				fprintf(stderr, "Resizing the failed.\n");
-				return QF_NO_SPACE;
+	uint64_t bucket = (hash >> next->metadata->bits_per_slot) &
+		BITMASK(next->metadata->quotient_bits);
+	return (bucket >> 1) / QF_RESIZE_CHUNK;
+}
+
+/* Frees the tables replaced by this one's resizes (see qf_destroy). */
+static void free_retired(qfruntime *rt)
+{
+	QF *old = rt->retired_qf;
+	if (old == NULL)
+		return;
+	// the table old resized into is rt's; only the struct is old's
+	free(old->runtimedata->resize_next);
+	old->runtimedata->resize_next = NULL;
+	qf_free(old);
+	free(old);
+	rt->retired_qf = NULL;
+}
+
+/* Starts migrating cur, a snapshot of qf, into a table twice its size.
+ * Returns false if the new table can't be set up. */
+static bool resize_start(QF *qf, const QF *cur)
+{
+	qfruntime *rt = cur->runtimedata;
+	uint32_t spins = 0;
+	uint64_t i;
+
+	if (__sync_lock_test_and_set(&rt->resize_lock, 1)) {
+		// someone else is starting it
+		while (__atomic_load_n(&rt->resize_lock, __ATOMIC_ACQUIRE))
+			qf_cpu_relax(&spins);
+		return true;
+	}
+	if (rt->resize_next != NULL) {
+		__sync_lock_release(&rt->resize_lock);
+		return true;
+	}
+
+	QF *self = (QF *)malloc(sizeof(QF));
+	QF *next = (QF *)malloc(sizeof(QF));
+	if (self == NULL || next == NULL) {
+		perror("Couldn't allocate memory for the resized CQF.");
+		exit(EXIT_FAILURE);
+	}
+	if (!qf_malloc(next, cur->metadata->nslots * 2, cur->metadata->key_bits,
+								 cur->metadata->value_bits, cur->metadata->hash_mode,
+								 cur->metadata->seed)) {
+		free(self);
+		free(next);
+		__sync_lock_release(&rt->resize_lock);
+		return false;
+	}
+	qf_set_lock_regions(next, rt->slots_per_lock, rt->cluster_size);
+	qf_set_lock_kind(next, rt->lock_kind);
+	// resize_move_chunk carries payloads and reverse map keys over
+	if ((rt->payloads != NULL && !qf_enable_payloads(next)) ||
+			(rt->reverse_map != NULL && !qf_enable_reverse_map(next)) ||
+			!qf_set_adapt_policy(next, &rt->adapt_policy)) {
+		qf_free(next);
+		free(self);
+		free(next);
+		__sync_lock_release(&rt->resize_lock);
+		return false;
+	}
+	memcpy(self, cur, sizeof(QF));
+	rt->resize_self = self;
+	rt->resize_cursor = 0;
+	rt->resize_done = 0;
+	__atomic_store_n(&rt->resize_next, next, __ATOMIC_SEQ_CST);
+
+	// wait out writers that locked their regions before they could see
+	// resize_next; nothing writes to this table after that
+	for (i = 0; i < rt->num_locks; i++) {
+		lock_regions(self, i, i, QF_WAIT_FOR_LOCK);
+		unlock_regions(self, i, i);
+	}
+
+	uint64_t nchunks = (cur->metadata->nslots + QF_RESIZE_CHUNK - 1) /
+		QF_RESIZE_CHUNK;
+	uint8_t *chunks = (uint8_t *)calloc(nchunks, sizeof(uint8_t));
+	if (chunks == NULL) {
+		perror("Couldn't allocate memory for the resize state.");
+		exit(EXIT_FAILURE);
+	}
+	rt->resize_nchunks = nchunks;
+	__atomic_store_n(&rt->resize_chunks, chunks, __ATOMIC_RELEASE);
+
+	__sync_lock_release(&rt->resize_lock);
+	return true;
+}
+
+/* Copies every item whose home bucket is in chunk from qf to next.  An
+ * extended item whose key is known, from its payload or the reverse map, is
+ * inserted again from the key's hash, so items that were told apart by
+ * extensions are told apart in next too.  Other items are rebuilt from
+ * their quotient and remainder, and ones that now collide share a counter,
+ * as in qf_resize_malloc.  Payloads and reverse map keys come along.
+ * Losing an item would make its keys false negatives, so a failed insert
+ * aborts, as in qf_resize. */
+static void resize_move_chunk(const QF *qf, QF *next, uint64_t chunk)
+{
+	uint64_t bucket = chunk * QF_RESIZE_CHUNK;
+	uint64_t end = bucket + QF_RESIZE_CHUNK;
+	if (end > qf->metadata->nslots)
+		end = qf->metadata->nslots;
+
+	for (; bucket < end; bucket++) {
+		if (!is_occupied(qf, bucket))
+			continue;
+		uint64_t pos = bucket == 0 ? 0 : run_end(qf, bucket - 1) + 1;
+		if (pos < bucket)
+			pos = bucket;
+		bool last;
+		do {
+			__uint128_t ext;
+			uint64_t count;
+			int ext_len, count_len;
+			last = is_runend(qf, pos);
+			get_slot_info(qf, pos, &ext, &ext_len, &count, &count_len);
+			uint64_t hash = get_slot(qf, pos) | (bucket <<
+																					 qf->metadata->bits_per_slot);
+			const int base_bits = qf->metadata->quotient_bits +
+				qf->metadata->bits_per_slot;
+			__uint128_t fingerprint = (__uint128_t)hash | ext << base_bits;
+			int len = base_bits + ext_len * qf->metadata->bits_per_slot;
+			uint64_t key = 0, key_hash;
+			bool known = qf->runtimedata->payloads != NULL;
+			if (known)
+				key = qf->runtimedata->payloads[pos];
+			else
+				known = revmap_lookup((QF *)qf, fingerprint, len, &key);
+			pos += 1 + ext_len + count_len;
+
+			// only the adaptive calls extend items; the others keep sharing
+			// counters as they did
+			int ret;
+			if (known && ext_len > 0 && key_has_fingerprint(qf, key, fingerprint,
+																											len, &key_hash))
+				ret = insert_or_extend(next, key_hash, key, count, QF_WAIT_FOR_LOCK);
+			else {
+				ret = insert_or_count(next, hash, key, count, QF_WAIT_FOR_LOCK);
+				if (ret == 1 && known && revmap_add(next, hash, base_bits, key) < 0)
+					ret = QF_NO_MEMORY;
 			}
-		} else {
+			if (ret < 0) {
+				fprintf(stderr, "Failed to move hash: %ld into the new CQF.\n", hash);
+				abort();
+			}
+		} while (!last);
+	}
+}
+
+/* Points qf at the table rt has been migrated into. */
+static void resize_finish(QF *qf, qfruntime *rt)
+{
+	QF *next = rt->resize_next;
+
+	next->runtimedata->retired_qf = rt->resize_self;
+	next->runtimedata->auto_resize = rt->auto_resize;
+	next->runtimedata->container_resize = rt->container_resize;
+
+	// resize_snapshot retries while it can see retired
+	__atomic_store_n(&rt->retired, 1, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&qf->metadata, next->metadata, __ATOMIC_RELEASE);
+	__atomic_store_n(&qf->blocks, next->blocks, __ATOMIC_RELEASE);
+	__atomic_store_n(&qf->runtimedata, next->runtimedata, __ATOMIC_RELEASE);
+}
+
+/* Moves chunk unless someone else already has it.  With wait, also waits
+ * for a mover that got there first. */
+static void resize_migrate_chunk(QF *qf, qfruntime *rt, uint64_t chunk, bool
+																 wait)
+{
+	volatile uint8_t *state = &rt->resize_chunks[chunk];
+	uint32_t spins = 0;
+
+	if (__sync_bool_compare_and_swap(state, QF_CHUNK_PENDING,
+																	 QF_CHUNK_MOVING)) {
+		resize_move_chunk(rt->resize_self, rt->resize_next, chunk);
+		__atomic_store_n(state, QF_CHUNK_DONE, __ATOMIC_RELEASE);
+		if (__sync_add_and_fetch(&rt->resize_done, 1) == rt->resize_nchunks)
+			resize_finish(qf, rt);
+		return;
+	}
+	while (wait && __atomic_load_n(state, __ATOMIC_ACQUIRE) != QF_CHUNK_DONE)
+		qf_cpu_relax(&spins);
+}
+
+/* Waits for resize_start to drain the writers and publish the chunks. */
+static inline void resize_wait_ready(qfruntime *rt)
+{
+	uint32_t spins = 0;
+
+	while (__atomic_load_n(&rt->resize_chunks, __ATOMIC_ACQUIRE) == NULL)
+		qf_cpu_relax(&spins);
+}
+
+/* Each insert that reaches a resizing table moves the next chunk, so the
+ * migration is over long before the new table could fill up.  Until the
+ * writers are drained there is nothing to move yet, and inserts wait
+ * rather than run ahead of it. */
+static void resize_help(QF *qf, qfruntime *rt)
+{
+	resize_wait_ready(rt);
+	uint64_t chunk = __sync_fetch_and_add(&rt->resize_cursor, 1);
+	if (chunk < rt->resize_nchunks)
+		resize_migrate_chunk(qf, rt, chunk, false);
+}
+
+/* Makes sure hash's chunk is in the new table. */
+static void resize_move_hash(QF *qf, qfruntime *rt, uint64_t hash)
+{
+	resize_wait_ready(rt);
+	resize_migrate_chunk(qf, rt, resize_chunk_of(rt->resize_next, hash), true);
+}
+
+/* Leaves in cur the table that holds hash's items: the new one during a
+ * resize, once hash's chunk has been moved there, else a snapshot of qf's
+ * header.  Calls that work on one key's run use it instead of finishing
+ * the whole migration. */
+static void resize_route(QF *qf, QF *cur, __uint128_t hash)
+{
+	resize_snapshot(qf, cur);
+	QF *next = __atomic_load_n(&cur->runtimedata->resize_next, __ATOMIC_ACQUIRE);
+	if (next == NULL)
+		return;
+	resize_move_hash(qf, cur->runtimedata, hash);
+	*cur = *next;
+}
+
+/* Finishes a resize in progress, if any, and leaves a snapshot of the
+ * header of the resulting table in cur. */
+static void resize_complete(QF *qf, QF *cur)
+{
+	uint32_t spins = 0;
+	uint64_t i;
+
+	resize_snapshot(qf, cur);
+	qfruntime *rt = cur->runtimedata;
+	if (__atomic_load_n(&rt->resize_next, __ATOMIC_ACQUIRE) == NULL)
+		return;
+	resize_wait_ready(rt);
+	for (i = 0; i < rt->resize_nchunks; i++)
+		resize_migrate_chunk(qf, rt, i, true);
+	while (__atomic_load_n(&qf->runtimedata, __ATOMIC_ACQUIRE) == rt)
+		qf_cpu_relax(&spins);
+	resize_snapshot(qf, cur);
+}
+
+/* The table the indexes returned during a resize refer to: the new one
+ * (qf_get_payload and friends take indexes without their keys). */
+static inline QF *resize_indexed(const QF *qf)
+{
+	QF *next = __atomic_load_n(&qf->runtimedata->resize_next,
+														 __ATOMIC_ACQUIRE);
+	return next != NULL ? next : (QF *)qf;
+}
+
+/* query_validated() for a filter that may be in the middle of a resize.
+ * Reads go to whichever table holds hash's chunk, or to both while the
+ * chunk is still pending, and are retried if the chunk starts moving in
+ * the meantime.  A caller that wants the index gets the chunk moved
+ * first. */
+static int64_t query_routed(const QF *qf, __uint128_t hash, uint64_t
+														*ret_index, __uint128_t *ret_hash, int
+														*ret_hash_len, uint8_t flags)
+{
+	uint32_t spins = 0;
+
+	while (true) {
+		QF cur;
+		resize_snapshot(qf, &cur);
+		qfruntime *rt = cur.runtimedata;
+		QF *next = __atomic_load_n(&rt->resize_next, __ATOMIC_ACQUIRE);
+		if (next == NULL)
+			return query_validated(&cur, hash, ret_index, ret_hash, ret_hash_len,
+														 flags);
+
+		uint64_t chunk = resize_chunk_of(next, hash);
+		volatile uint8_t *chunks = __atomic_load_n(&rt->resize_chunks,
+																							 __ATOMIC_ACQUIRE);
+		uint8_t state = chunks == NULL ? QF_CHUNK_PENDING :
+			__atomic_load_n(&chunks[chunk], __ATOMIC_ACQUIRE);
+		if (state == QF_CHUNK_DONE)
+			return query_validated(next, hash, ret_index, ret_hash, ret_hash_len,
+														 flags);
+		if (state == QF_CHUNK_MOVING) {
+			qf_cpu_relax(&spins);
+			continue;
+		}
+		if (ret_index != NULL) {
+			// indexes handed out during a resize are into the new table (see
+			// resize_indexed), so the chunk has to get there first
+			resize_move_hash((QF *)qf, rt, hash);
+			continue;
+		}
+
+		// pending: old copies are only in cur, new ones only in next
+		uint64_t old_index, new_index;
+		__uint128_t old_hash, new_hash;
+		int old_hash_len, new_hash_len;
+		int64_t old_count = query_validated(&cur, hash, &old_index, &old_hash,
+																				&old_hash_len, flags);
+		int64_t new_count = query_validated(next, hash, &new_index, &new_hash,
+																				&new_hash_len, flags);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		chunks = __atomic_load_n(&rt->resize_chunks, __ATOMIC_RELAXED);
+		if (chunks != NULL && chunks[chunk] != QF_CHUNK_PENDING) {
+			qf_cpu_relax(&spins);
+			continue;
+		}
+		if (old_count < 0)
+			return old_count;
+		if (new_count < 0)
+			return new_count;
+		if (new_count > 0) {
+			if (ret_index != NULL) *ret_index = new_index;
+			if (ret_hash != NULL) *ret_hash = new_hash;
+			if (ret_hash_len != NULL) *ret_hash_len = new_hash_len;
+		} else if (old_count > 0) {
+			if (ret_index != NULL) *ret_index = old_index;
+			if (ret_hash != NULL) *ret_hash = old_hash;
+			if (ret_hash_len != NULL) *ret_hash_len = old_hash_len;
+		}
+		return old_count + new_count;
+	}
+}
+
+bool qf_enable_reverse_map(QF *qf)
+{
+	if (qf->runtimedata->reverse_map != NULL)
+		return true;
+
+	rm_t *rm = (rm_t *)calloc(sizeof(rm_t), 1);
+	if (rm == NULL) {
+		perror("Couldn't allocate memory for the reverse map.");
+		return false;
+	}
+	if (rm_init(rm, qf->metadata->nslots) < 0) {
+		free(rm);
+		return false;
+	}
+	qf->runtimedata->reverse_map = rm;
+
+	return true;
+}
+
+bool qf_reverse_lookup(const QF *qf, uint64_t hash, int hash_len, uint64_t
+											 *key)
+{
+	return qf_reverse_lookup128(qf, hash, hash_len, key);
+}
+
+bool qf_reverse_lookup128(const QF *qf, __uint128_t hash, int hash_len,
+													uint64_t *key)
+{
+	// during a resize, keys of moved chunks are in the new table's map
+	QF *table = resize_indexed(qf);
+	if (revmap_lookup(table, hash, hash_len, key))
+		return true;
+	return table != qf && revmap_lookup((QF *)qf, hash, hash_len, key);
+}
+
+bool qf_enable_payloads(QF *qf)
+{
+	if (qf->runtimedata->payloads != NULL)
+		return true;
+
+	qf->runtimedata->payloads = (uint64_t *)calloc(qf->metadata->xnslots,
+																								 sizeof(uint64_t));
+	if (qf->runtimedata->payloads == NULL) {
+		perror("Couldn't allocate memory for payloads.");
+		return false;
+	}
+
+	return true;
+}
+
+uint64_t qf_get_payload(const QF *qf, uint64_t index)
+{
+	qf = resize_indexed(qf);
+	assert(qf->runtimedata->payloads != NULL && index < qf->metadata->xnslots);
+	return qf->runtimedata->payloads[index];
+}
+
+void qf_set_payload(QF *qf, uint64_t index, uint64_t payload)
+{
+	qf = resize_indexed(qf);
+	assert(qf->runtimedata->payloads != NULL && index < qf->metadata->xnslots);
+	qf->runtimedata->payloads[index] = payload;
+}
+
+bool qf_set_adapt_policy(QF *qf, const qf_adapt_policy *policy)
+{
+	qfruntime *rt = qf->runtimedata;
+
+	if (policy->lazy_threshold > 1 && rt->fp_counts == NULL) {
+		rm_t *counts = (rm_t *)calloc(sizeof(rm_t), 1);
+		if (counts == NULL) {
+			perror("Couldn't allocate memory for false-positive counts.");
+			return false;
+		}
+		if (rm_init(counts, 0) < 0) {
+			free(counts);
+			return false;
+		}
+		rt->fp_counts = counts;
+	} else if (policy->lazy_threshold <= 1 && rt->fp_counts != NULL) {
+		rm_destructor(rt->fp_counts);
+		free(rt->fp_counts);
+		rt->fp_counts = NULL;
+	}
+	rt->adapt_policy = *policy;
+
+	/* the count starts at zero for a filter that was loaded from disk */
+	uint64_t i, ext_slots = 0;
+	for (i = 0; i < qf->metadata->nblocks; i++)
+		ext_slots += popcnt(get_block(qf, i)->extensions[0] & ~get_block(qf,
+																																		 i)->runends[0]);
+	rt->ext_slots = ext_slots;
+
+	return true;
+}
+
+void qf_get_adapt_policy(const QF *qf, qf_adapt_policy *policy)
+{
+	*policy = qf->runtimedata->adapt_policy;
+}
+
+uint64_t qf_get_num_extension_slots(const QF *qf)
+{
+	return qf->runtimedata->ext_slots;
+}
+
+void qf_set_auto_resize(QF* qf, bool enabled)
+{
+	if (enabled)
+		qf->runtimedata->auto_resize = 1;
+	else
+		qf->runtimedata->auto_resize = 0;
+}
+
+bool qf_set_lock_regions(QF *qf, uint64_t slots_per_lock, uint64_t
+												 cluster_size)
+{
+	qfruntime *rt = qf->runtimedata;
+
+	// a block's metadata words are written under the lock of one region
+	if (slots_per_lock < QF_SLOTS_PER_BLOCK || (slots_per_lock &
+																							(slots_per_lock - 1)) ||
+			cluster_size == 0)
+		return false;
+	rt->slots_per_lock = slots_per_lock;
+	rt->cluster_size = cluster_size;
+	rt->num_locks = (qf->metadata->xnslots/slots_per_lock)+2;
+
+	free(rt->locks);
+	free((void*)rt->versions);
+	free(rt->wait_times);
+	rt->wait_times = NULL;
+	rt->locks = (qf_region_lock *)aligned_alloc(sizeof(qf_region_lock),
+																							rt->num_locks *
+																							sizeof(qf_region_lock));
+	if (rt->locks == NULL) {
+		perror("Couldn't allocate memory for runtime locks.");
+		exit(EXIT_FAILURE);
+	}
+	memset(rt->locks, 0, rt->num_locks * sizeof(qf_region_lock));
+	rt->versions = (volatile uint64_t *)calloc(rt->num_locks, sizeof(uint64_t));
+	if (rt->versions == NULL) {
+		perror("Couldn't allocate memory for runtime versions.");
+		exit(EXIT_FAILURE);
+	}
+#ifdef LOG_WAIT_TIME
+	rt->wait_times = (wait_time_data* )calloc(rt->num_locks+1,
+																						sizeof(wait_time_data));
+	if (rt->wait_times == NULL) {
+		perror("Couldn't allocate memory for runtime wait_times.");
+		exit(EXIT_FAILURE);
+	}
+#endif
+	return true;
+}
+
+/* qf_tune_lock_regions aims for this many lock regions per thread, but
+ * doesn't go below QF_MIN_SLOTS_PER_LOCK slots per region: removes and
+ * qf_lock_buckets still take every region within cluster_size slots. */
+#define QF_REGIONS_PER_THREAD 4
+#define QF_MIN_SLOTS_PER_LOCK (1ULL << 12)
+
+void qf_tune_lock_regions(QF *qf, int nthreads)
+{
+	uint64_t slots_per_lock = NUM_SLOTS_TO_LOCK;
+
+	if (nthreads <= 0)
+		nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads <= 0)
+		nthreads = 1;
+	while (slots_per_lock > QF_MIN_SLOTS_PER_LOCK && qf->metadata->xnslots /
+				 slots_per_lock < (uint64_t)nthreads * QF_REGIONS_PER_THREAD)
+		slots_per_lock >>= 1;
+	qf_set_lock_regions(qf, slots_per_lock, qf->runtimedata->cluster_size);
+}
+
+uint64_t qf_get_slots_per_lock(const QF *qf)
+{
+	return qf->runtimedata->slots_per_lock;
+}
+
+void qf_set_lock_kind(QF *qf, enum qf_lock_kind kind)
+{
+	qf->runtimedata->lock_kind = kind;
+	memset(qf->runtimedata->locks, 0, qf->runtimedata->num_locks *
+				 sizeof(qf_region_lock));
+}
+
+bool qf_lock_buckets(QF *qf, uint64_t first, uint64_t last, uint8_t flags)
+{
+	uint64_t first_region, last_region, unused;
+
+	lock_region_range(qf, first, /*small*/ false, &first_region, &unused);
+	lock_region_range(qf, last, /*small*/ false, &unused, &last_region);
+	return lock_regions(qf, first_region, last_region, flags);
+}
+
+void qf_unlock_buckets(QF *qf, uint64_t first, uint64_t last)
+{
+	uint64_t first_region, last_region, unused;
+
+	lock_region_range(qf, first, /*small*/ false, &first_region, &unused);
+	lock_region_range(qf, last, /*small*/ false, &unused, &last_region);
+	unlock_regions(qf, first_region, last_region);
+}
+
+// hash is already hashed; hash_bits of it are meaningful
+static int insert_ret(QF *qf, __uint128_t hash, uint64_t orig_key, uint64_t count, int hash_bits, uint64_t *ret_index, __uint128_t *ret_hash, int *ret_hash_len, uint8_t flags)
+{
+	QF cur;
+	resize_snapshot(qf, &cur);
+	QF *next = __atomic_load_n(&cur.runtimedata->resize_next, __ATOMIC_ACQUIRE);
+	if (next != NULL) {
+		// as in qf_insert, pay for a chunk of the move.  The key's own chunk
+		// has to be in the new table first, so that the item it collides with
+		// is found and the returned index points into the new table.
+		resize_help(qf, cur.runtimedata);
+		resize_move_hash(qf, cur.runtimedata, hash);
+		cur = *next;
+	} else if (!below_max_occupancy(&cur, item_slots(&cur, count))) {
+		// We fill up the CQF up to 95% load factor.
+		// This is a very conservative check.
+		if (!cur.runtimedata->auto_resize)
+			return QF_NO_SPACE;
+		if (cur.runtimedata->container_resize == qf_resize_malloc) {
+			// migrate incrementally instead of stalling this insert
+			if (!resize_start(qf, &cur))
+				return QF_NO_SPACE;
+			return insert_ret(qf, hash, orig_key, count, hash_bits, ret_index, ret_hash, ret_hash_len, flags);
+		}
+		if (cur.runtimedata->container_resize(qf, cur.metadata->nslots * 2) < 0)
+		{
+			fprintf(stderr, "Resizing the failed.\n");
 			return QF_NO_SPACE;
 		}
+		resize_snapshot(qf, &cur);
 	}
 	if (count == 0)
 		return 0;
 
-	if (GET_KEY_HASH(flags) != QF_KEY_IS_HASH) {
-		if (qf->metadata->hash_mode == QF_HASH_DEFAULT)
-			key = MurmurHash64A(((void *)&key), sizeof(key),
-													qf->metadata->seed) % qf->metadata->range;
-		else if (qf->metadata->hash_mode == QF_HASH_INVERTIBLE)
-			key = hash_64(key, BITMASK(qf->metadata->key_bits));
+	int ret = insert(&cur, hash, count, orig_key, hash_bits, ret_index, ret_hash, ret_hash_len, flags);
+	if (resize_retry(ret))
+		return insert_ret(qf, hash, orig_key, count, hash_bits, ret_index, ret_hash, ret_hash_len, flags);
+	if (ret == 1 && revmap_add(&cur, *ret_hash, *ret_hash_len, orig_key) < 0)
+		return QF_NO_MEMORY;
+
+	return ret;
+}
+
+/*
+key - 
+*/
+int qf_insert_ret(QF *qf, uint64_t key, uint64_t count, uint64_t *ret_index, uint64_t *ret_hash, int *ret_hash_len, uint8_t flags)
+{
+	__uint128_t hash = 0;
+	int ret = insert_ret(qf, key_to_hash(qf, key, flags), key, count, 64, ret_index, &hash, ret_hash_len, flags);
+	*ret_hash = hash;
+	return ret;
+}
+
+int qf_insert_ret128(QF *qf, __uint128_t key, uint64_t count, uint64_t *ret_index, __uint128_t *ret_hash, int *ret_hash_len, uint8_t flags)
+{
+	return insert_ret(qf, key_to_hash128(qf, key, flags), key, count, 128, ret_index, ret_hash, ret_hash_len, flags);
+}
+
+// inserts hash, or adds count to the item it already matches.  Both happen
+// under one lock, so the item can't move between finding and bumping it.
+static int insert_or_count(QF *qf, uint64_t hash, uint64_t key, uint64_t
+													 count, uint8_t flags)
+{
+	uint64_t first_region, last_region;
+	if (GET_NO_LOCK(flags) != QF_NO_LOCK) {
+		uint64_t hash_bucket_index = (hash >> qf->metadata->bits_per_slot) &
+			BITMASK(qf->metadata->quotient_bits);
+		if (!lock_for_shift(qf, hash_bucket_index, shift_slots_bound(qf, count,
+																																	64),
+												flags, &first_region, &last_region))
+			return QF_COULDNT_LOCK;
 	}
-	//uint64_t hash = ((key << qf->metadata->value_bits) | (value & BITMASK(qf->metadata->value_bits)));// % qf->metadata->range;
-  uint64_t hash = key;
-	
-	//uint64_t *found_index = malloc(sizeof(uint64_t)), *found_hash = malloc(sizeof(uint64_t));
-	int ret = insert(qf, hash, count, ret_index, ret_hash, ret_hash_len, flags);
-	//free(found_index);
-	//free(found_hash);
 
-	/*
-	// check for fullness based on the distance from the home slot to the slot
-	// in which the key is inserted
-	if (ret == QF_NO_SPACE || ret > DISTANCE_FROM_HOME_SLOT_CUTOFF) {
-		float load_factor = qf_get_num_occupied_slots(qf) /
-			(float)qf->metadata->nslots;
-		fprintf(stdout, "Load factor: %lf\n", load_factor);
-		if (qf->runtimedata->auto_resize) {
-			fprintf(stdout, "Resizing the CQF.\n");
-			if (qf->runtimedata->container_resize(qf, qf->metadata->nslots * 2) > 0)
-			{
-				if (ret == QF_NO_SPACE) {
-					if (count == 1)
-						ret = insert1(qf, hash, flags);
-					else
-						ret = insert(qf, hash, count, flags);
-				}
-				fprintf(stderr, "Resize finished.\n");
-			} else {
-				fprintf(stderr, "Resize failed\n");
-				ret = QF_NO_SPACE;
-			}
-		} else {
-			fprintf(stderr, "The CQF is filling up.\n");
-			ret = QF_NO_SPACE;
-		}
-	}*/
+	uint64_t found_index;
+	__uint128_t found_hash;
+	int found_hash_len;
+	int ret = insert(qf, hash, count, key, 64, &found_index, &found_hash, &found_hash_len, flags | QF_NO_LOCK);
+	if (ret == 0) {
+		// already there: bump its counter
+		__uint128_t placeholder;
+		ret = extend_item(qf, found_index, hash, count, hash, key, 64, &placeholder, &placeholder, flags | QF_NO_LOCK);
+	}
+
+	if (GET_NO_LOCK(flags) != QF_NO_LOCK)
+		unlock_regions(qf, first_region, last_region);
+	return ret;
+}
+
+// insert_or_count for an item whose key is known: an item it collides with
+// whose key is known too is told apart from it by extending both, as
+// insert_and_extend would.  Keeps the reverse map up to date.
+static int insert_or_extend(QF *qf, uint64_t hash, uint64_t key, uint64_t
+														count, uint8_t flags)
+{
+	uint64_t first_region, last_region;
+	if (GET_NO_LOCK(flags) != QF_NO_LOCK) {
+		uint64_t hash_bucket_index = (hash >> qf->metadata->bits_per_slot) &
+			BITMASK(qf->metadata->quotient_bits);
+		if (!lock_for_shift(qf, hash_bucket_index, shift_slots_bound(qf, count,
+																																	64),
+												flags, &first_region, &last_region))
+			return QF_COULDNT_LOCK;
+	}
+
+	uint64_t found_index, other_key = 0, other_hash = hash;
+	__uint128_t found_hash, placeholder;
+	int found_hash_len;
+	int ret = insert(qf, hash, count, key, 64, &found_index, &found_hash, &found_hash_len, flags | QF_NO_LOCK);
+	if (ret == 1) {
+		if (revmap_add(qf, found_hash, found_hash_len, key) < 0)
+			ret = QF_NO_MEMORY;
+	} else if (ret == 0) {
+		bool known = qf->runtimedata->payloads != NULL;
+		if (known)
+			other_key = qf->runtimedata->payloads[found_index];
+		else
+			known = revmap_lookup(qf, found_hash, found_hash_len, &other_key);
+		// with other_hash == hash this just bumps the counter
+		if (!known || other_key == key || !key_has_fingerprint(qf, other_key,
+																													 found_hash,
+																													 found_hash_len,
+																													 &other_hash))
+			other_hash = hash;
+		ret = extend_item(qf, found_index, hash, count, other_hash, key, 64, &placeholder, &placeholder, flags | QF_NO_LOCK);
+	}
+
+	if (GET_NO_LOCK(flags) != QF_NO_LOCK)
+		unlock_regions(qf, first_region, last_region);
 	return ret;
 }
 
 int qf_insert(QF *qf, uint64_t key, uint64_t value, uint64_t count, uint8_t flags)
 {
+	QF cur;
+	int ret;
+	resize_snapshot(qf, &cur);
+	QF *next = __atomic_load_n(&cur.runtimedata->resize_next, __ATOMIC_ACQUIRE);
+	if (next != NULL) {
+		// new items go straight to the new table; pay for a chunk of the move.
+		// Only qf's header may resize, so next skips the fullness check.
+		resize_help(qf, cur.runtimedata);
+		if (count == 0)
+			return 0;
+		ret = insert_or_count(next, key_value_to_hash(next, key, value, flags),
+													key, count, flags);
+		if (resize_retry(ret))
+			return qf_insert(qf, key, value, count, flags);
+		return ret;
+	}
+
 	// We fill up the CQF up to 95% load factor.
 	// This is a very conservative check.
-	if (qf_get_num_occupied_slots(qf) >= qf->metadata->nslots * 0.95) {
-		if (qf->runtimedata->auto_resize) {
+	if (!below_max_occupancy(&cur, item_slots(&cur, count))) {
+		if (cur.runtimedata->auto_resize) {
 			/*fprintf(stdout, "Resizing the CQF.\n");*/
-			if (qf->runtimedata->container_resize(qf, qf->metadata->nslots * 2) < 0)
+			if (cur.runtimedata->container_resize == qf_resize_malloc) {
+				// migrate incrementally instead of stalling this insert
+				if (!resize_start(qf, &cur))
+					return QF_NO_SPACE;
+				return qf_insert(qf, key, value, count, flags);
+			}
+			if (cur.runtimedata->container_resize(qf, cur.metadata->nslots * 2) < 0)
 			{
 				fprintf(stderr, "Resizing the failed.\n");
 				return QF_NO_SPACE;
 			}
+			resize_snapshot(qf, &cur);
 		} else
 			return QF_NO_SPACE;
 	}
 	if (count == 0)
 		return 0;
 
-	if (GET_KEY_HASH(flags) != QF_KEY_IS_HASH) {
-		if (qf->metadata->hash_mode == QF_HASH_DEFAULT)
-			key = MurmurHash64A(((void *)&key), sizeof(key),
-													qf->metadata->seed) % qf->metadata->range;
-		else if (qf->metadata->hash_mode == QF_HASH_INVERTIBLE)
-			key = hash_64(key, BITMASK(qf->metadata->key_bits));
-	}
-	uint64_t hash = ((key << qf->metadata->value_bits) | (value & BITMASK(qf->metadata->value_bits))) % qf->metadata->range;
-	
-	uint64_t found_index, found_hash, found_hash_len;
-	int ret = insert(qf, hash, count, &found_index, &found_hash, &found_hash_len, flags);
+	ret = insert_or_count(&cur, key_value_to_hash(&cur, key, value, flags), key,
+												count, flags);
+	if (resize_retry(ret))
+		return qf_insert(qf, key, value, count, flags);
 
 	/*
 	// check for fullness based on the distance from the home slot to the slot
@@ -2246,6 +3579,657 @@ int qf_insert(QF *qf, uint64_t key, uint64_t value, uint64_t count, uint8_t flag
 	return ret;
 }
 
+/* Bulk construction.  The hashes are partitioned by quotient into one range
+ * of buckets per thread, and each thread sorts its range and lays out its
+ * runs from the start of the range, with nothing to shift.  Ranges start on
+ * block boundaries, so threads never share a metadata word or an offset.
+ * A thread stops at the first item that would run past the end of its
+ * range; a final pass lays out those items and moves the front of the next
+ * range along, up to the first run that lands where it already is. */
+
+/* Where the next item goes while laying out runs in bucket order. */
+typedef struct bulk_cursor {
+	uint64_t pos;					/* first free slot */
+	uint64_t bucket;			/* bucket of the open run, or UINT64_MAX */
+	uint64_t last_item;		/* first slot of the open run's last item */
+} bulk_cursor;
+
+typedef struct bulk_range {
+	uint64_t first, last;	/* items of the range in bulk_build.sorted */
+	uint64_t placed;			/* items laid out by the range's thread */
+	bulk_cursor cursor;		/* cursor after them */
+} bulk_range;
+
+typedef struct bulk_build {
+	QF *qf;
+	const uint64_t *hashes;
+	uint64_t n;
+	int nranges;
+	uint64_t range_buckets;
+	uint64_t *histogram;	/* items per (thread, range) */
+	uint64_t *next;				/* per thread, where each range's items go next */
+	uint64_t *sorted;
+	uint64_t *scratch;		/* fingerprints in input order, then sort space */
+	bulk_range *ranges;
+	pthread_barrier_t barrier;
+	pthread_mutex_t start;	/* held until every thread is running */
+	bool abort;							/* a thread couldn't be started */
+} bulk_build;
+
+typedef struct bulk_thread {
+	bulk_build *b;
+	int id;
+	pthread_t thread;
+} bulk_thread;
+
+static inline uint64_t bulk_fingerprint(const QF *qf, uint64_t hash)
+{
+	return key_value_to_hash(qf, hash, 0, QF_KEY_IS_HASH) &
+		BITMASK(qf->metadata->quotient_bits + qf->metadata->bits_per_slot);
+}
+
+static inline int bulk_range_of(const bulk_build *b, uint64_t fingerprint)
+{
+	return (fingerprint >> b->qf->metadata->bits_per_slot) / b->range_buckets;
+}
+
+/* Sorts keys[0..n) on their low bits bits, a byte at a time, using tmp. */
+static void bulk_radix_sort(uint64_t *keys, uint64_t *tmp, uint64_t n, int
+														bits)
+{
+	uint64_t count[256], i;
+	int shift;
+
+	for (shift = 0; shift < bits; shift += 8) {
+		uint64_t sum = 0;
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < n; i++)
+			count[(keys[i] >> shift) & 0xff]++;
+		for (i = 0; i < 256; i++) {
+			uint64_t c = count[i];
+			count[i] = sum;
+			sum += c;
+		}
+		for (i = 0; i < n; i++)
+			tmp[count[(keys[i] >> shift) & 0xff]++] = keys[i];
+		uint64_t *t = keys;
+		keys = tmp;
+		tmp = t;
+	}
+	// an odd number of passes leaves the result in the buffer
+	if ((bits + 7) / 8 % 2)
+		memcpy(tmp, keys, n * sizeof(uint64_t));
+}
+
+/* Counter slots an item with this count takes (see extend_item). */
+static inline uint64_t bulk_counter_slots(const QF *qf, uint64_t count)
+{
+	uint64_t n = 0;
+	if (count > 1)
+		for (; count > 0; count >>= qf->metadata->bits_per_slot)
+			n++;
+	return n;
+}
+
+/* Sets the runend of the open run and points the blocks it spills into
+ * past it, as cluster_encode does. */
+static void bulk_close_run(QF *qf, bulk_cursor *c)
+{
+	uint64_t b;
+
+	if (c->bucket == UINT64_MAX)
+		return;
+	METADATA_WORD(qf, runends, c->last_item) |= 1ULL << (c->last_item % 64);
+	for (b = c->bucket / QF_SLOTS_PER_BLOCK + 1; b <= (c->pos - 1) /
+			 QF_SLOTS_PER_BLOCK; b++) {
+		uint64_t offset = c->pos - b * QF_SLOTS_PER_BLOCK;
+		get_block(qf, b)->offset = offset < BITMASK(8*sizeof(qf->blocks[0].offset)) ?
+			offset : BITMASK(8*sizeof(qf->blocks[0].offset));
+	}
+	c->bucket = UINT64_MAX;
+}
+
+/* Where the item would start, or UINT64_MAX if it would reach limit. */
+static inline uint64_t bulk_item_start(const QF *qf, const bulk_cursor *c,
+																			 uint64_t fingerprint, int ext_len,
+																			 uint64_t count, uint64_t limit)
+{
+	uint64_t bucket = fingerprint >> qf->metadata->bits_per_slot;
+	uint64_t start = bucket == c->bucket || c->pos > bucket ? c->pos : bucket;
+	if (start + 1 + ext_len + bulk_counter_slots(qf, count) > limit)
+		return UINT64_MAX;
+	return start;
+}
+
+/* Lays out the item at start (from bulk_item_start), with ext_len
+ * extension slots holding ext.  Every slot it covers is written in full,
+ * since the final pass writes over earlier layouts. */
+static void bulk_place(QF *qf, bulk_cursor *c, uint64_t fingerprint, uint64_t
+											 ext, int ext_len, uint64_t count, uint64_t start)
+{
+	uint64_t bucket = fingerprint >> qf->metadata->bits_per_slot;
+	uint64_t i, n = bulk_counter_slots(qf, count);
+
+	if (bucket != c->bucket) {
+		bulk_close_run(qf, c);
+		METADATA_WORD(qf, occupieds, bucket) |= 1ULL << (bucket % 64);
+		c->bucket = bucket;
+	}
+	set_slot(qf, start, fingerprint & BITMASK(qf->metadata->bits_per_slot));
+	set_payload(qf, start, 0);
+	METADATA_WORD(qf, runends, start) &= ~(1ULL << (start % 64));
+	METADATA_WORD(qf, extensions, start) &= ~(1ULL << (start % 64));
+	for (i = start + 1; i <= start + ext_len; i++) {
+		set_slot(qf, i, ext & BITMASK(qf->metadata->bits_per_slot));
+		set_payload(qf, i, 0);
+		METADATA_WORD(qf, runends, i) &= ~(1ULL << (i % 64));
+		METADATA_WORD(qf, extensions, i) |= 1ULL << (i % 64);
+		ext >>= qf->metadata->bits_per_slot;
+	}
+	start += ext_len;
+	for (i = start + 1; i <= start + n; i++) {
+		set_slot(qf, i, count & BITMASK(qf->metadata->bits_per_slot));
+		set_payload(qf, i, 0);
+		METADATA_WORD(qf, runends, i) |= 1ULL << (i % 64);
+		METADATA_WORD(qf, extensions, i) |= 1ULL << (i % 64);
+		count >>= qf->metadata->bits_per_slot;
+	}
+	c->last_item = start - ext_len;
+	c->pos = start + 1 + n;
+}
+
+/* The item at sorted[*i], merged with the copies that follow it. */
+static inline uint64_t bulk_next_item(const bulk_build *b, uint64_t last,
+																			uint64_t *i, uint64_t *count)
+{
+	uint64_t fingerprint = b->sorted[*i];
+	*count = 0;
+	while (*i < last && b->sorted[*i] == fingerprint) {
+		(*count)++;
+		(*i)++;
+	}
+	return fingerprint;
+}
+
+static void *bulk_build_thread(void *arg)
+{
+	bulk_thread *t = (bulk_thread *)arg;
+	bulk_build *b = t->b;
+	QF *qf = b->qf;
+	uint64_t first = b->n * t->id / b->nranges;
+	uint64_t last = b->n * (t->id + 1) / b->nranges;
+	uint64_t *histogram = &b->histogram[(uint64_t)t->id * b->nranges];
+	uint64_t *next = &b->next[(uint64_t)t->id * b->nranges];
+	uint64_t i;
+	int r;
+
+	// nobody reaches the barrier until every thread is up, so that one that
+	// couldn't be started doesn't leave the others waiting there
+	pthread_mutex_lock(&b->start);
+	pthread_mutex_unlock(&b->start);
+	if (b->abort)
+		return NULL;
+
+	// partition the hashes by range; each thread owns a slice of the input
+	// and a stretch of every range
+	for (i = first; i < last; i++) {
+		b->scratch[i] = bulk_fingerprint(qf, b->hashes[i]);
+		histogram[bulk_range_of(b, b->scratch[i])]++;
+	}
+	pthread_barrier_wait(&b->barrier);
+	uint64_t base = 0;
+	for (r = 0; r < b->nranges; r++) {
+		uint64_t size = 0;
+		int u;
+		next[r] = base;
+		for (u = 0; u < b->nranges; u++) {
+			if (u < t->id)
+				next[r] += b->histogram[(uint64_t)u * b->nranges + r];
+			size += b->histogram[(uint64_t)u * b->nranges + r];
+		}
+		if (r == t->id) {
+			b->ranges[r].first = base;
+			b->ranges[r].last = base + size;
+		}
+		base += size;
+	}
+	for (i = first; i < last; i++) {
+		uint64_t fingerprint = b->scratch[i];
+		b->sorted[next[bulk_range_of(b, fingerprint)]++] = fingerprint;
+	}
+	pthread_barrier_wait(&b->barrier);
+
+	// lay out this thread's range up to where it would spill
+	bulk_range *range = &b->ranges[t->id];
+	uint64_t limit = (t->id + 1) * b->range_buckets;
+	if (limit > qf->metadata->nslots)
+		limit = qf->metadata->nslots;
+	bulk_radix_sort(&b->sorted[range->first], &b->scratch[range->first],
+									range->last - range->first, qf->metadata->quotient_bits +
+									qf->metadata->bits_per_slot);
+	bulk_cursor *c = &range->cursor;
+	c->pos = t->id * b->range_buckets;
+	c->bucket = UINT64_MAX;
+	for (i = range->first; i < range->last;) {
+		uint64_t count, j = i;
+		uint64_t fingerprint = bulk_next_item(b, range->last, &j, &count);
+		uint64_t start = bulk_item_start(qf, c, fingerprint, 0, count, limit);
+		if (start == UINT64_MAX)
+			break;
+		bulk_place(qf, c, fingerprint, 0, 0, count, start);
+		i = j;
+	}
+	range->placed = i;
+	return NULL;
+}
+
+int64_t qf_bulk_build(QF *qf, const uint64_t *hashes, uint64_t n, int
+											nthreads)
+{
+	bulk_build b;
+	int r;
+
+	if (qf_get_num_occupied_slots(qf) != 0)
+		return QF_INVALID;
+	if (nthreads < 1)
+		nthreads = 1;
+	memset(&b, 0, sizeof(b));
+	b.qf = qf;
+	b.hashes = hashes;
+	b.n = n;
+	b.range_buckets = (qf->metadata->nslots + nthreads - 1) / nthreads;
+	b.range_buckets = (b.range_buckets + QF_SLOTS_PER_BLOCK - 1) /
+		QF_SLOTS_PER_BLOCK * QF_SLOTS_PER_BLOCK;
+	b.nranges = (qf->metadata->nslots + b.range_buckets - 1) / b.range_buckets;
+	b.histogram = (uint64_t *)calloc((uint64_t)b.nranges * b.nranges,
+																	 sizeof(uint64_t));
+	b.next = (uint64_t *)malloc((uint64_t)b.nranges * b.nranges *
+															sizeof(uint64_t));
+	b.sorted = (uint64_t *)malloc(n * sizeof(uint64_t));
+	b.scratch = (uint64_t *)malloc(n * sizeof(uint64_t));
+	b.ranges = (bulk_range *)calloc(b.nranges, sizeof(bulk_range));
+	bulk_thread *threads = (bulk_thread *)calloc(b.nranges,
+																							 sizeof(bulk_thread));
+	if (b.histogram == NULL || b.next == NULL || b.sorted == NULL || b.scratch
+			== NULL || b.ranges == NULL || threads == NULL) {
+		free(threads);
+		free(b.ranges);
+		free(b.scratch);
+		free(b.sorted);
+		free(b.next);
+		free(b.histogram);
+		return QF_NO_MEMORY;
+	}
+	pthread_barrier_init(&b.barrier, NULL, b.nranges);
+	pthread_mutex_init(&b.start, NULL);
+
+	for (r = 0; r < b.nranges; r++) {
+		threads[r].b = &b;
+		threads[r].id = r;
+	}
+	pthread_mutex_lock(&b.start);
+	for (r = 1; r < b.nranges; r++)
+		if (pthread_create(&threads[r].thread, NULL, bulk_build_thread,
+											 &threads[r]))
+			break;
+	int started = r;
+	b.abort = started < b.nranges;
+	pthread_mutex_unlock(&b.start);
+	bulk_build_thread(&threads[0]);
+	for (r = 1; r < started; r++)
+		pthread_join(threads[r].thread, NULL);
+	pthread_mutex_destroy(&b.start);
+	pthread_barrier_destroy(&b.barrier);
+	if (b.abort) {
+		// nothing was written yet: build again with the threads there were
+		free(threads);
+		free(b.ranges);
+		free(b.scratch);
+		free(b.sorted);
+		free(b.next);
+		free(b.histogram);
+		return qf_bulk_build(qf, hashes, n, started);
+	}
+
+	// fix up the spills: ranges whose front was spilled into are laid out
+	// again until a run lands where the range's own thread put it
+	bulk_cursor c = { 0, UINT64_MAX, 0 };
+	int64_t ret = 0;
+	uint64_t distinct = 0, used = 0;
+	for (r = 0; r < b.nranges && ret == 0; r++) {
+		bulk_range *range = &b.ranges[r];
+		bulk_cursor old = { r * b.range_buckets, UINT64_MAX, 0 };
+		uint64_t i = range->first;
+		bool moved = c.pos > old.pos;
+
+		for (; moved && i < range->placed;) {
+			uint64_t count, j = i;
+			uint64_t fingerprint = bulk_next_item(&b, range->last, &j, &count);
+			uint64_t start = bulk_item_start(qf, &c, fingerprint, 0, count,
+																			 qf->metadata->xnslots);
+			uint64_t old_start = bulk_item_start(qf, &old, fingerprint, 0,
+																					 count, UINT64_MAX);
+			if (start == UINT64_MAX) {
+				ret = QF_NO_SPACE;
+				break;
+			}
+			if (start == old_start && (fingerprint >> qf->metadata->bits_per_slot)
+					!= c.bucket) {
+				moved = false;
+				break;
+			}
+			bulk_place(qf, &c, fingerprint, 0, 0, count, start);
+			// old only tracks positions; nothing is written for it
+			old.bucket = fingerprint >> qf->metadata->bits_per_slot;
+			old.pos = old_start + 1 + bulk_counter_slots(qf, count);
+			i = j;
+		}
+		if (!moved) {
+			bulk_close_run(qf, &c);
+			c = range->cursor;
+			i = range->placed;
+		}
+		for (; ret == 0 && i < range->last;) {
+			uint64_t count, j = i;
+			uint64_t fingerprint = bulk_next_item(&b, range->last, &j, &count);
+			uint64_t start = bulk_item_start(qf, &c, fingerprint, 0, count,
+																			 qf->metadata->xnslots);
+			if (start == UINT64_MAX) {
+				ret = QF_NO_SPACE;
+				break;
+			}
+			bulk_place(qf, &c, fingerprint, 0, 0, count, start);
+			i = j;
+		}
+	}
+	if (ret == 0)
+		bulk_close_run(qf, &c);
+
+	for (r = 0; r < b.nranges && ret == 0; r++) {
+		uint64_t i = b.ranges[r].first, count;
+		while (i < b.ranges[r].last) {
+			bulk_next_item(&b, b.ranges[r].last, &i, &count);
+			distinct++;
+			used += 1 + bulk_counter_slots(qf, count);
+		}
+	}
+	free(threads);
+	free(b.ranges);
+	free(b.scratch);
+	free(b.sorted);
+	free(b.next);
+	free(b.histogram);
+	if (ret < 0) {
+		qf_reset(qf);
+		return ret;
+	}
+	pc_add(&qf->runtimedata->pc_nelts, n);
+	pc_add(&qf->runtimedata->pc_ndistinct_elts, distinct);
+	pc_add(&qf->runtimedata->pc_noccupied_slots, used);
+	return distinct;
+}
+
+/* Sorted bulk load.  The hashes of a bucket are gathered and put in
+ * remainder order, so that the ones sharing a fingerprint sit together and
+ * each can get, up front, the extension slots insert_and_extend would have
+ * given it: enough to tell it apart from every other hash of its
+ * fingerprint. */
+typedef struct bulk_load_item {
+	uint64_t hash;
+	uint64_t count;
+} bulk_load_item;
+
+static inline bool bulk_load_before(const QF *qf, const bulk_load_item *x,
+																		const bulk_load_item *y)
+{
+	uint64_t rx = x->hash & BITMASK(qf->metadata->bits_per_slot);
+	uint64_t ry = y->hash & BITMASK(qf->metadata->bits_per_slot);
+	return rx < ry || (rx == ry && x->hash < y->hash);
+}
+
+/* Extension slots it takes for two hashes of one fingerprint to differ. */
+static inline int bulk_load_ext_len(const QF *qf, uint64_t hash, uint64_t
+																		other)
+{
+	int shift = qf->metadata->quotient_bits + qf->metadata->bits_per_slot;
+	return __builtin_ctzll((hash ^ other) >> shift) /
+		qf->metadata->bits_per_slot + 1;
+}
+
+int64_t qf_bulk_load_sorted(QF *qf, const uint64_t *hashes, const uint64_t
+														*counts, uint64_t n)
+{
+	const uint64_t bits_per_slot = qf->metadata->bits_per_slot;
+	const uint64_t fingerprint_bits = qf->metadata->quotient_bits +
+		bits_per_slot;
+	bulk_cursor c = { 0, UINT64_MAX, 0 };
+	bulk_load_item *group = NULL;
+	uint64_t capacity = 0, i = 0, total = 0, distinct = 0, used = 0, ext = 0;
+	int64_t ret = 0;
+
+	if (qf_get_num_occupied_slots(qf) != 0)
+		return QF_INVALID;
+	while (i < n && ret == 0) {
+		uint64_t bucket = (hashes[i] >> bits_per_slot) &
+			BITMASK(qf->metadata->quotient_bits);
+		uint64_t j, k, m = 0;
+
+		for (j = i; j < n && ((hashes[j] >> bits_per_slot) &
+													BITMASK(qf->metadata->quotient_bits)) == bucket;
+				 j++) {
+			bulk_load_item item = { hashes[j], counts == NULL ? 1 : counts[j] };
+			if (item.count == 0)
+				continue;
+			if (m == capacity) {
+				uint64_t grown = capacity == 0 ? 16 : 2 * capacity;
+				bulk_load_item *p = (bulk_load_item *)realloc(group, grown *
+																											sizeof(bulk_load_item));
+				if (p == NULL) {
+					ret = QF_NO_MEMORY;
+					break;
+				}
+				group = p;
+				capacity = grown;
+			}
+			// runs are short, so an insertion sort is all it takes
+			for (k = m; k > 0 && bulk_load_before(qf, &item, &group[k - 1]); k--)
+				group[k] = group[k - 1];
+			group[k] = item;
+			m++;
+		}
+		if (ret < 0)
+			break;
+		if (j < n && ((hashes[j] >> bits_per_slot) &
+									BITMASK(qf->metadata->quotient_bits)) < bucket) {
+			ret = QF_INVALID;
+			break;
+		}
+		// copies of a hash are one item
+		uint64_t items = 0;
+		for (k = 0; k < m; k++) {
+			if (items > 0 && group[items - 1].hash == group[k].hash)
+				group[items - 1].count += group[k].count;
+			else
+				group[items++] = group[k];
+		}
+
+		uint64_t first = 0;
+		for (k = 0; k < items; k++) {
+			uint64_t fingerprint = group[k].hash & BITMASK(fingerprint_bits);
+			uint64_t l;
+			int ext_len = 0;
+			if ((group[first].hash & BITMASK(bits_per_slot)) !=
+					(group[k].hash & BITMASK(bits_per_slot)))
+				first = k;
+			for (l = first; l < items && (group[l].hash & BITMASK(bits_per_slot))
+						 == (group[k].hash & BITMASK(bits_per_slot)); l++)
+				if (l != k) {
+					int len = bulk_load_ext_len(qf, group[k].hash, group[l].hash);
+					if (len > ext_len)
+						ext_len = len;
+				}
+			uint64_t start = bulk_item_start(qf, &c, fingerprint, ext_len,
+																			 group[k].count, qf->metadata->xnslots);
+			if (start == UINT64_MAX) {
+				ret = QF_NO_SPACE;
+				break;
+			}
+			bulk_place(qf, &c, fingerprint, group[k].hash >> fingerprint_bits,
+								 ext_len, group[k].count, start);
+			set_payload(qf, start, group[k].hash);
+			total += group[k].count;
+			distinct++;
+			used += c.pos - start;
+			ext += ext_len;
+		}
+		i = j;
+	}
+	free(group);
+	if (ret < 0) {
+		qf_reset(qf);
+		return ret;
+	}
+	bulk_close_run(qf, &c);
+	pc_add(&qf->runtimedata->pc_nelts, total);
+	pc_add(&qf->runtimedata->pc_ndistinct_elts, distinct);
+	pc_add(&qf->runtimedata->pc_noccupied_slots, used);
+	__sync_fetch_and_add(&qf->runtimedata->ext_slots, ext);
+	return distinct;
+}
+
+/* Batched calls.  The whole batch is hashed first, and while one key is
+ * handled the home block of the key QF_BATCH_PREFETCH places later is
+ * prefetched.  Half as far ahead that block has arrived, so its offset
+ * tells where the key's run ends at the earliest, and that block is
+ * prefetched too when it's a different one. */
+#define QF_BATCH_PREFETCH 16
+
+typedef struct qf_batch_item {
+	uint64_t hash;
+	uint64_t bucket;
+	uint64_t index;				/* position in the caller's arrays */
+} qf_batch_item;
+
+static int batch_item_cmp(const void *a, const void *b)
+{
+	uint64_t x = ((const qf_batch_item *)a)->bucket;
+	uint64_t y = ((const qf_batch_item *)b)->bucket;
+	return x < y ? -1 : x > y;
+}
+
+/* Puts items (still in the caller's order) in bucket order.  When a bucket
+ * and a position fit in a word together they are radix sorted as one, if
+ * there is memory for it. */
+static qf_batch_item *batch_sort(qf_batch_item *items, uint64_t n, int
+																 quotient_bits)
+{
+	int index_bits = 64 - __builtin_clzll(n);
+	uint64_t i;
+
+	uint64_t *keys = NULL;
+	qf_batch_item *sorted = NULL;
+	if (quotient_bits + index_bits <= 64) {
+		keys = (uint64_t *)malloc(2 * n * sizeof(uint64_t));
+		sorted = (qf_batch_item *)malloc(n * sizeof(qf_batch_item));
+	}
+	if (keys == NULL || sorted == NULL) {
+		free(keys);
+		free(sorted);
+		qsort(items, n, sizeof(qf_batch_item), batch_item_cmp);
+		return items;
+	}
+	for (i = 0; i < n; i++)
+		keys[i] = items[i].bucket << index_bits | i;
+	bulk_radix_sort(keys, keys + n, n, quotient_bits + index_bits);
+	for (i = 0; i < n; i++)
+		sorted[i] = items[keys[i] & BITMASK(index_bits)];
+	free(keys);
+	free(items);
+	return sorted;
+}
+
+static inline const char *batch_slot_addr(const QF *qf, uint64_t index)
+{
+	return (const char *)get_block(qf, index / QF_SLOTS_PER_BLOCK)->slots +
+		index % QF_SLOTS_PER_BLOCK * qf->metadata->bits_per_slot / 8;
+}
+
+/* The block's header and the bucket's slot, which may be a line further. */
+#define batch_prefetch_home(qf, bucket, rw)																\
+	do {																																		\
+		__builtin_prefetch(get_block((qf), (bucket) / QF_SLOTS_PER_BLOCK), (rw)); \
+		__builtin_prefetch(batch_slot_addr((qf), (bucket)), (rw));						\
+	} while (0)
+
+/* Reads the home block, so only call it once that has been prefetched. */
+#define batch_prefetch_runend(qf, bucket, rw)															\
+	do {																																		\
+		uint64_t _block = (bucket) / QF_SLOTS_PER_BLOCK;											\
+		uint64_t _end = _block * QF_SLOTS_PER_BLOCK +													\
+			get_block((qf), _block)->offset;																		\
+		if (_end / QF_SLOTS_PER_BLOCK > _block && _end < (qf)->metadata->xnslots) { \
+			__builtin_prefetch(get_block((qf), _end / QF_SLOTS_PER_BLOCK), (rw)); \
+			__builtin_prefetch(batch_slot_addr((qf), _end), (rw));							\
+		}																																			\
+	} while (0)
+
+int64_t qf_insert_batch(QF *qf, const uint64_t *keys, const uint64_t
+												*counts, uint64_t n, uint8_t flags, int *results)
+{
+	uint64_t i, inserted = 0;
+	QF cur;
+
+	if (n == 0)
+		return 0;
+	qf_batch_item *items = (qf_batch_item *)malloc(n * sizeof(qf_batch_item));
+	if (items == NULL)
+		return QF_NO_MEMORY;
+	resize_snapshot(qf, &cur);
+	const qfmetadata *hashed = cur.metadata;
+	for (i = 0; i < n; i++) {
+		items[i].hash = key_value_to_hash(&cur, keys[i], 0, flags);
+		items[i].bucket = (items[i].hash & BITMASK(cur.metadata->quotient_bits +
+																							cur.metadata->bits_per_slot)) >>
+			cur.metadata->bits_per_slot;
+		items[i].index = i;
+	}
+	if (flags & QF_BATCH_SORT)
+		items = batch_sort(items, n, cur.metadata->quotient_bits);
+	flags &= ~QF_BATCH_SORT;
+
+	for (i = 0; i < n; i++) {
+		if (i + QF_BATCH_PREFETCH < n)
+			batch_prefetch_home(&cur, items[i + QF_BATCH_PREFETCH].bucket, 1);
+		if (i + QF_BATCH_PREFETCH / 2 < n)
+			batch_prefetch_runend(&cur, items[i + QF_BATCH_PREFETCH / 2].bucket, 1);
+
+		uint64_t key = keys[items[i].index];
+		uint64_t count = counts == NULL ? 1 : counts[items[i].index];
+		int ret = 0;
+		bool done = false;
+		// qf_insert's steps when the table is the one the batch was hashed for
+		// and no resize is under way; anything else goes through qf_insert
+		if (__atomic_load_n(&qf->metadata, __ATOMIC_ACQUIRE) == hashed &&
+				__atomic_load_n(&cur.runtimedata->resize_next, __ATOMIC_ACQUIRE) ==
+				NULL && below_max_occupancy(&cur, item_slots(&cur, count))) {
+			if (count > 0)
+				ret = insert_or_count(&cur, items[i].hash, key, count, flags);
+			done = !resize_retry(ret);
+		}
+		if (!done) {
+			ret = qf_insert(qf, key, 0, count, flags);
+			resize_snapshot(qf, &cur);
+		}
+
+		if (ret >= 0)
+			inserted++;
+		if (results != NULL)
+			results[items[i].index] = ret;
+	}
+	free(items);
+	return inserted;
+}
+
 int qf_set_count(QF *qf, uint64_t key, uint64_t value, uint64_t count, uint8_t
 								 flags)
 {
@@ -2272,142 +4256,424 @@ int qf_remove(QF *qf, uint64_t key, uint64_t value, uint64_t count, uint8_t
 	if (count == 0)
 		return true;
 
-	if (GET_KEY_HASH(flags) != QF_KEY_IS_HASH) {
-		if (qf->metadata->hash_mode == QF_HASH_DEFAULT)
-			key = MurmurHash64A(((void *)&key), sizeof(key),
-													qf->metadata->seed) % qf->metadata->range;
-		else if (qf->metadata->hash_mode == QF_HASH_INVERTIBLE)
-			key = hash_64(key, BITMASK(qf->metadata->key_bits));
-	}
-	uint64_t hash = (key << qf->metadata->value_bits) | (value &
-																											 BITMASK(qf->metadata->value_bits));
-	return _remove(qf, hash, count, flags);
+	__uint128_t fingerprint;
+	int fingerprint_len;
+	QF cur;
+	int ret;
+	resize_snapshot(qf, &cur);
+	uint64_t hash = key_value_to_hash(&cur, key, value, flags);
+	QF *next = __atomic_load_n(&cur.runtimedata->resize_next, __ATOMIC_ACQUIRE);
+	if (next != NULL) {
+		// move the key's chunk first so that all its copies are in one place
+		resize_move_hash(qf, cur.runtimedata, hash);
+		ret = remove_item(next, hash, count, &fingerprint, &fingerprint_len, flags);
+	} else
+		ret = remove_item(&cur, hash, count, &fingerprint, &fingerprint_len, flags);
+	if (resize_retry(ret))
+		return qf_remove(qf, key, value, count, flags);
+	return ret;
 }
 
 int qf_delete_key_value(QF *qf, uint64_t key, uint64_t value, uint8_t flags)
 {
-	uint64_t count = qf_count_key_value(qf, key, value, flags);
+	return qf_remove(qf, key, value, UINT64_MAX, flags);
+}
+
+int qf_remove_ret(QF *qf, uint64_t key, uint64_t count, uint64_t *ret_hash,
+									int *ret_hash_len, uint8_t flags)
+{
 	if (count == 0)
 		return true;
 
-	if (GET_KEY_HASH(flags) != QF_KEY_IS_HASH) {
-		if (qf->metadata->hash_mode == QF_HASH_DEFAULT)
-			key = MurmurHash64A(((void *)&key), sizeof(key),
-													qf->metadata->seed) % qf->metadata->range;
-		else if (qf->metadata->hash_mode == QF_HASH_INVERTIBLE)
-			key = hash_64(key, BITMASK(qf->metadata->key_bits));
-	}
-	uint64_t hash = (key << qf->metadata->value_bits) | (value &
-																											 BITMASK(qf->metadata->value_bits));
-	return _remove(qf, hash, count, flags);
+	__uint128_t hash = 0;
+	QF cur;
+	int ret;
+	do {
+		resize_route(qf, &cur, key_to_hash(qf, key, flags));
+		ret = remove_item(&cur, key_to_hash(&cur, key, flags), count, &hash,
+											ret_hash_len, flags);
+	} while (resize_retry(ret));
+	*ret_hash = hash;
+	return ret;
+}
+
+int qf_remove_ret128(QF *qf, __uint128_t key, uint64_t count, __uint128_t
+										 *ret_hash, int *ret_hash_len, uint8_t flags)
+{
+	if (count == 0)
+		return true;
+
+	QF cur;
+	int ret;
+	do {
+		resize_route(qf, &cur, key_to_hash128(qf, key, flags));
+		ret = remove_item(&cur, key_to_hash128(&cur, key, flags), count, ret_hash,
+											ret_hash_len, flags);
+	} while (resize_retry(ret));
+	return ret;
 }
 
 uint64_t qf_count_key_value(const QF *qf, uint64_t key, uint64_t value,
 														uint8_t flags)
 {
-	if (GET_KEY_HASH(flags) != QF_KEY_IS_HASH) {
-		if (qf->metadata->hash_mode == QF_HASH_DEFAULT)
-			key = MurmurHash64A(((void *)&key), sizeof(key), qf->metadata->seed) % qf->metadata->range;
-		else if (qf->metadata->hash_mode == QF_HASH_INVERTIBLE)
-			key = hash_64(key, BITMASK(qf->metadata->key_bits));
-	}
-	uint64_t hash = (key << qf->metadata->value_bits) | (value & BITMASK(qf->metadata->value_bits));
-	uint64_t hash_remainder   = hash & BITMASK(qf->metadata->bits_per_slot);
-	int64_t hash_bucket_index = hash >> qf->metadata->bits_per_slot;
-
-	if (!is_occupied(qf, hash_bucket_index))
-		return 0;
+	return query_routed(qf, key_value_to_hash(qf, key, value, flags), NULL, NULL, NULL, flags);
+}
 
-	int64_t runstart_index = hash_bucket_index == 0 ? 0 : run_end(qf, hash_bucket_index-1) + 1;
-	if (runstart_index < hash_bucket_index)
-		runstart_index = hash_bucket_index;
+uint64_t get_item_hash(const QF *qf, uint64_t index);
 
-	/* printf("MC RUNSTART: %02lx RUNEND: %02lx\n", runstart_index, runend_index); */
+/* True if the item starting at index has no extension or counter slots and
+ * neither does anything else in its block, so the remainder alone decides a
+ * match and the count is 1.  Checks whole metadata words, which keeps
+ * lookups in regions adaptation never touched as cheap as in the CQF. */
+static inline bool is_plain_item(const QF *qf, uint64_t index)
+{
+	if (get_block(qf, index / QF_SLOTS_PER_BLOCK)->extensions[0] != 0)
+		return false;
+	// the item's extensions may start in the next block
+	return (index + 1) % QF_SLOTS_PER_BLOCK != 0 || index + 1 >=
+		qf->metadata->xnslots || !(get_block(qf, index / QF_SLOTS_PER_BLOCK +
+																				 1)->extensions[0] & 1);
+}
 
-	uint64_t current_remainder, current_count, current_end;
-	do {
-		//printf("2179");
-		current_end = decode_counter(qf, runstart_index, &current_remainder,
-																 &current_count);
-		if (current_remainder == hash_remainder)
-			return current_count;
-		runstart_index = current_end + 1;
-	} while (!is_runend(qf, current_end));
+/* Whether the item whose remainder slot (already known to match hash's
+ * remainder) is at index also matches hash's extensions.  Fills in the
+ * item's extension bits, extension and counter slot counts and count. */
+static inline bool item_matches(const QF *qf, uint64_t index, __uint128_t hash, __uint128_t *ext, int *ext_len, uint64_t *count, int *count_len)
+{
+  if (is_plain_item(qf, index)) {
+    *ext = 0;
+    *ext_len = 0;
+    *count = 1;
+    *count_len = 0;
+    return true;
+  }
+  get_slot_info(qf, index, ext, ext_len, count, count_len);
+  return ((hash >> (qf->metadata->quotient_bits + qf->metadata->bits_per_slot)) & BITMASK128(qf->metadata->bits_per_slot * *ext_len)) == *ext;
+}
 
-	return 0;
+#if QF_BITS_PER_SLOT == 8 || QF_BITS_PER_SLOT == 16
+/* Bit i is set if slot i of block b holds remainder. */
+static inline uint64_t block_remainder_matches(const qfblock *b, uint64_t remainder)
+{
+  uint64_t matches = 0;
+#if defined(__AVX2__) && QF_BITS_PER_SLOT == 8
+  const __m256i r = _mm256_set1_epi8((char)remainder);
+  int i;
+  for (i = 0; i < 2; i++) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)&b->slots[32 * i]);
+    matches |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, r)) << (32 * i);
+  }
+#elif defined(__AVX2__) && QF_BITS_PER_SLOT == 16
+  const __m256i r = _mm256_set1_epi16((short)remainder);
+  int i;
+  for (i = 0; i < 2; i++) {
+    __m256i lo = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i *)&b->slots[32 * i]), r);
+    __m256i hi = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i *)&b->slots[32 * i + 16]), r);
+    // packs works per 128-bit lane, so put the lanes back in slot order
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(lo, hi), 0xd8);
+    matches |= (uint64_t)(uint32_t)_mm256_movemask_epi8(packed) << (32 * i);
+  }
+#elif defined(__SSE2__) && QF_BITS_PER_SLOT == 8
+  const __m128i r = _mm_set1_epi8((char)remainder);
+  int i;
+  for (i = 0; i < 4; i++) {
+    __m128i v = _mm_loadu_si128((const __m128i *)&b->slots[16 * i]);
+    matches |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, r)) << (16 * i);
+  }
+#elif defined(__SSE2__) && QF_BITS_PER_SLOT == 16
+  const __m128i r = _mm_set1_epi16((short)remainder);
+  int i;
+  for (i = 0; i < 4; i++) {
+    __m128i lo = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)&b->slots[16 * i]), r);
+    __m128i hi = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)&b->slots[16 * i + 8]), r);
+    matches |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_packs_epi16(lo, hi)) << (16 * i);
+  }
+#else
+  int i;
+  for (i = 0; i < QF_SLOTS_PER_BLOCK; i++)
+    matches |= (uint64_t)(b->slots[i] == remainder) << i;
+#endif
+  return matches;
 }
+#endif
 
-uint64_t get_item_hash(const QF *qf, uint64_t index);
-uint64_t qf_query(const QF *qf, uint64_t key, uint64_t *ret_index, uint64_t *ret_hash, int *ret_hash_len, uint8_t flags)
+/* Scan the run of hash's home bucket for an item whose fingerprint
+ * (remainder and extensions) matches hash.  On success, fills in the
+ * item's first slot, its extension bits and number of extension slots, and
+ * its count.  A shorter item inserted later can sit in front of a longer one
+ * that also matches; with longest set the whole run is scanned and the
+ * longest match wins.  If scan_end isn't NULL it is set to about where the
+ * scan stopped: the slots it read end within a few slots of it. */
+static inline bool find_item(const QF *qf, __uint128_t hash, bool longest, uint64_t *ret_index, __uint128_t *ret_ext, int *ret_ext_len, uint64_t *ret_count, uint64_t *scan_end)
 {
-	//printf("query start\n");
-	// Convert key to hash
-	if (GET_KEY_HASH(flags) != QF_KEY_IS_HASH) {
-		if (qf->metadata->hash_mode == QF_HASH_DEFAULT)
-			key = MurmurHash64A(((void *)&key), sizeof(key),
-													qf->metadata->seed) % qf->metadata->range;
-		else if (qf->metadata->hash_mode == QF_HASH_INVERTIBLE)
-			key = hash_64(key, BITMASK(qf->metadata->key_bits));
-	}
-	//uint64_t hash = (key << qf->metadata->value_bits) | (value & BITMASK(qf->metadata->value_bits));
-  uint64_t hash = key;
+	bool found = false;
 	uint64_t hash_remainder   = hash & BITMASK(qf->metadata->bits_per_slot);
 	int64_t hash_bucket_index = (hash >> qf->metadata->bits_per_slot) & BITMASK(qf->metadata->quotient_bits);
 
+	if (scan_end != NULL)
+		*scan_end = hash_bucket_index;
 	// If no one wants this slot, we can already say for certain the item is not in the filter
 	if (!is_occupied(qf, hash_bucket_index))
-		return 0;
+		return false;
 
 	// Otherwise, find the start of the run (all the items that want that slot) and parse for the remainder we're looking for
 	int64_t runstart_index = hash_bucket_index == 0 ? 0 : run_end(qf, hash_bucket_index - 1) + 1;
 	if (runstart_index < hash_bucket_index)
 		runstart_index = hash_bucket_index;
 
-	/* printf("MC RUNSTART: %02lx RUNEND: %02lx\n", runstart_index, runend_index); */
-
-	// Look through the run and attempt to find an item that matches the hash
-	/*uint64_t current_index = runstart_index;
-	// For each item from the start of the run until the first runend
-	do {
-		if (!is_extension(qf, current_index) && !is_counter(qf, current_index) && match(qf, current_index, hash)) {
-			if (ret_index != NULL) *ret_index = current_index;
-			uint64_t item_hash, item_hash_len, item_count, item_count_len;
-			get_item_info(qf, current_index, &item_hash, &item_hash_len, &item_count, &item_count_len);
-			if (ret_hash != NULL) *ret_hash = item_hash;
-			if (ret_hash_len != NULL) *ret_hash_len = item_hash_len;
-			//printf("query end\n");
-			return 1;
-		}
-		match(qf, current_index, hash);
-	} while (!is_runend(qf, current_index++) && current_index < qf->metadata->xnslots);*/
-
-  // "optimized" query
+  __uint128_t ext;
+  uint64_t count;
+  int ext_len, count_len;
+#if QF_BITS_PER_SLOT == 8 || QF_BITS_PER_SLOT == 16
+  // compare the remainder against a block of the run at a time; item starts
+  // are the slots without an extension bit (counters have one too), and
+  // only those candidates are decoded
+  uint64_t current_index = runstart_index;
+  bool run_done = false;
+  while (!run_done && current_index < qf->metadata->xnslots) {
+    uint64_t block_index = current_index / QF_SLOTS_PER_BLOCK;
+    const qfblock *b = get_block(qf, block_index);
+    uint64_t live = ~BITMASK(current_index % QF_SLOTS_PER_BLOCK);
+    // the run's last item starts at its first item runend
+    uint64_t ends = item_runends(b) & live;
+    if (ends) {
+      live &= BITMASK(__builtin_ctzll(ends) + 1);
+      run_done = true;
+    }
+    uint64_t candidates = block_remainder_matches(b, hash_remainder) & ~b->extensions[0] & live;
+    while (candidates) {
+      uint64_t index = block_index * QF_SLOTS_PER_BLOCK + __builtin_ctzll(candidates);
+      candidates &= candidates - 1;
+      if (item_matches(qf, index, hash, &ext, &ext_len, &count, &count_len) && (!found || ext_len > *ret_ext_len)) {
+        *ret_index = index;
+        *ret_ext = ext;
+        *ret_ext_len = ext_len;
+        *ret_count = count;
+        found = true;
+        if (!longest) {
+          if (scan_end != NULL)
+            *scan_end = index;
+          return true;
+        }
+      }
+    }
+    current_index = (block_index + 1) * QF_SLOTS_PER_BLOCK;
+  }
+#else
   uint64_t current_index = runstart_index;
   do { // for each slot containing the start of an item:
     if (get_slot(qf, current_index) == hash_remainder) { // if first slot matches, check remaining extensions
-      uint64_t ext, count;
-      int ext_len, count_len;
-      get_slot_info(qf, current_index, &ext, &ext_len, &count, &count_len);
-      if (((hash >> (qf->metadata->quotient_bits + qf->metadata->bits_per_slot)) & BITMASK(qf->metadata->bits_per_slot * ext_len)) == ext) { // if extensions match, return the count
-        if (ret_index != NULL) *ret_index = current_index;
-        if (ret_hash != NULL) *ret_hash = (hash & BITMASK(qf->metadata->quotient_bits + qf->metadata->bits_per_slot)) | (ext << (qf->metadata->quotient_bits + qf->metadata->bits_per_slot));
-        if (ret_hash_len != NULL) *ret_hash_len = (qf->metadata->bits_per_slot * ext_len) + qf->metadata->quotient_bits + qf->metadata->bits_per_slot;
-        return count;
+      if (item_matches(qf, current_index, hash, &ext, &ext_len, &count, &count_len) && (!found || ext_len > *ret_ext_len)) { // if extensions match, return the item
+        *ret_index = current_index;
+        *ret_ext = ext;
+        *ret_ext_len = ext_len;
+        *ret_count = count;
+        found = true;
+        if (!longest) {
+          if (scan_end != NULL)
+            *scan_end = current_index;
+          return true;
+        }
       }
       if (is_runend(qf, current_index++)) break; // if extensions don't match, stop if end of run, skip to next item otherwise
       current_index += ext_len + count_len;
     }
+    else if (is_plain_item(qf, current_index)) { // nothing to skip
+      if (is_runend(qf, current_index++)) break;
+    }
     else { // if first slot doesn't match, stop if end of run, skip to next item otherwise
       if (is_runend(qf, current_index++)) break;
       while (is_extension(qf, current_index)) current_index++;
       while (is_counter(qf, current_index)) current_index++;
     }
   } while (current_index < qf->metadata->xnslots); // stop if reached the end of all items (should never actually reach this point because should stop at the runend)
+#endif
 
-	return 0;
+	if (scan_end != NULL)
+		*scan_end = current_index;
+	return found;
+}
+
+static inline uint64_t query(const QF *qf, __uint128_t hash, uint64_t *ret_index, __uint128_t *ret_hash, int *ret_hash_len, uint64_t *scan_end)
+{
+  uint64_t index, count;
+  __uint128_t ext;
+  int ext_len;
+  if (!find_item(qf, hash, false, &index, &ext, &ext_len, &count, scan_end))
+    return 0;
+
+  if (ret_index != NULL) *ret_index = index;
+  if (ret_hash != NULL) *ret_hash = (hash & BITMASK(qf->metadata->quotient_bits + qf->metadata->bits_per_slot)) | (ext << (qf->metadata->quotient_bits + qf->metadata->bits_per_slot));
+  if (ret_hash_len != NULL) *ret_hash_len = (qf->metadata->bits_per_slot * ext_len) + qf->metadata->quotient_bits + qf->metadata->bits_per_slot;
+  return count;
+}
+
+/* query() for callers that share the filter with writers, without taking
+ * any locks.  Snapshots the seqlock versions of the lock regions the query
+ * reads, runs it, and retries if a writer held any of them meanwhile.
+ * Which regions those are is only known once the scan of the run is done:
+ * if it reaches past the regions validated, they are widened and the
+ * query runs again.  Versions only grow, so comparing their sums is as good
+ * as comparing each.  With QF_NO_LOCK this is just query(); with
+ * QF_TRY_ONCE_LOCK it gives up after one failed attempt. */
+static inline int64_t query_validated(const QF *qf, __uint128_t hash, uint64_t *ret_index, __uint128_t *ret_hash, int *ret_hash_len, uint8_t flags)
+{
+	if (GET_NO_LOCK(flags) == QF_NO_LOCK)
+		return query(qf, hash, ret_index, ret_hash, ret_hash_len, NULL);
+
+	volatile uint64_t *versions = qf->runtimedata->versions;
+	const uint64_t slots_per_lock = qf->runtimedata->slots_per_lock;
+	uint64_t hash_bucket_index = (hash >> qf->metadata->bits_per_slot) & BITMASK(qf->metadata->quotient_bits);
+	uint64_t first, last, need, seen, now, v, i, scan_end;
+	uint64_t count;
+	uint32_t spins = 0;
+
+	first = lock_region(qf, hash_bucket_index > 0 ? hash_bucket_index - 1 : 0);
+	last = lock_region(qf, (lock_region(qf, hash_bucket_index) + 1) *
+										 slots_per_lock);
+	while (true) {
+		bool stable = true;
+		seen = 0;
+		for (i = first; i <= last; i++) {
+			v = __atomic_load_n(&versions[i], __ATOMIC_ACQUIRE);
+			seen += v;
+			stable &= !(v & 1);
+		}
+		if (stable) {
+			count = query(qf, hash, ret_index, ret_hash, ret_hash_len, &scan_end);
+			// the last item read can spill its extension and counter slots
+			// into the next region
+			need = lock_region(qf, (lock_region(qf, scan_end) + 1) * slots_per_lock);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			now = 0;
+			for (i = first; i <= last; i++)
+				now += __atomic_load_n(&versions[i], __ATOMIC_RELAXED);
+			if (now == seen) {
+				if (need <= last)
+					return count;
+				last = need;
+				continue;
+			}
+		}
+		if (GET_TRY_ONCE_LOCK(flags) == QF_TRY_ONCE_LOCK)
+			return QF_COULDNT_LOCK;
+		qf_cpu_relax(&spins);
+	}
+}
+
+/* is_occupied() for callers that share the filter with writers.  Removes
+ * and adapts rewrite whole clusters, clearing and setting occupied bits on
+ * the way, so the bit is only trusted if the seqlock version of its region
+ * didn't move while it was read.  Returns 1 or 0, or QF_COULDNT_LOCK as
+ * query_validated does. */
+static inline int occupied_validated(const QF *qf, uint64_t bucket, uint8_t
+																		 flags)
+{
+	if (GET_NO_LOCK(flags) == QF_NO_LOCK)
+		return is_occupied(qf, bucket);
+
+	volatile uint64_t *version = &qf->runtimedata->versions[lock_region(qf,
+																																			bucket)];
+	uint32_t spins = 0;
+	while (true) {
+		uint64_t v = __atomic_load_n(version, __ATOMIC_ACQUIRE);
+		if (!(v & 1)) {
+			int occupied = is_occupied(qf, bucket);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(version, __ATOMIC_RELAXED) == v)
+				return occupied;
+		}
+		if (GET_TRY_ONCE_LOCK(flags) == QF_TRY_ONCE_LOCK)
+			return QF_COULDNT_LOCK;
+		qf_cpu_relax(&spins);
+	}
+}
+
+uint64_t qf_query(const QF *qf, uint64_t key, uint64_t *ret_index, uint64_t *ret_hash, int *ret_hash_len, uint8_t flags)
+{
+  __uint128_t hash;
+  int64_t count = query_routed(qf, key_to_hash(qf, key, flags), ret_index, &hash, ret_hash_len, flags);
+  if (count > 0 && ret_hash != NULL) *ret_hash = hash;
+  return count;
+}
+
+uint64_t qf_query128(const QF *qf, __uint128_t key, uint64_t *ret_index, __uint128_t *ret_hash, int *ret_hash_len, uint8_t flags)
+{
+  return query_routed(qf, key_to_hash128(qf, key, flags), ret_index, ret_hash, ret_hash_len, flags);
+}
+
+int64_t qf_query_batch(const QF *qf, const uint64_t *keys, uint64_t n,
+											 uint64_t *counts_out, uint64_t *index_out, uint64_t
+											 *hash_out, int *hash_len_out, uint8_t flags)
+{
+	uint64_t i, found = 0;
+	QF cur;
+
+	if (n == 0)
+		return 0;
+	qf_batch_item *items = (qf_batch_item *)malloc(n * sizeof(qf_batch_item));
+	if (items == NULL)
+		return QF_NO_MEMORY;
+	resize_snapshot(qf, &cur);
+	const qfmetadata *hashed = cur.metadata;
+	for (i = 0; i < n; i++) {
+		items[i].hash = key_to_hash(&cur, keys[i], flags);
+		items[i].bucket = (items[i].hash >> cur.metadata->bits_per_slot) &
+			BITMASK(cur.metadata->quotient_bits);
+		items[i].index = i;
+	}
+	if (flags & QF_BATCH_SORT)
+		items = batch_sort(items, n, cur.metadata->quotient_bits);
+	flags &= ~QF_BATCH_SORT;
+
+	for (i = 0; i < n; i++) {
+		// a negative only needs the home block's metadata, so the slots are
+		// fetched once that says the bucket is occupied
+		if (i + QF_BATCH_PREFETCH < n)
+			__builtin_prefetch(get_block(&cur, items[i + QF_BATCH_PREFETCH].bucket /
+																	 QF_SLOTS_PER_BLOCK), 0);
+		if (i + QF_BATCH_PREFETCH / 2 < n) {
+			uint64_t bucket = items[i + QF_BATCH_PREFETCH / 2].bucket;
+			if (is_occupied(&cur, bucket)) {
+				__builtin_prefetch(batch_slot_addr(&cur, bucket), 0);
+				batch_prefetch_runend(&cur, bucket, 0);
+			}
+		}
+
+		uint64_t j = items[i].index;
+		uint64_t index = 0, hash = 0;
+		__uint128_t hash128 = 0;
+		int hash_len = 0;
+		int64_t count;
+		if (__atomic_load_n(&qf->metadata, __ATOMIC_ACQUIRE) != hashed ||
+				__atomic_load_n(&cur.runtimedata->resize_next, __ATOMIC_ACQUIRE) !=
+				NULL) {
+			count = qf_query(qf, keys[j], &index, &hash, &hash_len, flags);
+			resize_snapshot(qf, &cur);
+		} else {
+			// a clear occupied bit is a negative without reading the slots
+			count = occupied_validated(&cur, items[i].bucket, flags);
+			if (count > 0)
+				count = query_validated(&cur, items[i].hash, &index, &hash128,
+																&hash_len, flags);
+			hash = hash128;
+		}
+
+		if (count > 0)
+			found++;
+		counts_out[j] = count;
+		if (index_out != NULL)
+			index_out[j] = count > 0 ? index : 0;
+		if (hash_out != NULL)
+			hash_out[j] = count > 0 ? hash : 0;
+		if (hash_len_out != NULL)
+			hash_len_out[j] = count > 0 ? hash_len : 0;
+	}
+	free(items);
+	return found;
 }
 
-int match(const QF *qf, int64_t index, uint64_t hash) { // Takes an index and hash and matches fingerprint with hash (including extensions)
+int match(const QF *qf, int64_t index, __uint128_t hash) { // Takes an index and hash and matches fingerprint with hash (including extensions)
 	if ((hash & BITMASK(qf->metadata->bits_per_slot)) != get_slot(qf, index)) {
 		return 0;
 	}
@@ -2424,9 +4690,8 @@ int match(const QF *qf, int64_t index, uint64_t hash) { // Takes an index and ha
 	return 1;
 }
 
-int get_slot_info(const QF *qf, uint64_t index, uint64_t *ext, int *ext_slots, uint64_t *count, int *count_slots) {
+int get_slot_info(const QF *qf, uint64_t index, __uint128_t *ext, int *ext_slots, uint64_t *count, int *count_slots) {
 	if (is_extension(qf, index) || is_counter(qf, index)) {
-		bp1(qf, index, index % 64, 0);
 		*ext = -1;
 		*ext_slots = 0;
 		*count = 1;
@@ -2439,7 +4704,7 @@ int get_slot_info(const QF *qf, uint64_t index, uint64_t *ext, int *ext_slots, u
   if (ext != NULL) {
     *ext = 0;
     while (is_extension(qf, curr)) {
-      *ext |= get_slot(qf, index) << ((curr - index) * qf->metadata->bits_per_slot);
+      *ext |= (__uint128_t)get_slot(qf, curr) << ((curr - index) * qf->metadata->bits_per_slot);
       curr++;
     }
     if (ext_slots != NULL) *ext_slots = curr - index;
@@ -2454,7 +4719,7 @@ int get_slot_info(const QF *qf, uint64_t index, uint64_t *ext, int *ext_slots, u
       if (count_slots != NULL) *count_slots = 0;
     }
     while (is_counter(qf, curr)) {
-      *count |= get_slot(qf, index) << ((curr - index) * qf->metadata->bits_per_slot);
+      *count |= get_slot(qf, curr) << ((curr - index) * qf->metadata->bits_per_slot);
       curr++;
     }
     if (count_slots != NULL) *count_slots = curr - index;
@@ -2508,101 +4773,131 @@ int get_item_info(const QF *qf, uint64_t index, uint64_t *hash, uint64_t *hash_s
 	return 1;
 }
 
-int adapt(QF *qf, uint64_t index, uint64_t hash_bucket_index, uint64_t hash, uint64_t other_hash, uint64_t *ret_hash) {
-	uint64_t ext, count;
+int adapt(QF *qf, uint64_t index, uint64_t hash_bucket_index, __uint128_t hash, __uint128_t other_hash, int hash_bits, bool false_positive, __uint128_t *ret_hash) {
+	__uint128_t ext;
+	uint64_t count;
   int ext_len, count_len;
 	// figure out how many extensions there currently are
 	if (!get_slot_info(qf, index, &ext, &ext_len, &count, &count_len)) return 0;
-  assert((hash & BITMASK(qf->metadata->quotient_bits + qf->metadata->bits_per_slot)) == (get_slot(qf, index) | (hash_bucket_index << qf->metadata->bits_per_slot)));
-  int ext_bits = qf->metadata->bits_per_slot * ext_len;
-	*ret_hash = hash & BITMASK(ext_bits + qf->metadata->quotient_bits + qf->metadata->bits_per_slot);
-	int slots_used = ext_len + 1;
-	// get the bits for the next extension
-	hash >>= ext_bits + qf->metadata->quotient_bits + qf->metadata->bits_per_slot;
-	other_hash >>= ext_bits + qf->metadata->quotient_bits + qf->metadata->bits_per_slot;
+	return adapt_item(qf, index, hash_bucket_index, ext_len, hash, other_hash, hash_bits, false_positive, ret_hash);
+}
 
+/* Whether the adaptation policy lets the item at index (with ext_len
+ * extension slots and stored fingerprint fingerprint/len) grow by nslots
+ * extension slots.  Lazy adaptation only applies to false positives found
+ * by queries; two inserted items that collide are split right away. */
+static bool adapt_allowed(QF *qf, uint64_t index, uint64_t hash_bucket_index,
+													int ext_len, uint64_t nslots, __uint128_t fingerprint,
+													int len, bool false_positive)
+{
+	const qf_adapt_policy *policy = &qf->runtimedata->adapt_policy;
 
-  /*do {
-    hash >>= qf->metadata->bits_per_slot;
-    other_hash >>= qf->metadata->bits_per_slot;
-    uint64_t empty_slot_index = find_first_empty_slot(qf, index + slots_used);
-    if (empty_slot_index >= qf->metadata->xnslots) {
-      return QF_NO_SPACE;
-    }
+	if (policy->max_item_ext_slots && ext_len + nslots >
+			policy->max_item_ext_slots)
+		return false;
+	if (policy->max_ext_fraction > 0 && qf->runtimedata->ext_slots + nslots >
+			policy->max_ext_fraction * qf->metadata->nslots)
+		return false;
+	if (policy->max_occupancy > 0 && qf_get_num_occupied_slots(qf) + nslots >=
+			policy->max_occupancy * qf->metadata->nslots)
+		return false;
+	if (policy->max_run_ext_slots) {
+		uint64_t i = hash_bucket_index == 0 ? 0 : run_end(qf, hash_bucket_index - 1) + 1;
+		uint64_t end = run_end(qf, hash_bucket_index), run_ext_slots = 0;
+		for (i = i < hash_bucket_index ? hash_bucket_index : i; i <= end; i++)
+			run_ext_slots += is_extension(qf, i);
+		if (run_ext_slots + nslots > policy->max_run_ext_slots)
+			return false;
+	}
 
-    shift_remainders(qf, index + slots_used, empty_slot_index);
-    set_slot(qf, index + slots_used, hash & BITMASK(qf->metadata->bits_per_slot));
-    shift_runends(qf, index + slots_used, empty_slot_index - 1, 1);
+	rm_t *counts = qf->runtimedata->fp_counts;
+	if (false_positive && counts != NULL) {
+		uint64_t seen = 0;
+		revmap_lock(counts);
+		rm_lookup(counts, fingerprint, len, &seen);
+		if (++seen < policy->lazy_threshold) {
+			if (rm_insert(counts, fingerprint, len, seen) < 0)
+				seen = policy->lazy_threshold;	/* can't count, so adapt now */
+		}
+		if (seen >= policy->lazy_threshold)
+			rm_remove(counts, fingerprint, len, NULL);
+		revmap_unlock(counts);
+		if (seen < policy->lazy_threshold)
+			return false;
+	}
 
-    *ret_hash |= (hash & BITMASK(qf->metadata->bits_per_slot)) << (ext_bits + qf->metadata->quotient_bits + qf->metadata->bits_per_slot);
+	return true;
+}
 
-    uint64_t i;
-    for (i = hash_bucket_index / QF_SLOTS_PER_BLOCK + 1; i <= empty_slot_index / QF_SLOTS_PER_BLOCK; i++) {
-      if (get_block(qf, i)->offset < BITMASK(8 * sizeof(qf->blocks[0].offset))) get_block(qf, i)->offset++;
-      assert(get_block(qf, i)->offset != 0);
-    }
+// same as adapt, for callers that already know how many extension slots the item at index has
+// hash_bits is 64 or 128, the number of bits the caller's hashes actually carry
+// false_positive is set when the adaptation fixes a false positive found by a query
+static int adapt_item(QF *qf, uint64_t index, uint64_t hash_bucket_index, int ext_len, __uint128_t hash, __uint128_t other_hash, int hash_bits, bool false_positive, __uint128_t *ret_hash) {
+  assert((hash & BITMASK(qf->metadata->quotient_bits + qf->metadata->bits_per_slot)) == (get_slot(qf, index) | (hash_bucket_index << qf->metadata->bits_per_slot)));
+	const uint64_t bits_per_slot = qf->metadata->bits_per_slot;
+	const uint64_t base_bits = qf->metadata->quotient_bits + bits_per_slot;
+	uint64_t ext_bits = bits_per_slot * ext_len;
+	*ret_hash = hash & BITMASK128(ext_bits + base_bits);
+	if (ext_bits + base_bits >= hash_bits) // no hash bits left to extend with
+		return ext_bits + base_bits;
 
-    METADATA_WORD(qf, extensions, index) |= 1ULL << ((index + slots_used) % 64);
-    modify_metadata(&qf->runtimedata->pc_noccupied_slots, 1);
-    slots_used++;
-    ext_bits += qf->metadata->bits_per_slot;
-  } while (((hash & BITMASK(qf->metadata->bits_per_slot)) == (other_hash & BITMASK(qf->metadata->bits_per_slot))) && (ext_bits + qf->metadata->quotient_bits + qf->metadata->bits_per_slot < 64));*/
+	// get the bits for the next extension
+	hash >>= ext_bits + base_bits;
+	other_hash >>= ext_bits + base_bits;
+
+	// work out all the extension slots needed up front: one for every chunk
+	// on which hash and other_hash still agree, plus the first that differs
+	uint64_t remainders[67];
+	uint64_t nslots_needed = 0;
+	while (((hash & BITMASK(bits_per_slot)) == (other_hash & BITMASK(bits_per_slot))) && (ext_bits + base_bits + bits_per_slot < hash_bits)) {
+		remainders[nslots_needed++] = hash & BITMASK(bits_per_slot);
+		ext_bits += bits_per_slot;
+		hash >>= bits_per_slot;
+		other_hash >>= bits_per_slot;
+	}
+	remainders[nslots_needed++] = hash & BITMASK(bits_per_slot);
 
+	if (!adapt_allowed(qf, index, hash_bucket_index, ext_len, nslots_needed, *ret_hash, base_bits + bits_per_slot * ext_len, false_positive))
+		return base_bits + bits_per_slot * ext_len;
 
-	// while the hash and other_hash match on these bits, insert an extension slot
-	while (((hash & BITMASK(qf->metadata->bits_per_slot)) == (other_hash & BITMASK(qf->metadata->bits_per_slot))) && (ext_bits + qf->metadata->quotient_bits + 2 * qf->metadata->bits_per_slot < 64)) {
-		uint64_t empty_slot_index = find_first_empty_slot(qf, index + slots_used); // find the first empty slot
-		if (empty_slot_index >= qf->metadata->xnslots) {
-			return QF_NO_SPACE;
-		}
-		shift_remainders(qf, index + slots_used, empty_slot_index); // shift all slots from insert index to the empty slot
+	// open all of them behind the item's existing slots with a single shift
+	uint64_t insert_index = index + ext_len + 1;
+	if (insert_replace_slots_and_shift_remainders_and_runends_and_offsets(qf, 3, hash_bucket_index, insert_index, remainders, nslots_needed, 0) <= 0)
+		return QF_NO_SPACE;
+	__sync_fetch_and_add(&qf->runtimedata->ext_slots, nslots_needed);
 
-		set_slot(qf, index + slots_used, hash & BITMASK(qf->metadata->bits_per_slot)); // fill the newly made space
-		*ret_hash |= (hash & BITMASK(qf->metadata->bits_per_slot)) << (ext_bits + qf->metadata->quotient_bits + qf->metadata->bits_per_slot);
+	uint64_t i;
+	for (i = 0; i < nslots_needed; i++) {
+		METADATA_WORD(qf, extensions, insert_index + i) |= 1ULL << ((insert_index + i) % 64);
+		*ret_hash |= (__uint128_t)remainders[i] << (base_bits + bits_per_slot * (ext_len + i));
+	}
+	
+	return base_bits + bits_per_slot * (ext_len + nslots_needed);
+}
 
-		shift_runends(qf, index + slots_used, empty_slot_index - 1, 1); // shift runend bits from insert index to the empty slot
-		//if (is_extension(qf, index + slots_used)) METADATA_WORD(qf, extensions, index + slots_used - 1) |= 1ULL << ((index + slots_used - 1) % 64);
-		
-		uint64_t i; // increment offset for all blocks that the shift pushed into
-		for (i = hash_bucket_index / QF_SLOTS_PER_BLOCK + 1; i <= empty_slot_index / QF_SLOTS_PER_BLOCK; i++) {
-			if (get_block(qf, i)->offset < BITMASK(8*sizeof(qf->blocks[0].offset)))
-				get_block(qf, i)->offset++;
-			assert(get_block(qf, i)->offset != 0);
-		}
-		
-		METADATA_WORD(qf, extensions, index) |= 1ULL << ((index + slots_used) % 64);
-		modify_metadata(&qf->runtimedata->pc_noccupied_slots, 1);
-		slots_used++;
-		ext_bits += qf->metadata->bits_per_slot;
-		hash >>= qf->metadata->bits_per_slot;
-		other_hash >>= qf->metadata->bits_per_slot;
-	} // NOTE: COULD CHANGE THIS TO A DO-WHILE
-		
-	uint64_t empty_slot_index = find_first_empty_slot(qf, index + slots_used); // find the first empty slot
-	if (empty_slot_index >= qf->metadata->xnslots) {
-		return QF_NO_SPACE;
+static int adapt_hashed(QF *qf, uint64_t index, __uint128_t hash, __uint128_t other_hash, int hash_bits, __uint128_t *ret_hash, uint8_t flags) {
+	if (hash == other_hash) {
+		return 0;
+	}
+	
+	uint64_t hash_bucket_index = (hash & BITMASK(qf->metadata->quotient_bits + qf->metadata->bits_per_slot)) >> qf->metadata->bits_per_slot;
+	uint64_t first_region, last_region;
+	if (GET_NO_LOCK(flags) != QF_NO_LOCK) {
+		uint64_t nslots = shift_slots_bound(qf, 1, hash_bits);
+		if (!lock_for_shift(qf, hash_bucket_index, nslots, flags, &first_region,
+												&last_region))
+			return QF_COULDNT_LOCK;
 	}
-	shift_remainders(qf, index + slots_used, empty_slot_index); // shift all slots from insert index to the empty slot
 
-	set_slot(qf, index + slots_used, hash & BITMASK(qf->metadata->bits_per_slot)); // fill the newly made space
-	*ret_hash |= (hash & BITMASK(qf->metadata->bits_per_slot)) << (ext_bits + qf->metadata->quotient_bits + qf->metadata->bits_per_slot);
+	int old_len = item_fingerprint_len(qf, index);
+	int ret = adapt(qf, index, hash_bucket_index, hash, other_hash, hash_bits, true, ret_hash);
+	revmap_rekey(qf, hash & BITMASK128(old_len), old_len, *ret_hash, ret);
 
-	shift_runends(qf, index + slots_used, empty_slot_index - 1, 1); // shift runend bits from insert index to the empty slot
-	//if (is_extension(qf, index + slots_used)) METADATA_WORD(qf, extensions, index + slots_used - 1) |= 1ULL << ((index + slots_used - 1) % 64);
-	
-	uint64_t i; // increment offset for all blocks that the shift pushed into
-	//printf("%lu\t%lu\t%lu\n", qf_get_num_occupied_slots(qf), hash_bucket_index, empty_slot_index);
-	for (i = hash_bucket_index / QF_SLOTS_PER_BLOCK + 1; i <= empty_slot_index / QF_SLOTS_PER_BLOCK; i++) {
-		if (get_block(qf, i)->offset < BITMASK(8*sizeof(qf->blocks[0].offset)))
-			get_block(qf, i)->offset++;
-		assert(get_block(qf, i)->offset != 0);
+	if (GET_NO_LOCK(flags) != QF_NO_LOCK) {
+		unlock_regions(qf, first_region, last_region);
 	}
-	
-	METADATA_WORD(qf, extensions, index + slots_used) |= 1ULL << ((index + slots_used) % 64);
-	modify_metadata(&qf->runtimedata->pc_noccupied_slots, 1);
-	ext_bits += qf->metadata->bits_per_slot;
-	
-	return ext_bits + qf->metadata->quotient_bits + qf->metadata->bits_per_slot;
+
+	return ret;
 }
 
 /*	index is the index of the fingerprint to adapt (should have been returned in ret_index by qf_query or qf_insert_ret)
@@ -2612,54 +4907,694 @@ int adapt(QF *qf, uint64_t index, uint64_t hash_bucket_index, uint64_t hash, uin
 	returns the length of the resulting fingerprint
 */
 int qf_adapt(QF *qf, uint64_t index, uint64_t hash, uint64_t other_hash, uint64_t *ret_hash, uint8_t flags) {
-	if (qf_get_num_occupied_slots(qf) == 24101) {
-		bp1(qf, 0, 0, 0);
+	__uint128_t fingerprint = 0;
+	QF cur;
+	int ret;
+	do {
+		resize_route(qf, &cur, key_to_hash(qf, hash, flags));
+		ret = adapt_hashed(&cur, index, key_to_hash(&cur, hash, flags), key_to_hash(&cur, other_hash, flags), 64, &fingerprint, flags);
+	} while (resize_retry(ret));
+	*ret_hash = fingerprint;
+	return ret;
+}
+
+int qf_adapt128(QF *qf, uint64_t index, __uint128_t key, __uint128_t other_key, __uint128_t *ret_hash, uint8_t flags) {
+	QF cur;
+	int ret;
+	do {
+		resize_route(qf, &cur, key_to_hash128(qf, key, flags));
+		ret = adapt_hashed(&cur, index, key_to_hash128(&cur, key, flags), key_to_hash128(&cur, other_key, flags), 128, ret_hash, flags);
+	} while (resize_retry(ret));
+	return ret;
+}
+
+/* Fingerprint of the item whose remainder record is c->slots[first], using
+ * its first ext_len extension records. */
+static inline __uint128_t cluster_fingerprint(const QF *qf, const qf_cluster
+																							*c, uint64_t first, uint64_t
+																							ext_len)
+{
+	const uint64_t base_bits = qf->metadata->quotient_bits + qf->metadata->bits_per_slot;
+	__uint128_t fingerprint = c->slots[first].value | (c->slots[first].bucket <<
+																										 qf->metadata->bits_per_slot);
+	uint64_t i;
+	for (i = 0; i < ext_len; i++) {
+		uint64_t shift = base_bits + qf->metadata->bits_per_slot * i;
+		if (shift < 128)
+			fingerprint |= (__uint128_t)c->slots[first + 1 + i].value << shift;
 	}
-	if (hash == other_hash) {
+	return fingerprint;
+}
+
+static inline uint64_t cluster_ext_len(const qf_cluster *c, uint64_t first)
+{
+	uint64_t n = 0;
+	while (first + 1 + n < c->len && c->slots[first + 1 + n].kind ==
+				 CS_EXTENSION)
+		n++;
+	return n;
+}
+
+/* Index of the first extension record in which the items whose remainder
+ * records are a and b (with the same remainder) differ, plus one; or
+ * a_len if a is a prefix of b. */
+static inline uint64_t cluster_distinct_at(const qf_cluster *c, uint64_t a,
+																					 uint64_t a_len, uint64_t b)
+{
+	uint64_t b_len = cluster_ext_len(c, b);
+	uint64_t common = b_len < a_len ? b_len : a_len, j;
+	for (j = 0; j < common && c->slots[a + 1 + j].value == c->slots[b + 1 +
+																														 j].value; j++);
+	return j < common ? j + 1 : a_len;
+}
+
+/* Trim the extensions of the items in records [first, last) (one run) to
+ * the fewest slots that still tell each item apart from every other item
+ * with the same remainder.  Two items are told apart by the first extension
+ * slot in which they differ, so each keeps up to the latest such slot over
+ * all of its neighbours; an item that is a prefix of another keeps all of
+ * its slots.
+ *
+ * If removed is in [first, last), it is the remainder record of an item
+ * that is about to be removed: it is ignored as a neighbour, and only the
+ * items whose last extension slot told them apart from it are trimmed, so
+ * that adaptations made for other reasons survive.  Returns the number of
+ * records dropped. */
+static uint64_t cluster_trim_run(QF *qf, qf_cluster *c, uint64_t first,
+																 uint64_t last, uint64_t removed, uint8_t
+																 flags)
+{
+	const uint64_t base_bits = qf->metadata->quotient_bits + qf->metadata->bits_per_slot;
+	bool removing = removed >= first && removed < last;
+	uint64_t a, b, j, dropped = 0;
+
+	for (a = first; a < last; a++) {
+		if (a == removed || c->slots[a].kind != CS_REMAINDER)
+			continue;
+		uint64_t ext_len = cluster_ext_len(c, a);
+		if (ext_len == 0)
+			continue;
+		if (removing && (c->slots[removed].value != c->slots[a].value ||
+										 cluster_distinct_at(c, a, ext_len, removed) != ext_len))
+			continue;
+
+		uint64_t needed = 0;
+		for (b = first; b < last && needed < ext_len; b++) {
+			if (b == a || b == removed || c->slots[b].kind != CS_REMAINDER ||
+					c->slots[b].value != c->slots[a].value)
+				continue;
+			uint64_t distinct_at = cluster_distinct_at(c, a, ext_len, b);
+			if (distinct_at > needed)
+				needed = distinct_at;
+		}
+		if (needed == ext_len)
+			continue;
+
+		revmap_rekey(qf, cluster_fingerprint(qf, c, a, ext_len), base_bits +
+								 qf->metadata->bits_per_slot * ext_len,
+								 cluster_fingerprint(qf, c, a, needed), base_bits +
+								 qf->metadata->bits_per_slot * needed);
+		for (j = needed; j < ext_len; j++)
+			c->slots[a + 1 + j].kind = CS_DROPPED;
+		dropped += ext_len - needed;
+		__sync_fetch_and_sub(&qf->runtimedata->ext_slots, ext_len - needed);
+	}
+
+	return dropped;
+}
+
+/* Trim every run of a decoded cluster and write it back if anything
+ * changed.  Returns the number of slots freed. */
+static uint64_t cluster_trim(QF *qf, qf_cluster *c, uint8_t flags)
+{
+	uint64_t first = 0, last, dropped = 0;
+	while (first < c->len) {
+		for (last = first + 1; last < c->len && c->slots[last].bucket ==
+				 c->slots[first].bucket; last++);
+		dropped += cluster_trim_run(qf, c, first, last, c->len, flags);
+		first = last;
+	}
+	return dropped > 0 ? cluster_encode(qf, c) : 0;
+}
+
+static int64_t compact_extensions(QF *qf, uint64_t nslots, uint8_t flags)
+{
+	qf_cluster c;
+	memset(&c, 0, sizeof(c));
+	uint64_t cursor = qf->runtimedata->compact_cursor;
+	uint64_t scanned = 0;
+	int64_t freed = 0;
+
+	while (scanned < nslots) {
+		if (cursor >= qf->metadata->xnslots)
+			cursor = 0;
+
+		// skip ahead to the next cluster
+		uint64_t start;
+		if (slot_is_free(qf, cursor)) {
+			while (cursor < qf->metadata->xnslots && !is_occupied(qf, cursor)) {
+				uint64_t word = METADATA_WORD(qf, occupieds, cursor) >> (cursor % 64);
+				uint64_t skip = word ? bitselect(word, 0) : 64 - cursor % 64;
+				cursor += skip;
+				scanned += skip;
+			}
+			if (cursor >= qf->metadata->xnslots)
+				continue;
+			start = cursor;
+		} else
+			start = cluster_start(qf, cursor);
+
+		if (GET_NO_LOCK(flags) != QF_NO_LOCK) {
+			if (!qf_lock(qf, start, /*small*/ false, flags)) {
+				if (freed == 0)
+					freed = QF_COULDNT_LOCK;
+				break;
+			}
+		}
+		bool decoded = cluster_decode(qf, start, &c);
+		uint64_t end = c.end;
+		if (decoded)
+			freed += cluster_trim(qf, &c, flags);
+		if (GET_NO_LOCK(flags) != QF_NO_LOCK) {
+			qf_unlock(qf, start, /*small*/ false);
+		}
+		if (!decoded)
+			break;
+
+		scanned += end + 1 - cursor;
+		cursor = end + 1;
+	}
+
+	qf->runtimedata->compact_cursor = cursor;
+	free(c.slots);
+	return freed;
+}
+
+int64_t qf_compact_extensions(QF *qf, uint64_t nslots, uint8_t flags)
+{
+	QF cur;
+	resize_snapshot(qf, &cur);
+	// during a resize only the new table takes writes, and the chunks still
+	// to be moved come over without extensions anyway
+	QF *next = __atomic_load_n(&cur.runtimedata->resize_next, __ATOMIC_ACQUIRE);
+	if (next != NULL)
+		cur = *next;
+	return compact_extensions(&cur, nslots, flags);
+}
+
+/* Batched adaptation.  The fixes are put in slot order and applied a
+ * cluster at a time, from the end of the table back, so that a cluster that
+ * grows only ever moves slots whose fixes are done.  The cluster (and any
+ * clusters after it that its growth runs into) is decoded once, every fix
+ * that lands in it adds its extension records, and it is written back
+ * once, so it is shifted once however many fixes it gets.  An item with
+ * several fixes is extended once, as far as the fix that needs the most
+ * slots.  Clusters whose growth would reach past the regions locked, or
+ * that are long for the fixes they get, go through qf_adapt. */
+
+/* Records decoded per fix past which a cluster is adapted one fix at a
+ * time instead. */
+#define QF_ADAPT_BATCH_RECORDS (2 * QF_SLOTS_PER_BLOCK)
+
+/* Extension slots the item needs to tell hash apart from other_hash, given
+ * that it has ext_len now: ext_len if its fingerprint already does. */
+static inline uint64_t adapt_batch_ext_len(const QF *qf, uint64_t hash,
+																					 uint64_t other_hash, uint64_t
+																					 ext_len)
+{
+	const uint64_t base_bits = qf->metadata->quotient_bits +
+		qf->metadata->bits_per_slot;
+	uint64_t diff = (hash ^ other_hash) >> base_bits;
+	if (diff == 0)
+		return ext_len;
+	uint64_t len = __builtin_ctzll(diff) / qf->metadata->bits_per_slot + 1;
+	return len > ext_len ? len : ext_len;
+}
+
+/* Once cluster c is written back as out, count the extension slots that
+ * grew its items and move their reverse map entries to the longer
+ * fingerprints.  Records other than items' map one to one. */
+static void adapt_batch_rekey(QF *qf, const qf_cluster *c, const qf_cluster
+															*out)
+{
+	const uint64_t bits_per_slot = qf->metadata->bits_per_slot;
+	const uint64_t base_bits = qf->metadata->quotient_bits + bits_per_slot;
+	uint64_t r, o, grown = 0;
+
+	for (r = 0, o = 0; r < c->len && o < out->len; r++, o++) {
+		if (c->slots[r].kind != CS_REMAINDER)
+			continue;
+		uint64_t ext_len = cluster_ext_len(c, r), target = cluster_ext_len(out, o);
+		if (target > ext_len) {
+			grown += target - ext_len;
+			revmap_rekey(qf, cluster_fingerprint(qf, c, r, ext_len), base_bits +
+									 bits_per_slot * ext_len, cluster_fingerprint(qf, out, o,
+																																target),
+									 base_bits + bits_per_slot * target);
+		}
+		r += ext_len;
+		o += target;
+	}
+	__sync_fetch_and_add(&qf->runtimedata->ext_slots, grown);
+}
+
+/* The last slot the decoded cluster c can reach once the fixes
+ * items[first..last) (sorted by slot) are applied.  Records don't keep
+ * their slots, so pos follows the layout cluster_encode gives them as they
+ * are, and end the one it gives them grown. */
+static uint64_t adapt_batch_reach(const QF *qf, const qf_cluster *c, const
+																	qf_batch_item *items, const uint64_t
+																	*others, uint64_t first, uint64_t last)
+{
+	uint64_t pos = c->start, end = c->start, r, k = first;
+
+	for (r = 0; r < c->len; r++, pos++, end++) {
+		const cluster_slot *cs = &c->slots[r];
+		if (cs->kind != CS_REMAINDER)
+			continue;
+		if (r == 0 || cs->bucket != c->slots[r - 1].bucket) {
+			pos = pos > cs->bucket ? pos : cs->bucket;
+			end = end > cs->bucket ? end : cs->bucket;
+		}
+		for (; k < last && items[k].bucket < pos; k++);
+		uint64_t ext_len = cluster_ext_len(c, r), target = ext_len;
+		for (; k < last && items[k].bucket == pos; k++) {
+			uint64_t len = adapt_batch_ext_len(qf, items[k].hash,
+																				 others[items[k].index], ext_len);
+			if (len > target)
+				target = len;
+		}
+		end += target - ext_len;
+	}
+	return end - 1;
+}
+
+/* Whether the cluster at start ends within limit slots, so that it is
+ * worth decoding. */
+static bool adapt_batch_short(const QF *qf, uint64_t start, uint64_t limit)
+{
+	uint64_t end = start + limit < qf->metadata->xnslots ? start + limit :
+		qf->metadata->xnslots;
+
+	for (; start < end; start++)
+		if (slot_is_free(qf, start))
+			return true;
+	return start == qf->metadata->xnslots;
+}
+
+int64_t qf_adapt_batch(QF *qf, const uint64_t *indexes, const uint64_t *keys,
+											 const uint64_t *other_keys, uint64_t n, uint64_t
+											 *ret_hashes, int *results, uint8_t flags)
+{
+	const bool locking = GET_NO_LOCK(flags) != QF_NO_LOCK;
+	uint64_t i, applied = 0;
+	qf_cluster c, next, out;
+	bool nomem = false;
+	QF cur;
+
+	if (n == 0)
 		return 0;
+	resize_snapshot(qf, &cur);
+	QF *resized = __atomic_load_n(&cur.runtimedata->resize_next,
+																__ATOMIC_ACQUIRE);
+	if (resized != NULL) {
+		// bring over the fixed items' chunks rather than the whole table
+		for (i = 0; i < n; i++)
+			resize_move_hash(qf, cur.runtimedata, key_to_hash(&cur, keys[i],
+																												flags));
+		cur = *resized;
 	}
-	
-	return adapt(qf, index, (hash % qf->metadata->range) >> qf->metadata->bits_per_slot, hash, other_hash, ret_hash);
+	const uint64_t bits_per_slot = cur.metadata->bits_per_slot;
+	const uint64_t base_bits = cur.metadata->quotient_bits + bits_per_slot;
+	const uint64_t slots_per_lock = cur.runtimedata->slots_per_lock;
+	qf_batch_item *items = (qf_batch_item *)malloc(n * sizeof(qf_batch_item));
+	uint64_t *others = (uint64_t *)malloc(n * sizeof(uint64_t));
+	int *lens = (int *)malloc(n * sizeof(int));
+	if (items == NULL || others == NULL || lens == NULL) {
+		free(lens);
+		free(others);
+		free(items);
+		return QF_NO_MEMORY;
+	}
+	for (i = 0; i < n; i++) {
+		items[i].hash = key_to_hash(&cur, keys[i], flags);
+		items[i].bucket = indexes[i];	/* slot order is bucket order */
+		items[i].index = i;
+		others[i] = key_to_hash(&cur, other_keys[i], flags);
+	}
+	// indexes go up to xnslots, one bit past the quotient
+	items = batch_sort(items, n, cur.metadata->quotient_bits + 1);
+	memset(&c, 0, sizeof(c));
+	memset(&next, 0, sizeof(next));
+	memset(&out, 0, sizeof(out));
+
+	// fixes [i, last) are the ones in the cluster of fix last - 1
+	for (uint64_t last = n; last > 0; last = i) {
+		uint64_t bucket = (items[last - 1].hash >> bits_per_slot) &
+			BITMASK(cur.metadata->quotient_bits);
+		uint64_t first_region, last_region, lock_end, k, r;
+		bool fits = false;
+
+		i = last - 1;
+		lock_region_range(&cur, bucket, /*small*/ false, &first_region,
+											&last_region);
+		lock_end = (last_region + 1) * slots_per_lock;
+		if (lock_end > cur.metadata->xnslots || !locking)
+			lock_end = cur.metadata->xnslots;
+		if (!locking || lock_regions(&cur, first_region, last_region, flags)) {
+			if (slot_is_free(&cur, items[i].bucket)) {
+				// there is no item to adapt
+				if (locking)
+					unlock_regions(&cur, first_region, last_region);
+				lens[items[i].index] = QF_INVALID;
+				items[i].hash = 0;
+				continue;
+			}
+			// back to the start of the cluster, taking in the fixes on the way; a
+			// long cluster with few fixes costs less shifted once per fix
+			uint64_t start = items[i].bucket;
+			for (;;) {
+				while (i > 0 && items[i - 1].bucket >= start)
+					i--;
+				if (start == 0 || slot_is_free(&cur, start - 1) || items[last -
+																																1].bucket -
+						start >= (last - i) * QF_ADAPT_BATCH_RECORDS)
+					break;
+				start--;
+			}
+			uint64_t budget = (last - i) * QF_ADAPT_BATCH_RECORDS;
+			fits = (start == 0 || slot_is_free(&cur, start - 1)) && (!locking ||
+																															 start >=
+																															 first_region *
+																															 slots_per_lock)
+				&& adapt_batch_short(&cur, start, budget) && cluster_decode(&cur,
+																																		 start, &c);
+			// take in the clusters that the growth runs into
+			while (fits) {
+				uint64_t reach = adapt_batch_reach(&cur, &c, items, others, i, last);
+				for (k = c.end + 1; k <= reach && k < lock_end && slot_is_free(&cur,
+																																			 k); k++);
+				if (k > reach)
+					break;
+				fits = k < lock_end && c.len < budget && adapt_batch_short(&cur, k,
+																																	 budget -
+																																	 c.len) &&
+					cluster_decode(&cur, k, &next);
+				for (r = 0; fits && r < next.len; r++)
+					if (!cluster_push(&c, next.slots[r].value, next.slots[r].payload,
+														next.slots[r].bucket, next.slots[r].kind))
+						nomem = true, fits = false;
+				c.end = next.end;
+			}
+			if (!fits && locking)
+				unlock_regions(&cur, first_region, last_region);
+		}
+		if (nomem)
+			break;
+		if (!fits) {
+			// one fix at a time, with qf_adapt's own locking; from the back, so
+			// that the shifts leave the slots of the others alone
+			for (k = last; k > i; k--) {
+				uint64_t fingerprint = 0, f = items[k - 1].index;
+				int len = k < last ? lens[items[k].index] : 0;
+				// the fix before, on the same item, may already tell this one apart
+				if (len > 0 && len < 64 && items[k].bucket == items[k - 1].bucket &&
+						((items[k - 1].hash ^ others[f]) & BITMASK(len)) != 0) {
+					lens[f] = len;
+					items[k - 1].hash &= BITMASK(len);
+					continue;
+				}
+				lens[f] = qf_adapt(qf, indexes[f], keys[f], other_keys[f],
+													 &fingerprint, flags);
+				items[k - 1].hash = fingerprint;
+			}
+			continue;
+		}
+
+		// copy the records over, growing the items that have fixes
+		uint64_t pos = c.start, grown = 0;
+		out.start = c.start;
+		out.end = c.end;
+		out.len = 0;
+		k = i;
+		for (r = 0; r < c.len && !nomem; r++, pos++) {
+			const cluster_slot *cs = &c.slots[r];
+			if (cs->kind != CS_REMAINDER) {
+				nomem = !cluster_push(&out, cs->value, 0, cs->bucket, cs->kind);
+				continue;
+			}
+			if (r == 0 || cs->bucket != c.slots[r - 1].bucket)
+				pos = pos > cs->bucket ? pos : cs->bucket;
+			for (; k < last && items[k].bucket < pos; k++)
+				lens[items[k].index] = QF_INVALID;
+
+			uint64_t ext_len = cluster_ext_len(&c, r), target = ext_len, e;
+			int old_len = base_bits + bits_per_slot * ext_len;
+			__uint128_t old_fingerprint = cluster_fingerprint(&cur, &c, r, ext_len);
+			uint64_t first_fix = k, hash = 0;
+			for (; k < last && items[k].bucket == pos; k++) {
+				uint64_t h = items[k].hash, o = others[items[k].index];
+				lens[items[k].index] = 0;
+				if (h == o)
+					continue;
+				if ((h & BITMASK128(old_len)) != old_fingerprint) {
+					lens[items[k].index] = QF_INVALID;
+					continue;
+				}
+				// every fix counts towards lazy adaptation, as with qf_adapt
+				uint64_t len = adapt_batch_ext_len(&cur, h, o, ext_len);
+				if (len > ext_len && adapt_allowed(&cur, pos, cs->bucket, ext_len,
+																					 len - ext_len, old_fingerprint,
+																					 old_len, true) && len > target) {
+					target = len;
+					hash = h;
+				}
+			}
+			for (; first_fix < k; first_fix++)
+				if (lens[items[first_fix].index] == 0 && items[first_fix].hash !=
+						others[items[first_fix].index])
+					lens[items[first_fix].index] = base_bits + bits_per_slot * target;
+
+			nomem = !cluster_push(&out, cs->value, cs->payload, cs->bucket,
+														CS_REMAINDER);
+			for (e = 0; e < ext_len && !nomem; e++)
+				nomem = !cluster_push(&out, c.slots[r + 1 + e].value, 0, cs->bucket,
+															CS_EXTENSION);
+			for (e = ext_len; e < target && !nomem; e++)
+				nomem = !cluster_push(&out, (hash >> (base_bits + bits_per_slot * e)) &
+															BITMASK(bits_per_slot), 0, cs->bucket,
+															CS_EXTENSION);
+			grown += target - ext_len;
+			pos += ext_len;
+			r += ext_len;
+		}
+		if (nomem) {
+			// nothing is written back until the whole cluster is copied
+			if (locking)
+				unlock_regions(&cur, first_region, last_region);
+			break;
+		}
+		for (; k < last; k++)
+			lens[items[k].index] = QF_INVALID;
+
+		if (grown > 0) {
+			// cluster_encode takes the gaps between the clusters for freed slots
+			uint64_t gaps = c.end + 1 - c.start - c.len;
+			cluster_encode(&cur, &out);
+			if (gaps > 0)
+				modify_metadata(&cur.runtimedata->pc_noccupied_slots, gaps);
+			adapt_batch_rekey(&cur, &c, &out);
+		}
+		if (locking)
+			unlock_regions(&cur, first_region, last_region);
+		for (k = i; k < last; k++) {
+			int len = lens[items[k].index];
+			// the fingerprint is the bottom len bits of the item's hash
+			items[k].hash = len <= 0 ? 0 : len >= 64 ? items[k].hash :
+				items[k].hash & BITMASK(len);
+		}
+	}
+
+	for (i = 0; i < n && !nomem; i++) {
+		if (lens[items[i].index] >= 0)
+			applied++;
+		if (ret_hashes != NULL)
+			ret_hashes[items[i].index] = items[i].hash;
+		if (results != NULL)
+			results[items[i].index] = lens[items[i].index];
+	}
+	free(c.slots);
+	free(next.slots);
+	free(out.slots);
+	free(lens);
+	free(others);
+	free(items);
+	return nomem ? QF_NO_MEMORY : (int64_t)applied;
 }
 
-int64_t qf_get_unique_index(const QF *qf, uint64_t key, uint64_t value,
-														uint8_t flags)
+/* Remove up to count instances of the item whose fingerprint matches hash.
+ * Decodes the item's cluster, drops the item's remainder, extension and
+ * counter records (or just rewrites its counter) and writes the cluster
+ * back in one pass, so offsets, runends, extensions and occupieds stay
+ * consistent across blocks.  Items that were only extended to tell them
+ * apart from the removed item lose those extensions again.  Returns the
+ * number of slots freed. */
+static int remove_item(QF *qf, __uint128_t hash, uint64_t count, __uint128_t
+											 *ret_hash, int *ret_hash_len, uint8_t flags)
 {
-	if (GET_KEY_HASH(flags) != QF_KEY_IS_HASH) {
-		if (qf->metadata->hash_mode == QF_HASH_DEFAULT)
-			key = MurmurHash64A(((void *)&key), sizeof(key),
-													qf->metadata->seed) % qf->metadata->range;
-		else if (qf->metadata->hash_mode == QF_HASH_INVERTIBLE)
-			key = hash_64(key, BITMASK(qf->metadata->key_bits));
+	const uint64_t bits_per_slot = qf->metadata->bits_per_slot;
+	const uint64_t base_bits = qf->metadata->quotient_bits + bits_per_slot;
+	uint64_t hash_bucket_index = (hash & BITMASK(base_bits)) >> bits_per_slot;
+
+	if (GET_NO_LOCK(flags) != QF_NO_LOCK) {
+		if (!qf_lock(qf, hash_bucket_index, /*small*/ false, flags))
+			return QF_COULDNT_LOCK;
 	}
-	uint64_t hash = (key << qf->metadata->value_bits) | (value &
-																											 BITMASK(qf->metadata->value_bits));
-	uint64_t hash_remainder   = hash & BITMASK(qf->metadata->bits_per_slot);
-	int64_t hash_bucket_index = hash >> qf->metadata->bits_per_slot;
 
-	if (!is_occupied(qf, hash_bucket_index))
-		return QF_DOESNT_EXIST;
+	int ret = QF_DOESNT_EXIST;
+	uint64_t index, cur_count;
+	__uint128_t ext;
+	int ext_len;
+	if (!find_item(qf, hash, true, &index, &ext, &ext_len, &cur_count, NULL))
+		goto out;
+	*ret_hash = (hash & BITMASK(base_bits)) | (ext << base_bits);
+	*ret_hash_len = base_bits + bits_per_slot * ext_len;
+
+	qf_cluster c;
+	memset(&c, 0, sizeof(c));
+	uint64_t start = cluster_start(qf, index);
+	if (!cluster_decode(qf, start, &c)) {
+		free(c.slots);
+		ret = QF_NO_SPACE;
+		goto out;
+	}
+	uint64_t victim = index - start, i;
+	uint64_t count_first = victim + 1 + ext_len, count_last = count_first;
+	while (count_last < c.len && c.slots[count_last].kind == CS_COUNTER)
+		count_last++;
+
+	if (count < cur_count) {
+		uint64_t rest = cur_count - count;
+		for (i = count_first; i < count_last; i++) {
+			if (rest <= 1 && i == count_first)
+				rest = 0;		/* a count of one needs no counter slots */
+			if (rest == 0)
+				c.slots[i].kind = CS_DROPPED;
+			else
+				c.slots[i].value = rest & BITMASK(bits_per_slot);
+			rest >>= bits_per_slot;
+		}
+		modify_metadata(&qf->runtimedata->pc_nelts, -(int64_t)count);
+	} else {
+		uint64_t first = victim, last = victim + 1;
+		while (first > 0 && c.slots[first - 1].bucket == c.slots[victim].bucket)
+			first--;
+		while (last < c.len && c.slots[last].bucket == c.slots[victim].bucket)
+			last++;
+		cluster_trim_run(qf, &c, first, last, victim, flags);
+
+		for (i = victim; i < count_last; i++)
+			c.slots[i].kind = CS_DROPPED;
+		revmap_remove(qf, *ret_hash, *ret_hash_len);
+		__sync_fetch_and_sub(&qf->runtimedata->ext_slots, ext_len);
+		modify_metadata(&qf->runtimedata->pc_nelts, -(int64_t)cur_count);
+		modify_metadata(&qf->runtimedata->pc_ndistinct_elts, -1);
+	}
+	ret = cluster_encode(qf, &c);
+	free(c.slots);
 
-	int64_t runstart_index = hash_bucket_index == 0 ? 0 : run_end(qf,
-																																hash_bucket_index-1)
-		+ 1;
-	if (runstart_index < hash_bucket_index)
-		runstart_index = hash_bucket_index;
+out:
+	if (GET_NO_LOCK(flags) != QF_NO_LOCK) {
+		qf_unlock(qf, hash_bucket_index, /*small*/ false);
+	}
+	return ret;
+}
 
-	/* printf("MC RUNSTART: %02lx RUNEND: %02lx\n", runstart_index, runend_index); */
+static int64_t query_adapt(QF *qf, uint64_t key, uint64_t *ret_index, uint64_t
+													 *ret_hash, int *ret_hash_len, qf_verify_fn verify,
+													 void *arg, uint8_t flags)
+{
+	uint64_t hash = key_to_hash(qf, key, flags);
+	uint64_t hash_bucket_index = (hash >> qf->metadata->bits_per_slot) & BITMASK(qf->metadata->quotient_bits);
 
-	uint64_t current_remainder, current_count, current_end;
-	do {
-		//printf("2369");
-		current_end = decode_counter(qf, runstart_index, &current_remainder,
-																 &current_count);
-		if (current_remainder == hash_remainder)
-			return runstart_index;
+	uint64_t first_region, last_region;
+	if (GET_NO_LOCK(flags) != QF_NO_LOCK) {
+		uint64_t nslots = shift_slots_bound(qf, 1, 64);
+		if (!lock_for_shift(qf, hash_bucket_index, nslots, flags, &first_region,
+												&last_region))
+			return QF_COULDNT_LOCK;
+	}
+
+	int64_t ret = 0;
+	uint64_t index, count;
+	__uint128_t ext;
+	int ext_len;
+	if (find_item(qf, hash, false, &index, &ext, &ext_len, &count, NULL)) {
+		int len = (qf->metadata->bits_per_slot * ext_len) + qf->metadata->quotient_bits + qf->metadata->bits_per_slot;
+		__uint128_t fingerprint = (hash & BITMASK(qf->metadata->quotient_bits + qf->metadata->bits_per_slot)) | (ext << (qf->metadata->quotient_bits + qf->metadata->bits_per_slot));
+		uint64_t stored_key;
+		bool known;
+
+		// find out which key the matching item was inserted for
+		if (verify != NULL)
+			known = verify(arg, index, fingerprint, len, &stored_key);
+		else if (qf->runtimedata->payloads != NULL) {
+			stored_key = qf->runtimedata->payloads[index];
+			known = true;
+		} else
+			known = revmap_lookup(qf, fingerprint, len, &stored_key);
+
+		if (!known || stored_key == key)
+			ret = count;
+		else {
+			// false positive: extend the stored fingerprint until it no longer
+			// matches, if the adapt policy lets it
+			uint64_t stored_hash = key_to_hash(qf, stored_key, flags);
+			__uint128_t new_fingerprint;
+			int new_len = stored_hash == hash ? 0 : adapt_item(qf, index, hash_bucket_index, ext_len, stored_hash, hash, 64, true, &new_fingerprint);
+			if (new_len > 0) {
+				revmap_rekey(qf, fingerprint, len, new_fingerprint, new_len);
+				fingerprint = new_fingerprint;
+				len = new_len;
+			}
+		}
+
+		if (ret_index != NULL) *ret_index = index;
+		if (ret_hash != NULL) *ret_hash = fingerprint;
+		if (ret_hash_len != NULL) *ret_hash_len = len;
+	}
+
+	if (GET_NO_LOCK(flags) != QF_NO_LOCK) {
+		unlock_regions(qf, first_region, last_region);
+	}
 
-		runstart_index = current_end + 1;
-	} while (!is_runend(qf, current_end));
+	return ret;
+}
+
+int64_t qf_query_adapt(QF *qf, uint64_t key, uint64_t *ret_index, uint64_t
+											 *ret_hash, int *ret_hash_len, qf_verify_fn verify,
+											 void *arg, uint8_t flags)
+{
+	QF cur;
+	int64_t ret;
+	do {
+		resize_route(qf, &cur, key_to_hash(qf, key, flags));
+		ret = query_adapt(&cur, key, ret_index, ret_hash, ret_hash_len, verify, arg,
+											flags);
+	} while (resize_retry(ret));
+	return ret;
+}
 
-	return QF_DOESNT_EXIST;
+int64_t qf_get_unique_index(const QF *qf, uint64_t key, uint64_t value,
+														uint8_t flags)
+{
+	uint64_t index;
+	int64_t count = query_routed(qf, key_value_to_hash(qf, key, value, flags), &index, NULL, NULL, flags);
+	if (count < 0)
+		return count;
+	if (count == 0)
+		return QF_DOESNT_EXIST;
+	return index;
 }
 
 enum qf_hashmode qf_get_hashmode(const QF *qf) {
@@ -2671,6 +5606,10 @@ uint64_t qf_get_hash_seed(const QF *qf) {
 __uint128_t qf_get_hash_range(const QF *qf) {
 	return qf->metadata->range;
 }
+uint64_t qf_get_home_bucket(const QF *qf, uint64_t key, uint8_t flags) {
+	return (key_to_hash(qf, key, flags) >> qf->metadata->bits_per_slot) &
+		BITMASK(qf->metadata->quotient_bits);
+}
 
 bool qf_is_auto_resize_enabled(const QF *qf) {
 	if (qf->runtimedata->auto_resize == 1)
@@ -2719,6 +5658,17 @@ void qf_sync_counters(const QF *qf) {
 /* initialize the iterator at the run corresponding
  * to the position index
  */
+/* Last slot of the item whose remainder is at index: its extension and
+ * counter slots follow it. */
+static inline uint64_t item_last_slot(const QF *qf, uint64_t index)
+{
+	__uint128_t ext;
+	uint64_t count;
+	int ext_len, count_len;
+	get_slot_info(qf, index, &ext, &ext_len, &count, &count_len);
+	return index + ext_len + count_len;
+}
+
 int64_t qf_iterator_from_position(const QF *qf, QFi *qfi, uint64_t position)
 {
 	if (position == 0xffffffffffffffff) {
@@ -2796,21 +5746,25 @@ int64_t qf_iterator_from_key_value(const QF *qf, QFi *qfi, uint64_t key,
 			+ 1;
 		if (runstart_index < hash_bucket_index)
 			runstart_index = hash_bucket_index;
-		uint64_t current_remainder, current_count, current_end;
+		// items are added at the front of their run, so runs aren't sorted:
+		// look for "hash" itself, else take the first larger remainder
+		uint64_t current_index = runstart_index, found = 0;
+		bool last;
 		do {
-			//printf("2517");
-			current_end = decode_counter(qf, runstart_index, &current_remainder,
-																	 &current_count);
-			if (current_remainder >= hash_remainder) {
+			uint64_t current_remainder = get_slot(qf, current_index);
+			if (current_remainder == hash_remainder || (current_remainder >
+																									hash_remainder && !flag)) {
+				found = current_index;
 				flag = true;
-				break;
+				if (current_remainder == hash_remainder)
+					break;
 			}
-			runstart_index = current_end + 1;
-		} while (!is_runend(qf, current_end));
-		// found "hash" or smallest key greater than "hash" in this run.
+			last = is_runend(qf, current_index);
+			current_index = item_last_slot(qf, current_index) + 1;
+		} while (!last);
 		if (flag) {
 			qfi->run = hash_bucket_index;
-			qfi->current = runstart_index;
+			qfi->current = found;
 		}
 	}
 	// If a run doesn't start at "position" or the largest key in the run
@@ -2845,9 +5799,12 @@ static int qfi_get(const QFi *qfi, uint64_t *key, uint64_t *value, uint64_t
 	if (qfi_end(qfi))
 		return QFI_INVALID;
 
-	uint64_t current_remainder, current_count;
-	//printf("2565");
-	decode_counter(qfi->qf, qfi->current, &current_remainder, &current_count);
+	uint64_t current_remainder = get_slot(qfi->qf, qfi->current);
+	uint64_t current_count;
+	__uint128_t ext;
+	int ext_len, count_len;
+	get_slot_info(qfi->qf, qfi->current, &ext, &ext_len, &current_count,
+								&count_len);
 
 	*value = current_remainder & BITMASK(qfi->qf->metadata->value_bits);
 	current_remainder = current_remainder >> qfi->qf->metadata->value_bits;
@@ -2885,14 +5842,11 @@ int qfi_next(QFi *qfi)
 	if (qfi_end(qfi))
 		return QFI_INVALID;
 	else {
-		/* move to the end of the current counter*/
-		uint64_t current_remainder, current_count;
-		//printf("2606");
-		//if (qfi->current >= 256) return QF_NO_SPACE;
-		qfi->current = decode_counter(qfi->qf, qfi->current, &current_remainder,
-																	&current_count);
-		
-		if (!is_runend(qfi->qf, qfi->current)) {
+		/* move to the last slot of the current item */
+		bool last = is_runend(qfi->qf, qfi->current);
+		qfi->current = item_last_slot(qfi->qf, qfi->current);
+
+		if (!last) {
 			qfi->current++;
 #ifdef LOG_CLUSTER_LENGTH
 			qfi->cur_length++;
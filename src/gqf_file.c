@@ -28,8 +28,6 @@
 #include "gqf_int.h"
 #include "gqf_file.h"
 
-#define NUM_SLOTS_TO_LOCK (1ULL<<16)
-
 bool qf_initfile(QF *qf, uint64_t nslots, uint64_t key_bits, uint64_t
 								 value_bits, enum qf_hashmode hash, uint32_t seed, const char*
 								 filename)
@@ -132,22 +130,6 @@ uint64_t qf_usefile(QF* qf, const char* filename, int flag)
 	strcpy(qf->runtimedata->f_info.filepath, filename);
 	/* initialize container resize */
 	qf->runtimedata->container_resize = qf_resize_file;
-	/* initialize all the locks to 0 */
-	qf->runtimedata->metadata_lock = 0;
-	qf->runtimedata->locks = (volatile int *)calloc(qf->runtimedata->num_locks,
-																					sizeof(volatile int));
-	if (qf->runtimedata->locks == NULL) {
-		perror("Couldn't allocate memory for runtime locks.");
-		exit(EXIT_FAILURE);
-	}
-#ifdef LOG_WAIT_TIME
-	qf->runtimedata->wait_times = (wait_time_data* )calloc(qf->runtimedata->num_locks+1,
-																								 sizeof(wait_time_data));
-	if (qf->runtimedata->wait_times == NULL) {
-		perror("Couldn't allocate memory for runtime wait_times.");
-		exit(EXIT_FAILURE);
-	}
-#endif
 	qf->metadata = (qfmetadata *)mmap(NULL, sb.st_size, mmap_flag, MAP_SHARED,
 																		qf->runtimedata->f_info.fd, 0);
 	if (qf->metadata == MAP_FAILED) {
@@ -160,9 +142,13 @@ uint64_t qf_usefile(QF* qf, const char* filename, int flag)
 	}
 	qf->blocks = (qfblock *)(qf->metadata + 1);
 
-	pc_init(&qf->runtimedata->pc_nelts, (int64_t*)&qf->metadata->nelts, 8, 100);
-	pc_init(&qf->runtimedata->pc_ndistinct_elts, (int64_t*)&qf->metadata->ndistinct_elts, 8, 100);
-	pc_init(&qf->runtimedata->pc_noccupied_slots, (int64_t*)&qf->metadata->noccupied_slots, 8, 100);
+	/* initialize all the locks to 0 */
+	qf->runtimedata->metadata_lock = 0;
+	qf_set_lock_regions(qf, NUM_SLOTS_TO_LOCK, CLUSTER_SIZE);
+
+	pc_init(&qf->runtimedata->pc_nelts, (int64_t*)&qf->metadata->nelts, 0, 100);
+	pc_init(&qf->runtimedata->pc_ndistinct_elts, (int64_t*)&qf->metadata->ndistinct_elts, 0, 100);
+	pc_init(&qf->runtimedata->pc_noccupied_slots, (int64_t*)&qf->metadata->noccupied_slots, 0, 100);
 
 	return sizeof(qfmetadata) + qf->metadata->total_size_in_bytes;
 }
@@ -192,6 +178,8 @@ int64_t qf_resize_file(QF *qf, uint64_t nslots)
 		return false;
 	if (qf->runtimedata->auto_resize)
 		qf_set_auto_resize(&new_qf, true);
+	qf_set_lock_regions(&new_qf, qf->runtimedata->slots_per_lock,
+											qf->runtimedata->cluster_size);
 
 	// copy keys from qf into new_qf
 	QFi qfi;
@@ -313,15 +301,8 @@ uint64_t qf_deserialize(QF *qf, const char *filename)
 	}
 	strcpy(qf->runtimedata->f_info.filepath, filename);
 	/* initlialize the locks in the QF */
-	qf->runtimedata->num_locks = (qf->metadata->xnslots/NUM_SLOTS_TO_LOCK)+2;
 	qf->runtimedata->metadata_lock = 0;
-	/* initialize all the locks to 0 */
-	qf->runtimedata->locks = (volatile int *)calloc(qf->runtimedata->num_locks,
-																									sizeof(volatile int));
-	if (qf->runtimedata->locks == NULL) {
-		perror("Couldn't allocate memory for runtime locks.");
-		exit(EXIT_FAILURE);
-	}
+	qf_set_lock_regions(qf, NUM_SLOTS_TO_LOCK, CLUSTER_SIZE);
 	qf->metadata = (qfmetadata *)realloc(qf->metadata,
 																			 qf->metadata->total_size_in_bytes +
 																			 sizeof(qfmetadata));
@@ -341,9 +322,9 @@ uint64_t qf_deserialize(QF *qf, const char *filename)
 	}
 	fclose(fin);
 
-	pc_init(&qf->runtimedata->pc_nelts, (int64_t*)&qf->metadata->nelts, 8, 100);
-	pc_init(&qf->runtimedata->pc_ndistinct_elts, (int64_t*)&qf->metadata->ndistinct_elts, 8, 100);
-	pc_init(&qf->runtimedata->pc_noccupied_slots, (int64_t*)&qf->metadata->noccupied_slots, 8, 100);
+	pc_init(&qf->runtimedata->pc_nelts, (int64_t*)&qf->metadata->nelts, 0, 100);
+	pc_init(&qf->runtimedata->pc_ndistinct_elts, (int64_t*)&qf->metadata->ndistinct_elts, 0, 100);
+	pc_init(&qf->runtimedata->pc_noccupied_slots, (int64_t*)&qf->metadata->noccupied_slots, 0, 100);
 
 	return sizeof(qfmetadata) + qf->metadata->total_size_in_bytes;
 }
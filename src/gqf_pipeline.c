@@ -0,0 +1,247 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "gqf.h"
+#include "gqf_int.h"
+#include "gqf_pipeline.h"
+
+/* Operations an owner applies under one qf_lock_buckets. */
+#define QF_PIPELINE_BATCH 256
+/* Idle polls before an owner or a blocked producer yields the CPU. */
+#define QF_PIPELINE_SPINS 64
+
+enum qf_pipeline_op_type {
+	QF_PIPELINE_INSERT,
+	QF_PIPELINE_ADAPT
+};
+
+typedef struct qf_pipeline_op {
+	uint64_t key;
+	uint64_t count;
+	uint64_t bucket;
+	int type;
+} qf_pipeline_op;
+
+/* One slot of a bounded multi-producer queue (Vyukov).  seq says whether
+ * the slot is free for the producer at position seq or holds the op for
+ * the consumer at position seq - 1. */
+typedef struct qf_pipeline_cell {
+	volatile uint64_t seq;
+	qf_pipeline_op op;
+} qf_pipeline_cell;
+
+typedef struct __attribute__ ((aligned (64))) qf_pipeline_owner {
+	qf_pipeline *p;
+	pthread_t thread;
+	qf_pipeline_cell *cells;
+	uint64_t mask;
+	/* producers and the owner write these, so keep them apart */
+	volatile uint64_t enqueue_pos __attribute__ ((aligned (64)));
+	volatile uint64_t dequeue_pos __attribute__ ((aligned (64)));
+	volatile uint64_t applied;
+	qf_pipeline_op batch[QF_PIPELINE_BATCH];
+} qf_pipeline_owner;
+
+struct qf_pipeline {
+	QF *qf;
+	uint8_t flags;
+	int nowners;
+	uint64_t regions_per_owner;
+	volatile int stop;
+	volatile int error;
+	qf_pipeline_owner *owners;
+};
+
+static inline void pipeline_relax(uint32_t *spins)
+{
+	if (++*spins % QF_PIPELINE_SPINS == 0)
+		sched_yield();
+	else
+		__builtin_ia32_pause();
+}
+
+static void pipeline_push(qf_pipeline *p, uint64_t key, uint64_t count, int
+													type)
+{
+	uint64_t bucket = qf_get_home_bucket(p->qf, key, p->flags);
+	qf_pipeline_owner *o = &p->owners[bucket / qf_get_slots_per_lock(p->qf) /
+		p->regions_per_owner];
+	uint64_t pos = __atomic_load_n(&o->enqueue_pos, __ATOMIC_RELAXED);
+	uint32_t spins = 0;
+	qf_pipeline_cell *cell;
+
+	while (true) {
+		cell = &o->cells[pos & o->mask];
+		int64_t dif = (int64_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) -
+														pos);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&o->enqueue_pos, &pos, pos + 1, true,
+																			__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			// full; wait for the owner to catch up
+			pipeline_relax(&spins);
+			pos = __atomic_load_n(&o->enqueue_pos, __ATOMIC_RELAXED);
+		} else
+			pos = __atomic_load_n(&o->enqueue_pos, __ATOMIC_RELAXED);
+	}
+	cell->op.key = key;
+	cell->op.count = count;
+	cell->op.bucket = bucket;
+	cell->op.type = type;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+static int op_cmp(const void *a, const void *b)
+{
+	uint64_t x = ((const qf_pipeline_op *)a)->bucket;
+	uint64_t y = ((const qf_pipeline_op *)b)->bucket;
+	return x < y ? -1 : x > y;
+}
+
+static void *pipeline_owner(void *arg)
+{
+	qf_pipeline_owner *o = (qf_pipeline_owner *)arg;
+	qf_pipeline *p = o->p;
+	uint8_t flags = QF_NO_LOCK | p->flags;
+	uint32_t spins = 0;
+
+	while (true) {
+		uint64_t pos = o->dequeue_pos;
+		int n = 0, i;
+
+		while (n < QF_PIPELINE_BATCH) {
+			qf_pipeline_cell *cell = &o->cells[pos & o->mask];
+			if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos + 1)
+				break;
+			o->batch[n++] = cell->op;
+			__atomic_store_n(&cell->seq, pos + o->mask + 1, __ATOMIC_RELEASE);
+			pos++;
+		}
+		o->dequeue_pos = pos;
+		if (n == 0) {
+			if (p->stop && __atomic_load_n(&o->enqueue_pos, __ATOMIC_ACQUIRE) == pos)
+				break;
+			pipeline_relax(&spins);
+			continue;
+		}
+
+		// neighbouring inserts share blocks, and the batch locks its span once
+		qsort(o->batch, n, sizeof(qf_pipeline_op), op_cmp);
+		qf_lock_buckets(p->qf, o->batch[0].bucket, o->batch[n - 1].bucket,
+										QF_WAIT_FOR_LOCK);
+		for (i = 0; i < n; i++) {
+			int64_t ret;
+			if (o->batch[i].type == QF_PIPELINE_INSERT) {
+				uint64_t index, hash;
+				int hash_len;
+				ret = qf_insert_ret(p->qf, o->batch[i].key, o->batch[i].count, &index,
+														&hash, &hash_len, flags);
+			} else
+				ret = qf_query_adapt(p->qf, o->batch[i].key, NULL, NULL, NULL, NULL,
+														 NULL, flags);
+			if (ret < 0)
+				__sync_bool_compare_and_swap(&p->error, 0, (int)ret);
+		}
+		qf_unlock_buckets(p->qf, o->batch[0].bucket, o->batch[n - 1].bucket);
+		__atomic_store_n(&o->applied, pos, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+qf_pipeline *qf_pipeline_create(QF *qf, int nowners, uint64_t queue_len,
+																uint8_t flags)
+{
+	uint64_t slots_per_lock = qf_get_slots_per_lock(qf);
+	uint64_t nregions = (qf_get_nslots(qf) + slots_per_lock - 1) /
+		slots_per_lock;
+	uint64_t capacity = 2, i;
+	int started;
+
+	if (nowners < 1)
+		nowners = 1;
+	if ((uint64_t)nowners > nregions)
+		nowners = nregions;
+	while (capacity < queue_len)
+		capacity <<= 1;
+
+	qf_pipeline *p = (qf_pipeline *)calloc(1, sizeof(qf_pipeline));
+	if (p == NULL)
+		return NULL;
+	p->qf = qf;
+	p->flags = flags & QF_KEY_IS_HASH;
+	p->regions_per_owner = (nregions + nowners - 1) / nowners;
+	// the rounding can leave the last owners without regions
+	p->nowners = (nregions + p->regions_per_owner - 1) / p->regions_per_owner;
+	p->owners = (qf_pipeline_owner *)aligned_alloc(sizeof(qf_pipeline_owner),
+																								 p->nowners *
+																								 sizeof(qf_pipeline_owner));
+	if (p->owners == NULL) {
+		free(p);
+		return NULL;
+	}
+	memset(p->owners, 0, p->nowners * sizeof(qf_pipeline_owner));
+
+	for (started = 0; started < p->nowners; started++) {
+		qf_pipeline_owner *o = &p->owners[started];
+		o->p = p;
+		o->mask = capacity - 1;
+		o->cells = (qf_pipeline_cell *)malloc(capacity * sizeof(qf_pipeline_cell));
+		if (o->cells == NULL)
+			break;
+		for (i = 0; i < capacity; i++)
+			o->cells[i].seq = i;
+		if (pthread_create(&o->thread, NULL, pipeline_owner, o)) {
+			free(o->cells);
+			break;
+		}
+	}
+	if (started < p->nowners) {
+		p->nowners = started;
+		qf_pipeline_destroy(p);
+		return NULL;
+	}
+
+	return p;
+}
+
+void qf_pipeline_insert(qf_pipeline *p, uint64_t key, uint64_t count)
+{
+	pipeline_push(p, key, count, QF_PIPELINE_INSERT);
+}
+
+void qf_pipeline_adapt(qf_pipeline *p, uint64_t key)
+{
+	pipeline_push(p, key, 0, QF_PIPELINE_ADAPT);
+}
+
+int qf_pipeline_flush(qf_pipeline *p)
+{
+	int i;
+
+	for (i = 0; i < p->nowners; i++) {
+		qf_pipeline_owner *o = &p->owners[i];
+		uint64_t target = __atomic_load_n(&o->enqueue_pos, __ATOMIC_ACQUIRE);
+		uint32_t spins = 0;
+		while (__atomic_load_n(&o->applied, __ATOMIC_ACQUIRE) < target)
+			pipeline_relax(&spins);
+	}
+	return __atomic_exchange_n(&p->error, 0, __ATOMIC_ACQ_REL);
+}
+
+int qf_pipeline_destroy(qf_pipeline *p)
+{
+	int ret, i;
+
+	p->stop = 1;
+	for (i = 0; i < p->nowners; i++) {
+		pthread_join(p->owners[i].thread, NULL);
+		free(p->owners[i].cells);
+	}
+	ret = p->error;
+	free(p->owners);
+	free(p);
+	return ret;
+}
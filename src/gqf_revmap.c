@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gqf_revmap.h"
+
+#define RM_MIN_CAPACITY 64
+
+static inline uint64_t rm_hash(__uint128_t fingerprint, uint32_t len)
+{
+	/* The low bits of a fingerprint are already well mixed when the CQF
+	 * hashes keys, but not with QF_HASH_NONE, so run the murmur finalizer
+	 * over it anyway. */
+	uint64_t h = (uint64_t)fingerprint ^ (uint64_t)(fingerprint >> 64) ^
+		((uint64_t)len << 56);
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static inline uint64_t rm_find(const rm_t *rm, __uint128_t fingerprint, uint32_t
+															 len)
+{
+	uint64_t mask = rm->capacity - 1;
+	uint64_t i = rm_hash(fingerprint, len) & mask;
+	while (rm->entries[i].len != 0 && (rm->entries[i].len != len ||
+																		 rm->entries[i].fingerprint !=
+																		 fingerprint))
+		i = (i + 1) & mask;
+	return i;
+}
+
+static int rm_grow(rm_t *rm)
+{
+	rmentry *old = rm->entries;
+	uint64_t old_capacity = rm->capacity;
+
+	rm->entries = (rmentry *)calloc(old_capacity * 2, sizeof(*rm->entries));
+	if (rm->entries == NULL) {
+		perror("Couldn't allocate memory for the reverse map.");
+		rm->entries = old;
+		return RM_ERROR;
+	}
+	rm->capacity = old_capacity * 2;
+
+	for (uint64_t i = 0; i < old_capacity; i++)
+		if (old[i].len != 0)
+			rm->entries[rm_find(rm, old[i].fingerprint, old[i].len)] = old[i];
+	free(old);
+
+	return 0;
+}
+
+int rm_init(rm_t *rm, uint64_t capacity)
+{
+	uint64_t c = RM_MIN_CAPACITY;
+	while (c < capacity)
+		c <<= 1;
+
+	rm->entries = (rmentry *)calloc(c, sizeof(*rm->entries));
+	if (rm->entries == NULL) {
+		perror("Couldn't allocate memory for the reverse map.");
+		return RM_ERROR;
+	}
+	rm->capacity = c;
+	rm->nentries = 0;
+	rm->lock = 0;
+
+	return 0;
+}
+
+void rm_destructor(rm_t *rm)
+{
+	rmentry *e = rm->entries;
+	rm->entries = NULL;
+	rm->capacity = rm->nentries = 0;
+	free(e);
+}
+
+int rm_insert(rm_t *rm, __uint128_t fingerprint, uint32_t len, uint64_t key)
+{
+	if ((rm->nentries + 1) * 4 > rm->capacity * 3)
+		if (rm_grow(rm) < 0)
+			return RM_ERROR;
+
+	uint64_t i = rm_find(rm, fingerprint, len);
+	if (rm->entries[i].len == 0)
+		rm->nentries++;
+	rm->entries[i].fingerprint = fingerprint;
+	rm->entries[i].key = key;
+	rm->entries[i].len = len;
+
+	return 0;
+}
+
+bool rm_lookup(const rm_t *rm, __uint128_t fingerprint, uint32_t len, uint64_t
+							 *key)
+{
+	if (rm->entries == NULL || len == 0)
+		return false;
+	uint64_t i = rm_find(rm, fingerprint, len);
+	if (rm->entries[i].len == 0)
+		return false;
+	*key = rm->entries[i].key;
+	return true;
+}
+
+bool rm_remove(rm_t *rm, __uint128_t fingerprint, uint32_t len, uint64_t *key)
+{
+	if (rm->entries == NULL || len == 0)
+		return false;
+	uint64_t mask = rm->capacity - 1;
+	uint64_t i = rm_find(rm, fingerprint, len);
+	if (rm->entries[i].len == 0)
+		return false;
+	if (key)
+		*key = rm->entries[i].key;
+
+	/* Backward-shift deletion: pull later entries of the probe sequence into
+	 * the hole so that lookups never need tombstones. */
+	uint64_t j = i;
+	while (true) {
+		j = (j + 1) & mask;
+		if (rm->entries[j].len == 0)
+			break;
+		uint64_t home = rm_hash(rm->entries[j].fingerprint, rm->entries[j].len)
+			& mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			rm->entries[i] = rm->entries[j];
+			i = j;
+		}
+	}
+	memset(&rm->entries[i], 0, sizeof(rm->entries[i]));
+	rm->nentries--;
+
+	return true;
+}
+
+int rm_rekey(rm_t *rm, __uint128_t old_fingerprint, uint32_t old_len,
+						 __uint128_t new_fingerprint, uint32_t new_len)
+{
+	uint64_t key;
+	if (old_fingerprint == new_fingerprint && old_len == new_len)
+		return 0;
+	if (!rm_remove(rm, old_fingerprint, old_len, &key))
+		return RM_ERROR;
+	return rm_insert(rm, new_fingerprint, new_len, key);
+}
@@ -0,0 +1,304 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "gqf.h"
+#include "gqf_int.h"
+#include "gqf_sharded.h"
+#include "hashutil.h"
+
+/* Nodes looked for under /sys/devices/system/node. */
+#define QF_SHARDED_MAX_NODES 64
+
+typedef struct qf_shard {
+	QF qf;
+	int node;
+} qf_shard;
+
+struct qf_sharded {
+	uint64_t key_bits;
+	uint64_t value_bits;
+	enum qf_hashmode hash_mode;
+	uint32_t seed;
+	int shard_bits;
+	int nshards;
+	int nnodes;
+	cpu_set_t *node_cpus;
+	qf_shard *shards;
+};
+
+static inline uint64_t sharded_mask(uint64_t bits)
+{
+	return bits >= 64 ? ~0ULL : (1ULL << bits) - 1;
+}
+
+/* Reads a cpulist such as "0-3,8-11" into cpus.  Returns false if the file
+ * is missing or lists no CPUs. */
+static bool read_cpulist(const char *path, cpu_set_t *cpus)
+{
+	FILE *f = fopen(path, "r");
+	int first, last, n;
+
+	if (f == NULL)
+		return false;
+	CPU_ZERO(cpus);
+	while ((n = fscanf(f, "%d-%d", &first, &last)) >= 1) {
+		if (n == 1)
+			last = first;
+		for (; first <= last; first++)
+			CPU_SET(first, cpus);
+		if (fgetc(f) != ',')
+			break;
+	}
+	fclose(f);
+	return CPU_COUNT(cpus) > 0;
+}
+
+/* The CPUs of each NUMA node that has any.  Without NUMA information all
+ * the CPUs this thread may run on form one node. */
+static int find_nodes(cpu_set_t *node_cpus)
+{
+	char path[64];
+	int node, nnodes = 0;
+
+	for (node = 0; node < QF_SHARDED_MAX_NODES; node++) {
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+						 node);
+		if (read_cpulist(path, &node_cpus[nnodes]))
+			nnodes++;
+	}
+	if (nnodes == 0) {
+		if (sched_getaffinity(0, sizeof(cpu_set_t), &node_cpus[0]))
+			return 0;
+		nnodes = 1;
+	}
+	return nnodes;
+}
+
+typedef struct shard_setup {
+	qf_sharded *s;
+	int shard;
+	uint64_t nslots;
+	bool started;
+	bool ok;
+} shard_setup;
+
+/* Runs on the shard's node, so that its pages are first touched there. */
+static void *shard_alloc(void *arg)
+{
+	shard_setup *setup = (shard_setup *)arg;
+	qf_sharded *s = setup->s;
+	qf_shard *shard = &s->shards[setup->shard];
+	QF *qf = &shard->qf;
+	uint64_t key_bits = s->key_bits - s->shard_bits;
+
+	sched_setaffinity(0, sizeof(cpu_set_t), &s->node_cpus[shard->node]);
+	uint64_t total_num_bytes = qf_init(qf, setup->nslots, key_bits,
+																		 s->value_bits, QF_HASH_NONE, s->seed,
+																		 NULL, 0);
+	void *buffer = malloc(total_num_bytes);
+	qf->runtimedata = (qfruntime *)calloc(sizeof(qfruntime), 1);
+	if (buffer == NULL || qf->runtimedata == NULL) {
+		free(buffer);
+		free(qf->runtimedata);
+		qf->runtimedata = NULL;
+		return NULL;
+	}
+	memset(buffer, 0, total_num_bytes);
+	setup->ok = qf_init(qf, setup->nslots, key_bits, s->value_bits,
+											QF_HASH_NONE, s->seed, buffer, total_num_bytes) ==
+		total_num_bytes;
+	if (!setup->ok) {
+		free(buffer);
+		free(qf->runtimedata);
+		qf->runtimedata = NULL;
+	}
+	return NULL;
+}
+
+qf_sharded *qf_sharded_create(uint64_t nslots, uint64_t key_bits, uint64_t
+															value_bits, enum qf_hashmode hash, uint32_t
+															seed, int nshards)
+{
+	cpu_set_t node_cpus[QF_SHARDED_MAX_NODES];
+	int nnodes = find_nodes(node_cpus);
+	int shard_bits = 0, i;
+
+	if (nnodes == 0)
+		return NULL;
+	if (nshards < 1)
+		nshards = nnodes;
+	while ((1 << shard_bits) < nshards)
+		shard_bits++;
+	nshards = 1 << shard_bits;
+	if (nslots / nshards < QF_SLOTS_PER_BLOCK || key_bits <= (uint64_t)shard_bits)
+		return NULL;
+
+	qf_sharded *s = (qf_sharded *)calloc(1, sizeof(qf_sharded));
+	if (s == NULL)
+		return NULL;
+	s->key_bits = key_bits;
+	s->value_bits = value_bits;
+	s->hash_mode = hash;
+	s->seed = seed;
+	s->shard_bits = shard_bits;
+	s->nshards = nshards;
+	s->nnodes = nnodes;
+	s->node_cpus = (cpu_set_t *)malloc(nnodes * sizeof(cpu_set_t));
+	s->shards = (qf_shard *)calloc(nshards, sizeof(qf_shard));
+	shard_setup *setup = (shard_setup *)calloc(nshards, sizeof(shard_setup));
+	pthread_t *threads = (pthread_t *)calloc(nshards, sizeof(pthread_t));
+	if (s->node_cpus == NULL || s->shards == NULL || setup == NULL || threads
+			== NULL) {
+		free(threads);
+		free(setup);
+		free(s->shards);
+		free(s->node_cpus);
+		free(s);
+		return NULL;
+	}
+	memcpy(s->node_cpus, node_cpus, nnodes * sizeof(cpu_set_t));
+
+	bool ok = true;
+	for (i = 0; i < nshards; i++) {
+		s->shards[i].node = i % nnodes;
+		setup[i].s = s;
+		setup[i].shard = i;
+		setup[i].nslots = nslots / nshards;
+		setup[i].started = pthread_create(&threads[i], NULL, shard_alloc,
+																			&setup[i]) == 0;
+		// with no thread to put it on its node, allocate it here instead
+		if (!setup[i].started)
+			shard_alloc(&setup[i]);
+	}
+	for (i = 0; i < nshards; i++) {
+		if (setup[i].started)
+			pthread_join(threads[i], NULL);
+		ok = ok && setup[i].ok;
+	}
+	if (!ok) {
+		for (i = 0; i < nshards; i++)
+			if (setup[i].ok)
+				free(qf_destroy(&s->shards[i].qf));
+		s->nshards = 0;
+		qf_sharded_destroy(s);
+		s = NULL;
+	}
+	free(threads);
+	free(setup);
+	return s;
+}
+
+void qf_sharded_destroy(qf_sharded *s)
+{
+	int i;
+
+	for (i = 0; i < s->nshards; i++)
+		free(qf_destroy(&s->shards[i].qf));
+	free(s->shards);
+	free(s->node_cpus);
+	free(s);
+}
+
+/* The hash qf_insert would compute for the whole filter; its top
+ * shard_bits bits pick the shard and the rest is the shard's hash. */
+static inline uint64_t sharded_hash(const qf_sharded *s, uint64_t key,
+																		uint64_t value, uint8_t flags)
+{
+	if ((flags & QF_KEY_IS_HASH) != QF_KEY_IS_HASH) {
+		if (s->hash_mode == QF_HASH_DEFAULT)
+			key = MurmurHash64A(((void *)&key), sizeof(key), s->seed);
+		else if (s->hash_mode == QF_HASH_INVERTIBLE)
+			key = hash_64(key, sharded_mask(s->key_bits));
+	}
+	return ((key << s->value_bits) | (value & sharded_mask(s->value_bits))) &
+		sharded_mask(s->key_bits + s->value_bits);
+}
+
+static inline int hash_shard(const qf_sharded *s, uint64_t hash)
+{
+	return hash >> (s->key_bits + s->value_bits - s->shard_bits);
+}
+
+/* The key to pass to the shard, with QF_KEY_IS_HASH. */
+static inline uint64_t hash_shard_key(const qf_sharded *s, uint64_t hash)
+{
+	return (hash >> s->value_bits) & sharded_mask(s->key_bits - s->shard_bits);
+}
+
+int qf_sharded_insert(qf_sharded *s, uint64_t key, uint64_t value, uint64_t
+											count, uint8_t flags)
+{
+	uint64_t hash = sharded_hash(s, key, value, flags);
+	QF *qf = &s->shards[hash_shard(s, hash)].qf;
+	return qf_insert(qf, hash_shard_key(s, hash), value, count, flags |
+									 QF_KEY_IS_HASH);
+}
+
+int qf_sharded_remove(qf_sharded *s, uint64_t key, uint64_t value, uint64_t
+											count, uint8_t flags)
+{
+	uint64_t hash = sharded_hash(s, key, value, flags);
+	QF *qf = &s->shards[hash_shard(s, hash)].qf;
+	return qf_remove(qf, hash_shard_key(s, hash), value, count, flags |
+									 QF_KEY_IS_HASH);
+}
+
+uint64_t qf_sharded_count_key_value(const qf_sharded *s, uint64_t key,
+																		uint64_t value, uint8_t flags)
+{
+	uint64_t hash = sharded_hash(s, key, value, flags);
+	const QF *qf = &s->shards[hash_shard(s, hash)].qf;
+	return qf_count_key_value(qf, hash_shard_key(s, hash), value, flags |
+														QF_KEY_IS_HASH);
+}
+
+int qf_sharded_shard_of(const qf_sharded *s, uint64_t key, uint64_t value,
+												uint8_t flags)
+{
+	return hash_shard(s, sharded_hash(s, key, value, flags));
+}
+
+int qf_sharded_num_shards(const qf_sharded *s)
+{
+	return s->nshards;
+}
+
+QF *qf_sharded_get_shard(const qf_sharded *s, int shard)
+{
+	return &s->shards[shard].qf;
+}
+
+int qf_sharded_node_of(const qf_sharded *s, int shard)
+{
+	return s->shards[shard].node;
+}
+
+bool qf_sharded_bind_thread(const qf_sharded *s, int shard)
+{
+	return sched_setaffinity(0, sizeof(cpu_set_t),
+													 &s->node_cpus[s->shards[shard].node]) == 0;
+}
+
+uint64_t qf_sharded_get_sum_of_counts(const qf_sharded *s)
+{
+	uint64_t sum = 0;
+	int i;
+
+	for (i = 0; i < s->nshards; i++)
+		sum += qf_get_sum_of_counts(&s->shards[i].qf);
+	return sum;
+}
+
+uint64_t qf_sharded_get_num_occupied_slots(const qf_sharded *s)
+{
+	uint64_t sum = 0;
+	int i;
+
+	for (i = 0; i < s->nshards; i++)
+		sum += qf_get_num_occupied_slots(&s->shards[i].qf);
+	return sum;
+}
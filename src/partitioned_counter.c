@@ -53,25 +53,42 @@ void pc_destructor(pc_t *pc)
 	free(lc);
 }
 	
+/* Threads are numbered in the order they first add to a counter, and each
+ * one keeps to the local counter its number picks.  Unlike the CPU a thread
+ * runs on, that never changes, so as long as there are no more threads than
+ * counters a local counter only ever sees one writer.  The counts are only
+ * read through pc_sync, so the atomics need no ordering. */
+static uint32_t pc_num_threads;
+static __thread int64_t pc_thread_id = -1;
+
+static inline uint32_t pc_thread_counter(const pc_t *pc)
+{
+	if (pc_thread_id < 0)
+		pc_thread_id = __atomic_fetch_add(&pc_num_threads, 1, __ATOMIC_RELAXED);
+	return pc_thread_id % pc->num_counters;
+}
+
 void pc_add(pc_t *pc, int64_t count) {
-	int cpuid = sched_getcpu();
-	uint32_t counter_id = cpuid % pc->num_counters;
+	uint32_t counter_id = pc_thread_counter(pc);
 	int64_t cur_count =
 		__atomic_add_fetch(&pc->local_counters[counter_id].counter, count,
-											 __ATOMIC_SEQ_CST);
+											 __ATOMIC_RELAXED);
 	if (cur_count > pc->threshold || cur_count < -pc->threshold) {
 		int64_t new_count =
 			__atomic_exchange_n(&pc->local_counters[counter_id].counter, 0,
-													__ATOMIC_SEQ_CST);
-		__atomic_fetch_add(pc->global_counter, new_count, __ATOMIC_SEQ_CST);
+													__ATOMIC_RELAXED);
+		__atomic_fetch_add(pc->global_counter, new_count, __ATOMIC_RELAXED);
 	}
 }
 
 void pc_sync(pc_t *pc) {
 	for (uint32_t i = 0; i < pc->num_counters; i++) {
+		if (__atomic_load_n(&pc->local_counters[i].counter, __ATOMIC_RELAXED) ==
+				0)
+			continue;
 		int64_t c = __atomic_exchange_n(&pc->local_counters[i].counter, 0,
-																		__ATOMIC_SEQ_CST);
-		__atomic_fetch_add(pc->global_counter, c, __ATOMIC_SEQ_CST);
+																		__ATOMIC_RELAXED);
+		__atomic_fetch_add(pc->global_counter, c, __ATOMIC_RELAXED);
 	}
 }
 
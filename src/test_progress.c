@@ -23,7 +23,6 @@
 #include "include/gqf_int.h"
 #include "include/gqf_file.h"
 
-#include "sglib.h"
 
 int bp2() {
 	return 0;
@@ -116,29 +115,6 @@ struct _keyValuePair {
 	struct _keyValuePair *right;
 } typedef keyValuePair;
 
-#define HASH_TABLE_SIZE  22000000
-
-struct _ilist {
-	uint64_t val; // the value of the actual item
-	uint64_t rem; // the remainder representing the item in the filter including extensions and the quotient
-	uint64_t len; // the number of bits used by the remainder and quotient
-	struct _ilist *next;
-} typedef ilist;
-typedef struct sglib_hashed_ilist_iterator ilist_iter;
-ilist *htab[HASH_TABLE_SIZE];
-
-//#define ILIST_COMPARATOR(e1, e2)    ((e1->rem + (1 << e1->len)) - (e2->rem + (1 << e2->len)))
-#define ILIST_COMPARATOR(e1, e2)    (e1->len != e2->len ? e2->len - e1->len : e2->rem - e1->rem)
-
-unsigned int ilist_hash_function(ilist *e) {
-	return e->rem + (1 << e->len);
-}
-
-SGLIB_DEFINE_LIST_PROTOTYPES(ilist, ILIST_COMPARATOR, next)
-SGLIB_DEFINE_LIST_FUNCTIONS(ilist, ILIST_COMPARATOR, next)
-SGLIB_DEFINE_HASHED_CONTAINER_PROTOTYPES(ilist, HASH_TABLE_SIZE, ilist_hash_function)
-SGLIB_DEFINE_HASHED_CONTAINER_FUNCTIONS(ilist, HASH_TABLE_SIZE, ilist_hash_function)
-
 int find(uint64_t* array, int len, uint64_t item) {
 	uint64_t i;
 	for (i = 0; i < len; i++)
@@ -230,10 +206,6 @@ void printbin(uint64_t val) {
 	printf("\n");
 }
 
-ilist *find_ilist(uint64_t hash) {
-	return NULL;
-}
-
 int main(int argc, char **argv)
 {
 	if (argc < 7) {
@@ -298,6 +270,13 @@ int main(int argc, char **argv)
 		}
 
 		qf_set_auto_resize(&qf, false);
+		if (!qf_enable_reverse_map(&qf)) {
+			fprintf(stderr, "Can't allocate the reverse map.\n");
+			abort();
+		}
+		qf_adapt_policy policy = {0};
+		policy.max_occupancy = 0.95;
+		qf_set_adapt_policy(&qf, &policy);
 		
 		uint64_t count_fp = 0, count_p = 0;
 		
@@ -391,9 +370,7 @@ int main(int argc, char **argv)
 			abort();
 		}
 		
-		sglib_hashed_ilist_init(htab);
-		ilist ii, *nn, *ll;
-		ilist_iter it;
+		uint64_t orig_key;
 		
 		if (universe < (double)qf.metadata->range * 0.8) {
 			printf("warning: universe may be too small to fill filter to completion\n");
@@ -443,45 +420,27 @@ int main(int argc, char **argv)
 					i++;
 					continue;
 				}
-				ii.rem = *ret_hash;
-				ii.len = *ret_hash_len;
-				ilist *item_in_table = sglib_hashed_ilist_find_member(htab, &ii);
-				if (item_in_table == NULL) {
-          printf("error:\tfilter claimed to have fingerprint %lu but hashtable could not find it\n", ii.rem);
+				if (!qf_reverse_lookup(&qf, *ret_hash, *ret_hash_len, &orig_key)) {
+          printf("error:\tfilter claimed to have fingerprint %lu but the reverse map could not find it\n", *ret_hash);
           bp2();
         }
-				else if (item_in_table->val == j) {
+				else if (orig_key == j) {
 					//printf("log:\trandom insert %lu would have been duplicate, skipping\n", ii.rem);
 				}
 				else if (1){
 					uint64_t new_rem, upd_rem;
-					int ext_len = insert_and_extend(&qf, *ret_index, j, 1, item_in_table->val, &new_rem, &upd_rem, QF_KEY_IS_HASH | QF_NO_LOCK);
+					int ext_len = insert_and_extend(&qf, *ret_index, j, 1, orig_key, &new_rem, &upd_rem, QF_KEY_IS_HASH | QF_NO_LOCK);
 					if (ext_len == QF_NO_SPACE) {
 						//printf("filter is full after insert_and_extend at %lu\n", num_occupied_slots);
 						printf("filter is full after insert_and_extend\n");
 						break;
 					}
-          sglib_hashed_ilist_delete(htab, item_in_table);
-          item_in_table->rem = upd_rem;
-          item_in_table->len = ext_len;
-          sglib_hashed_ilist_add(htab, item_in_table);
-
-					nn = malloc(sizeof(ilist));
-					nn->val = j;
-					nn->rem = new_rem;
-					nn->len = ext_len;
-					sglib_hashed_ilist_add(htab, nn);
 					//printf("extended to length %d\n", insert_and_extend(&qf, *ret_index, j, 0, 1, findpart(vals, i - 1, *ret_hash, *ret_hash_len, qbits, rbits), 0, QF_KEY_IS_HASH | QF_NO_LOCK));
 					k++;
 					i++;
 				}
 			}
 			else if (ret == 1) {
-				nn = malloc(sizeof(ilist));
-				nn->val = j;
-				nn->rem = *ret_hash;
-				nn->len = *ret_hash_len;
-				sglib_hashed_ilist_add(htab, nn);
 				/*val_mem[val_cnt].key = val_mem[val_cnt].val = j & BITMASK(rbits);
 				val_mem[val_cnt].left = val_mem[val_cnt].right = NULL;
 				values = insertItem(values, &(val_mem[val_cnt]));
@@ -513,11 +472,6 @@ int main(int argc, char **argv)
 		
 		// PERFORM QUERIES
 		printf("starting %lu queries...\n", num_queries);
-		int still_have_space = 1;
-		if (qf_get_num_occupied_slots(&qf) >= qf.metadata->nslots * 0.95) {
-			still_have_space = 0;
-			printf("filter is full; skipping query adaptations\n");
-		}
 		uint64_t i_2;
 		i = 0;
 
@@ -526,10 +480,7 @@ int main(int argc, char **argv)
 			j = rand_zipfian(1.01, 1000000);
 
 			if (qf_query(&qf, j, ret_index, ret_hash, ret_hash_len, QF_KEY_IS_HASH)) {
-				ii.rem = *ret_hash;
-				ii.len = *ret_hash_len;
-				ilist *potential_item = sglib_hashed_ilist_find_member(htab, &ii);
-				if (potential_item == NULL || potential_item->val != j) {
+				if (!qf_reverse_lookup(&qf, *ret_hash, *ret_hash_len, &orig_key) || orig_key != j) {
 					count_fp++;
 				}
 			}
@@ -548,26 +499,9 @@ int main(int argc, char **argv)
 				//j = hash_str(buffer);
 
 				if (qf_query(&qf, j, ret_index, ret_hash, ret_hash_len, QF_KEY_IS_HASH)) {
-					ii.rem = *ret_hash;
-					ii.len = *ret_hash_len;
-					ilist *potential_item = sglib_hashed_ilist_find_member(htab, &ii);
-					if (potential_item == NULL) bp2();
-					else if (potential_item->val != j) {
-						if (still_have_space) {
-							if (qf_get_num_occupied_slots(&qf) >= qf.metadata->nslots * 0.95) {
-								still_have_space = 0;
-								printf("out of space to adapt after %lu queries\n", i);
-							}
-							else {
-								*ret_hash_len = qf_adapt(&qf, *ret_index, potential_item->val, j, ret_hash, QF_KEY_IS_HASH | QF_NO_LOCK);
-								if (*ret_hash_len > 0) {
-									sglib_hashed_ilist_delete(htab, potential_item);
-									potential_item->rem = *ret_hash;
-									potential_item->len = *ret_hash_len;
-									sglib_hashed_ilist_add(htab, potential_item);
-								}
-							}
-						}
+					if (!qf_reverse_lookup(&qf, *ret_hash, *ret_hash_len, &orig_key)) bp2();
+					else if (orig_key != j) {
+						*ret_hash_len = qf_adapt(&qf, *ret_index, orig_key, j, ret_hash, QF_KEY_IS_HASH | QF_NO_LOCK);
 					}
 				}
 			}
@@ -577,10 +511,7 @@ int main(int argc, char **argv)
 				j = rand_uniform(universe);
 
 				if (qf_query(&qf, j, ret_index, ret_hash, ret_hash_len, QF_KEY_IS_HASH)) {
-					ii.rem = *ret_hash;
-					ii.len = *ret_hash_len;
-					ilist *potential_item = sglib_hashed_ilist_find_member(htab, &ii);
-					if (potential_item == NULL || potential_item->val != j) {
+					if (!qf_reverse_lookup(&qf, *ret_hash, *ret_hash_len, &orig_key) || orig_key != j) {
 						count_fp++;
 					}
 				}
@@ -600,9 +531,6 @@ int main(int argc, char **argv)
 		
 		free(ret_index);
 		free(ret_hash);
-		for(ll=sglib_hashed_ilist_it_init(&it,htab); ll!=NULL; ll=sglib_hashed_ilist_it_next(&it)) {
-			free(ll);
-		}
 		avgQryTime += (end_time - start_time);
     avgQryPer += (double)(end_time - start_time) / num_queries;
 		double fp_rate = (double)count_fp / num_queries;
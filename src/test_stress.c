@@ -0,0 +1,354 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "include/gqf.h"
+#include "include/gqf_int.h"
+#include "include/gqf_file.h"
+#include "include/zipf.h"
+
+/* Runs a mix of inserts, queries, adapts and removes from a sweep of thread
+ * counts and checks the filter against an exact shadow copy afterwards.
+ *
+ * Each thread owns the keys rank * nthreads + tid for ranks drawn from a
+ * zipfian (or uniform) distribution over its share of the key universe, so
+ * it can keep exact counts of its own keys without synchronization.  Adapts
+ * query keys with the top bit set, which are never inserted, so every
+ * positive one answers is a false positive for the filter to fix.  All the
+ * operations go through the adaptive calls: qf_insert and qf_remove don't
+ * see extensions, so they can't be mixed with adapts. */
+
+#define ADAPT_KEY_BIT (1ULL << 63)
+
+enum { OP_INSERT, OP_QUERY, OP_ADAPT, OP_REMOVE, NUM_OPS };
+static const char *op_names[NUM_OPS] = { "insert", "query", "adapt", "remove" };
+
+typedef struct stress_args {
+	QF *qf;
+	int tid;
+	int nthreads;
+	uint32_t *ranks;		/* key stream */
+	uint64_t nops;
+	uint32_t *shadow;		/* exact count of each of this thread's ranks */
+	uint64_t universe;
+	const int *mix;			/* cumulative percentages, one per op */
+	uint64_t done[NUM_OPS];
+	uint64_t positives[NUM_OPS];
+	uint64_t skipped_removes;
+	int failed;
+} stress_args;
+
+static inline uint64_t stress_key(const stress_args *a, uint32_t rank)
+{
+	return (uint64_t)rank * a->nthreads + a->tid;
+}
+
+static inline uint64_t xorshift64(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+static double elapsed(const struct timeval *start, const struct timeval *end)
+{
+	return (end->tv_sec - start->tv_sec) + (end->tv_usec - start->tv_usec) /
+		1000000.0;
+}
+
+static void *stress_thread(void *arg)
+{
+	stress_args *a = (stress_args *)arg;
+	uint64_t rng = 0x9e3779b97f4a7c15ULL * (a->tid + 1);
+	uint64_t index, hash, other_hash, bucket;
+	int hash_len, ret, op;
+
+	for (uint64_t i = 0; i < a->nops; i++) {
+		uint32_t rank = a->ranks[i];
+		uint64_t key = stress_key(a, rank);
+		int pick = xorshift64(&rng) % 100;
+		for (op = 0; op < NUM_OPS - 1 && pick >= a->mix[op]; op++)
+			;
+		switch (op) {
+			case OP_INSERT:
+				// the item qf_insert_ret matches must not move before it is
+				// counted or split, so hold its bucket across both calls
+				bucket = qf_get_home_bucket(a->qf, key, 0);
+				qf_lock_buckets(a->qf, bucket, bucket, QF_WAIT_FOR_LOCK);
+				ret = qf_insert_ret(a->qf, key, 1, &index, &hash, &hash_len,
+														QF_NO_LOCK);
+				if (ret == 0)
+					ret = insert_and_extend(a->qf, index, key, 1,
+																	qf_get_payload(a->qf, index), &hash,
+																	&other_hash, QF_NO_LOCK);
+				qf_unlock_buckets(a->qf, bucket, bucket);
+				if (ret < 0) {
+					fprintf(stderr, "Insert of %lx failed: %d.\n", key, ret);
+					if (ret == QF_NO_SPACE)
+						fprintf(stderr, "CQF is full, use more slots.\n");
+					a->failed = 1;
+					return NULL;
+				}
+				a->shadow[rank]++;
+				break;
+			case OP_QUERY:
+				if (qf_query(a->qf, key, &index, &hash, &hash_len, 0) > 0)
+					a->positives[op]++;
+				break;
+			case OP_ADAPT:
+				if (qf_query_adapt(a->qf, key | ADAPT_KEY_BIT, &index, &hash,
+													 &hash_len, NULL, NULL, QF_WAIT_FOR_LOCK) > 0)
+					a->positives[op]++;
+				break;
+			case OP_REMOVE:
+				// only remove what this thread put in, or it could take
+				// another key's item
+				if (a->shadow[rank] == 0) {
+					a->skipped_removes++;
+					break;
+				}
+				ret = qf_remove_ret(a->qf, key, 1, &hash, &hash_len,
+														QF_WAIT_FOR_LOCK);
+				if (ret < 0) {
+					fprintf(stderr, "Remove of inserted key %lx failed: %d.\n", key,
+									ret);
+					a->failed = 1;
+					return NULL;
+				}
+				a->shadow[rank]--;
+				break;
+		}
+		a->done[op]++;
+	}
+	return NULL;
+}
+
+/* Every key must be found at least as often as it was inserted (more is a
+ * fingerprint collision), and the filter's total must match the shadow's
+ * exactly.  Returns the number of errors. */
+static uint64_t check_consistency(QF *qf, stress_args *args, int nthreads)
+{
+	uint64_t index, hash, errors = 0, total = 0, negatives = 0, fps = 0;
+	int hash_len;
+
+	for (int t = 0; t < nthreads; t++) {
+		stress_args *a = &args[t];
+		for (uint64_t r = 0; r < a->universe; r++) {
+			uint64_t key = stress_key(a, r);
+			uint64_t count = qf_query(qf, key, &index, &hash, &hash_len, 0);
+			total += a->shadow[r];
+			if (a->shadow[r] == 0) {
+				negatives++;
+				fps += count > 0;
+			} else if (count < a->shadow[r]) {
+				if (errors++ < 10)
+					fprintf(stderr, "Key %lx: count %lu, expected at least %u.\n", key,
+									count, a->shadow[r]);
+			}
+		}
+	}
+	if (qf_get_sum_of_counts(qf) != total) {
+		fprintf(stderr, "Sum of counts %lu, expected %lu.\n",
+						qf_get_sum_of_counts(qf), total);
+		errors++;
+	}
+	printf("Consistency: %lu items, %lu absent keys (%lu false positives), "
+				 "%lu errors\n", total, negatives, fps, errors);
+	return errors;
+}
+
+/* One run from an empty filter.  Returns the throughput in ops/s, or a
+ * negative number if the run failed. */
+static double stress_run(uint64_t qbits, int nthreads, uint64_t nops,
+												 uint64_t universe, const int *mix, double s,
+												 enum qf_lock_kind lock_kind, uint64_t slots_per_lock)
+{
+	QF qf;
+	struct timeval start, end;
+	pthread_t threads[nthreads];
+	stress_args *args = (stress_args *)calloc(nthreads, sizeof(stress_args));
+	uint64_t share = universe / nthreads;
+	uint64_t per_thread = nops / nthreads;
+	ZIPFIAN z = s > 0 ? create_zipfian(s, share, random) : NULL;
+
+	if (!qf_malloc(&qf, 1ULL << qbits, qbits + 8, 0, QF_HASH_DEFAULT, 0)) {
+		fprintf(stderr, "Can't allocate CQF.\n");
+		abort();
+	}
+	if (slots_per_lock == 0)
+		qf_tune_lock_regions(&qf, nthreads);
+	else if (!qf_set_lock_regions(&qf, slots_per_lock, CLUSTER_SIZE)) {
+		fprintf(stderr, "Invalid lock region size %lu.\n", slots_per_lock);
+		abort();
+	}
+	qf_set_lock_kind(&qf, lock_kind);
+	if (!qf_enable_payloads(&qf)) {
+		fprintf(stderr, "Can't allocate payloads.\n");
+		abort();
+	}
+
+	for (int t = 0; t < nthreads; t++) {
+		stress_args *a = &args[t];
+		a->qf = &qf;
+		a->tid = t;
+		a->nthreads = nthreads;
+		a->nops = per_thread;
+		a->universe = share;
+		a->mix = mix;
+		a->ranks = (uint32_t *)malloc(per_thread * sizeof(uint32_t));
+		a->shadow = (uint32_t *)calloc(share, sizeof(uint32_t));
+		if (a->ranks == NULL || a->shadow == NULL) {
+			perror("Couldn't allocate key streams.");
+			exit(EXIT_FAILURE);
+		}
+		for (uint64_t i = 0; i < per_thread; i++)
+			a->ranks[i] = z ? zipfian_gen(z) : random() % share;
+	}
+	if (z)
+		destroy_zipfian(z);
+
+	gettimeofday(&start, NULL);
+	for (int t = 0; t < nthreads; t++) {
+		if (pthread_create(&threads[t], NULL, &stress_thread, &args[t])) {
+			fprintf(stderr, "Error creating thread\n");
+			exit(0);
+		}
+	}
+	for (int t = 0; t < nthreads; t++) {
+		if (pthread_join(threads[t], NULL)) {
+			fprintf(stderr, "Error joining thread\n");
+			exit(0);
+		}
+	}
+	gettimeofday(&end, NULL);
+
+	double secs = elapsed(&start, &end);
+	uint64_t done[NUM_OPS] = { 0 }, positives[NUM_OPS] = { 0 }, skipped = 0;
+	int failed = 0;
+	for (int t = 0; t < nthreads; t++) {
+		for (int op = 0; op < NUM_OPS; op++) {
+			done[op] += args[t].done[op];
+			positives[op] += args[t].positives[op];
+		}
+		skipped += args[t].skipped_removes;
+		failed |= args[t].failed;
+	}
+
+	printf("Threads: %d Slots per lock: %lu Time: %.3fs Throughput: %.3f Mops/s\n",
+				 nthreads, qf_get_slots_per_lock(&qf), secs,
+				 per_thread * nthreads / secs / 1000000);
+	for (int op = 0; op < NUM_OPS; op++)
+		printf("  %-6s %10lu", op_names[op], done[op]);
+	printf("\n  query positives: %lu adapt false positives: %lu skipped removes: "
+				 "%lu extension slots: %lu\n", positives[OP_QUERY], positives[OP_ADAPT],
+				 skipped, qf_get_num_extension_slots(&qf));
+	qf_dump_wait_times(&qf);
+
+	if (!failed && check_consistency(&qf, args, nthreads) > 0)
+		failed = 1;
+
+	for (int t = 0; t < nthreads; t++) {
+		free(args[t].ranks);
+		free(args[t].shadow);
+	}
+	free(args);
+	qf_free(&qf);
+	return failed ? -1 : per_thread * nthreads / secs;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 4) {
+		fprintf(stderr, "Please specify at least three arguments: \n \
+            1. log of the number of slots in the CQF.\n \
+            2. largest number of threads (runs 1, 2, 4, ... up to it).\n \
+            3. total number of operations per run.\n \
+            4. percentages of inserts,queries,adapts,removes (default 50,40,5,5).\n \
+            5. zipfian exponent of the keys, 0 for uniform (default 0.99).\n \
+            6. lock kind: tas, ticket or mcs (default tas).\n \
+            7. slots per lock region, 0 to tune it for each thread count (default 65536).\n");
+		exit(1);
+	}
+	uint64_t qbits = atoi(argv[1]);
+	int max_threads = atoi(argv[2]);
+	uint64_t nops = strtoull(argv[3], NULL, 10);
+	int pct[NUM_OPS] = { 50, 40, 5, 5 }, mix[NUM_OPS];
+	double s = 0.99;
+	enum qf_lock_kind lock_kind = QF_LOCK_TAS;
+	uint64_t slots_per_lock = NUM_SLOTS_TO_LOCK;
+
+	if (argc > 4 && sscanf(argv[4], "%d,%d,%d,%d", &pct[0], &pct[1], &pct[2],
+												 &pct[3]) != NUM_OPS) {
+		fprintf(stderr, "Mix must be four comma-separated percentages.\n");
+		exit(1);
+	}
+	if (argc > 5)
+		s = atof(argv[5]);
+	if (argc > 6) {
+		if (strcmp(argv[6], "ticket") == 0)
+			lock_kind = QF_LOCK_TICKET;
+		else if (strcmp(argv[6], "mcs") == 0)
+			lock_kind = QF_LOCK_MCS;
+		else if (strcmp(argv[6], "tas") != 0) {
+			fprintf(stderr, "Unknown lock kind %s.\n", argv[6]);
+			exit(1);
+		}
+	}
+	if (argc > 7)
+		slots_per_lock = strtoull(argv[7], NULL, 10);
+	for (int op = 0, sum = 0; op < NUM_OPS; op++) {
+		if (pct[op] < 0) {
+			fprintf(stderr, "Mix percentages can't be negative.\n");
+			exit(1);
+		}
+		sum += pct[op];
+		mix[op] = sum;
+	}
+	if (mix[NUM_OPS - 1] != 100) {
+		fprintf(stderr, "Mix percentages must add up to 100.\n");
+		exit(1);
+	}
+	if (max_threads < 1)
+		max_threads = 1;
+
+	/* A quarter of the slots' worth of distinct keys leaves room for
+	 * counters and extensions. */
+	uint64_t universe = (1ULL << qbits) / 4;
+	printf("Slots: %lu Keys: %lu Ops: %lu Mix: %d,%d,%d,%d Zipf: %.2f\n",
+				 (uint64_t)1 << qbits, universe, nops, pct[0], pct[1], pct[2], pct[3], s);
+
+	double base = 0;
+	int failed = 0;
+	for (int nthreads = 1; ; nthreads *= 2) {
+		if (nthreads > max_threads)
+			nthreads = max_threads;
+		srandom(nthreads);
+		double tput = stress_run(qbits, nthreads, nops, universe, mix, s,
+														 lock_kind, slots_per_lock);
+		if (tput < 0) {
+			failed = 1;
+			break;
+		}
+		if (nthreads == 1)
+			base = tput;
+		printf("Speedup over 1 thread: %.2fx\n\n", base > 0 ? tput / base : 0.0);
+		if (nthreads == max_threads)
+			break;
+	}
+
+	if (failed) {
+		fprintf(stderr, "Stress test failed.\n");
+		abort();
+	}
+	fprintf(stdout, "Verified all runs.\n");
+
+	return 0;
+}
@@ -71,6 +71,471 @@ void multi_threaded_insertion(insert_args args[], int tcnt)
 	}
 }
 
+static void expect(bool ok, const char *what, uint64_t key)
+{
+	if (!ok) {
+		fprintf(stderr, "%s: %lx\n", what, key);
+		abort();
+	}
+}
+
+static void new_filter(QF *qf, uint64_t qbits, enum qf_hashmode hash)
+{
+	if (!qf_malloc(qf, 1ULL << qbits, qbits + 8, 0, hash, 0)) {
+		fprintf(stderr, "Can't allocate CQF.\n");
+		abort();
+	}
+}
+
+static uint64_t *random_keys(uint64_t n, uint64_t range)
+{
+	uint64_t *keys = (uint64_t*)calloc(n, sizeof(keys[0]));
+	RAND_bytes((unsigned char *)keys, sizeof(*keys) * n);
+	if (range)
+		for (uint64_t i = 0; i < n; i++)
+			keys[i] %= range;
+	return keys;
+}
+
+/* Insert key through the adaptive API, extending the item it collides
+ * with.  The filter must have payloads enabled. */
+static void adaptive_insert(QF *qf, uint64_t key, uint8_t flags)
+{
+	uint64_t index, hash, other_hash;
+	int hash_len;
+	int ret = qf_insert_ret(qf, key, 1, &index, &hash, &hash_len, flags);
+	if (ret == 0)
+		ret = insert_and_extend(qf, index, key, 1, qf_get_payload(qf, index),
+														&hash, &other_hash, flags);
+	expect(ret >= 0, "adaptive insert failed", key);
+}
+
+/* The item key matches must be the one inserted for key. */
+static void expect_own_item(QF *qf, uint64_t key)
+{
+	uint64_t index, hash;
+	int hash_len;
+	expect(qf_query(qf, key, &index, &hash, &hash_len, 0) > 0 &&
+				 qf_get_payload(qf, index) == key, "inserted key not found", key);
+}
+
+/* Collect up to max false positives among random keys: the queried key,
+ * the slot of the item it matched and that item's key. */
+static uint64_t find_false_positives(QF *qf, uint64_t max, uint64_t *indexes,
+																		 uint64_t *keys, uint64_t *others)
+{
+	uint64_t n = 0;
+	for (uint64_t tries = 0; n < max && tries < 64 * qf_get_nslots(qf);
+			 tries++) {
+		uint64_t key, index, hash;
+		int hash_len;
+		RAND_bytes((unsigned char *)&key, sizeof(key));
+		if (qf_query(qf, key, &index, &hash, &hash_len, 0) == 0 ||
+				qf_get_payload(qf, index) == key)
+			continue;
+		indexes[n] = index;
+		keys[n] = qf_get_payload(qf, index);
+		others[n++] = key;
+	}
+	return n;
+}
+
+/* qf_insert_batch and qf_remove against one qf_insert per key. */
+static void check_insert_batch(uint64_t qbits)
+{
+	QF a, b;
+	new_filter(&a, qbits, QF_HASH_INVERTIBLE);
+	new_filter(&b, qbits, QF_HASH_INVERTIBLE);
+	uint64_t n = (1ULL << qbits) / 4;
+	uint64_t *keys = random_keys(n, a.metadata->range);
+	uint64_t *counts = (uint64_t*)calloc(n, sizeof(counts[0]));
+	int *results = (int*)calloc(n, sizeof(results[0]));
+
+	for (uint64_t i = 0; i < n; i++) {
+		counts[i] = 1 + i % 3;
+		expect(qf_insert(&a, keys[i], 0, counts[i], QF_NO_LOCK) >= 0,
+					 "insert failed", keys[i]);
+	}
+	expect(qf_insert_batch(&b, keys, counts, n, QF_NO_LOCK | QF_BATCH_SORT,
+												 results) == (int64_t)n, "batch insert failed", n);
+	for (uint64_t i = 0; i < n; i++)
+		expect(results[i] >= 0 && qf_count_key_value(&a, keys[i], 0, 0) ==
+					 qf_count_key_value(&b, keys[i], 0, 0), "batch insert count differs",
+					 keys[i]);
+
+	for (uint64_t i = 0; i < n; i += 2) {
+		expect(qf_remove(&a, keys[i], 0, counts[i], QF_NO_LOCK) >= 0 &&
+					 qf_remove(&b, keys[i], 0, counts[i], QF_NO_LOCK) >= 0,
+					 "remove failed", keys[i]);
+	}
+	for (uint64_t i = 0; i < n; i++) {
+		uint64_t count = qf_count_key_value(&b, keys[i], 0, 0);
+		expect(count == qf_count_key_value(&a, keys[i], 0, 0) && (i % 2 == 0 ||
+																																count >=
+																																counts[i]),
+					 "count differs after remove", keys[i]);
+	}
+	expect(qf_get_sum_of_counts(&a) == qf_get_sum_of_counts(&b),
+				 "sum of counts differs after remove", qf_get_sum_of_counts(&b));
+
+	free(keys);
+	free(counts);
+	free(results);
+	qf_free(&a);
+	qf_free(&b);
+}
+
+/* qf_query_batch against one qf_query per key, hits and misses. */
+static void check_query_batch(uint64_t qbits)
+{
+	QF qf;
+	new_filter(&qf, qbits, QF_HASH_DEFAULT);
+	qf_enable_payloads(&qf);
+	uint64_t n = (1ULL << qbits) / 2;
+	uint64_t *keys = random_keys(2 * n, 0);
+	for (uint64_t i = 0; i < n; i++)
+		adaptive_insert(&qf, keys[i], QF_NO_LOCK);
+
+	uint64_t *counts = (uint64_t*)calloc(2 * n, sizeof(counts[0]));
+	uint64_t *indexes = (uint64_t*)calloc(2 * n, sizeof(indexes[0]));
+	uint64_t *hashes = (uint64_t*)calloc(2 * n, sizeof(hashes[0]));
+	int *hash_lens = (int*)calloc(2 * n, sizeof(hash_lens[0]));
+	for (int sort = 0; sort < 2; sort++) {
+		int64_t found = qf_query_batch(&qf, keys, 2 * n, counts, indexes, hashes,
+																	 hash_lens, sort ? QF_BATCH_SORT : 0);
+		int64_t expected = 0;
+		for (uint64_t i = 0; i < 2 * n; i++) {
+			uint64_t index = 0, hash = 0;
+			int hash_len = 0;
+			uint64_t count = qf_query(&qf, keys[i], &index, &hash, &hash_len, 0);
+			expect(count == counts[i] && (count == 0 || (index == indexes[i] &&
+																									 hash == hashes[i] &&
+																									 hash_len ==
+																									 hash_lens[i])),
+						 "batch query differs", keys[i]);
+			expect(i >= n || count > 0, "batch query lost a key", keys[i]);
+			expected += count > 0;
+		}
+		expect(found == expected, "batch query found count differs", found);
+	}
+
+	free(keys);
+	free(counts);
+	free(indexes);
+	free(hashes);
+	free(hash_lens);
+	qf_free(&qf);
+}
+
+/* qf_bulk_build against one qf_insert per hash. */
+static void check_bulk_build(uint64_t qbits)
+{
+	QF a, b;
+	new_filter(&a, qbits, QF_HASH_INVERTIBLE);
+	new_filter(&b, qbits, QF_HASH_INVERTIBLE);
+	uint64_t n = (1ULL << qbits) / 2;
+	uint64_t *hashes = random_keys(n, a.metadata->range);
+	for (uint64_t i = 0; i < n; i++)
+		expect(qf_insert(&a, hashes[i], 0, 1, QF_NO_LOCK | QF_KEY_IS_HASH) >= 0,
+					 "insert failed", hashes[i]);
+	expect(qf_bulk_build(&b, hashes, n, 2) ==
+				 (int64_t)qf_get_num_distinct_key_value_pairs(&a), "bulk build failed",
+				 n);
+	for (uint64_t i = 0; i < n; i++)
+		expect(qf_count_key_value(&a, hashes[i], 0, QF_KEY_IS_HASH) ==
+					 qf_count_key_value(&b, hashes[i], 0, QF_KEY_IS_HASH),
+					 "bulk build count differs", hashes[i]);
+	free(hashes);
+	qf_free(&a);
+	qf_free(&b);
+}
+
+static uint64_t bucket_shift, bucket_mask;
+
+static int bucket_cmp(const void *a, const void *b)
+{
+	uint64_t x = (*(const uint64_t *)a >> bucket_shift) & bucket_mask;
+	uint64_t y = (*(const uint64_t *)b >> bucket_shift) & bucket_mask;
+	return x < y ? -1 : x > y;
+}
+
+/* qf_bulk_load_sorted against adaptive inserts of the same hashes. */
+static void check_bulk_load(uint64_t qbits)
+{
+	QF a, b;
+	new_filter(&a, qbits, QF_HASH_DEFAULT);
+	new_filter(&b, qbits, QF_HASH_DEFAULT);
+	qf_enable_payloads(&a);
+	qf_enable_payloads(&b);
+	uint64_t n = (1ULL << qbits) / 2;
+	uint64_t *hashes = random_keys(n, 0);
+	bucket_shift = b.metadata->bits_per_slot;
+	bucket_mask = (1ULL << b.metadata->quotient_bits) - 1;
+	qsort(hashes, n, sizeof(hashes[0]), bucket_cmp);
+	for (uint64_t i = 0; i < n; i++)
+		adaptive_insert(&a, hashes[i], QF_NO_LOCK | QF_KEY_IS_HASH);
+	expect(qf_bulk_load_sorted(&b, hashes, NULL, n) ==
+				 (int64_t)qf_get_num_distinct_key_value_pairs(&a), "bulk load failed",
+				 n);
+	for (uint64_t i = 0; i < n; i++) {
+		uint64_t index, hash;
+		int hash_len;
+		expect(qf_query(&b, hashes[i], &index, &hash, &hash_len,
+										QF_KEY_IS_HASH) == qf_query(&a, hashes[i], &index, &hash,
+																								&hash_len, QF_KEY_IS_HASH),
+					 "bulk load count differs", hashes[i]);
+	}
+	free(hashes);
+	qf_free(&a);
+	qf_free(&b);
+}
+
+/* Adapt away false positives, remove half of the keys and compact: the
+ * other half must still be found. */
+static void check_remove_compact(uint64_t qbits)
+{
+	QF qf;
+	new_filter(&qf, qbits, QF_HASH_DEFAULT);
+	qf_enable_payloads(&qf);
+	uint64_t n = (1ULL << qbits) / 2;
+	uint64_t *keys = random_keys(n, 0);
+	for (uint64_t i = 0; i < n; i++)
+		adaptive_insert(&qf, keys[i], QF_NO_LOCK);
+
+	uint64_t nfp = n / 16;
+	uint64_t *indexes = (uint64_t*)calloc(nfp, sizeof(indexes[0]));
+	uint64_t *fp_keys = (uint64_t*)calloc(nfp, sizeof(fp_keys[0]));
+	uint64_t *others = (uint64_t*)calloc(nfp, sizeof(others[0]));
+	nfp = find_false_positives(&qf, nfp, indexes, fp_keys, others);
+	for (uint64_t i = 0; i < nfp; i++) {
+		uint64_t index, hash;
+		int hash_len;
+		// earlier adapts may have moved the item
+		if (qf_query(&qf, others[i], &index, &hash, &hash_len, 0) == 0 ||
+				qf_get_payload(&qf, index) == others[i])
+			continue;
+		expect(qf_adapt(&qf, index, qf_get_payload(&qf, index), others[i], &hash,
+										QF_NO_LOCK) >= 0, "adapt failed", others[i]);
+	}
+
+	for (uint64_t i = 0; i < n; i += 2) {
+		uint64_t hash;
+		int hash_len;
+		expect(qf_remove_ret(&qf, keys[i], 1, &hash, &hash_len, QF_NO_LOCK) >= 0,
+					 "remove failed", keys[i]);
+	}
+	uint64_t ext_slots = qf_get_num_extension_slots(&qf);
+	int64_t freed = qf_compact_extensions(&qf, qf_get_nslots(&qf), QF_NO_LOCK);
+	expect(freed >= 0 && qf_get_num_extension_slots(&qf) + freed == ext_slots,
+				 "compaction failed", freed);
+	for (uint64_t i = 1; i < n; i += 2)
+		expect_own_item(&qf, keys[i]);
+
+	free(keys);
+	free(indexes);
+	free(fp_keys);
+	free(others);
+	qf_free(&qf);
+}
+
+/* qf_adapt_batch against one qf_adapt per false positive. */
+static void check_adapt_batch(uint64_t qbits)
+{
+	QF a, b;
+	new_filter(&a, qbits, QF_HASH_DEFAULT);
+	new_filter(&b, qbits, QF_HASH_DEFAULT);
+	qf_enable_payloads(&a);
+	qf_enable_payloads(&b);
+	uint64_t n = (1ULL << qbits) / 2;
+	uint64_t *keys = random_keys(n, 0);
+	for (uint64_t i = 0; i < n; i++) {
+		adaptive_insert(&a, keys[i], QF_NO_LOCK);
+		adaptive_insert(&b, keys[i], QF_NO_LOCK);
+	}
+
+	uint64_t nfp = n / 16;
+	uint64_t *indexes = (uint64_t*)calloc(nfp, sizeof(indexes[0]));
+	uint64_t *fp_keys = (uint64_t*)calloc(nfp, sizeof(fp_keys[0]));
+	uint64_t *others = (uint64_t*)calloc(nfp, sizeof(others[0]));
+	uint64_t *ret_hashes = (uint64_t*)calloc(nfp, sizeof(ret_hashes[0]));
+	int *results = (int*)calloc(nfp, sizeof(results[0]));
+	nfp = find_false_positives(&b, nfp, indexes, fp_keys, others);
+
+	for (uint64_t i = 0; i < nfp; i++) {
+		uint64_t index, hash;
+		int hash_len;
+		if (qf_query(&a, others[i], &index, &hash, &hash_len, 0) == 0 ||
+				qf_get_payload(&a, index) != fp_keys[i])
+			continue;
+		expect(qf_adapt(&a, index, fp_keys[i], others[i], &hash, QF_NO_LOCK) >= 0,
+					 "adapt failed", others[i]);
+	}
+	expect(qf_adapt_batch(&b, indexes, fp_keys, others, nfp, ret_hashes,
+												results, QF_NO_LOCK) == (int64_t)nfp,
+				 "batch adapt failed", nfp);
+
+	for (uint64_t i = 0; i < n; i++) {
+		expect_own_item(&a, keys[i]);
+		expect_own_item(&b, keys[i]);
+	}
+	for (uint64_t i = 0; i < nfp; i++) {
+		uint64_t index, hash;
+		int hash_len;
+		expect(qf_query(&b, others[i], &index, &hash, &hash_len, 0) == 0 ||
+					 qf_get_payload(&b, index) != fp_keys[i],
+					 "batch adapt left a false positive", others[i]);
+	}
+
+	free(keys);
+	free(indexes);
+	free(fp_keys);
+	free(others);
+	free(ret_hashes);
+	free(results);
+	qf_free(&a);
+	qf_free(&b);
+}
+
+/* The 128-bit key's high half is derived from the low half, so the payload
+ * (the low 64 bits) gives back the whole key. */
+static __uint128_t key128(uint64_t low)
+{
+	return ((__uint128_t)(low * 0x9e3779b97f4a7c15ULL) << 64) | low;
+}
+
+/* qf_insert_ret128, qf_query128, qf_adapt128 and qf_remove_ret128. */
+static void check_128(uint64_t qbits)
+{
+	QF qf;
+	new_filter(&qf, qbits, QF_HASH_DEFAULT);
+	qf_enable_payloads(&qf);
+	uint64_t n = (1ULL << qbits) / 2;
+	uint64_t *keys = random_keys(n, 0);
+	for (uint64_t i = 0; i < n; i++) {
+		uint64_t index;
+		__uint128_t hash, other_hash;
+		int hash_len;
+		int ret = qf_insert_ret128(&qf, key128(keys[i]), 1, &index, &hash,
+															 &hash_len, QF_NO_LOCK);
+		if (ret == 0)
+			ret = insert_and_extend128(&qf, index, key128(keys[i]), 1,
+																 key128(qf_get_payload(&qf, index)), &hash,
+																 &other_hash, QF_NO_LOCK);
+		expect(ret >= 0, "128-bit insert failed", keys[i]);
+	}
+
+	for (uint64_t tries = 0; tries < 16 * n; tries++) {
+		uint64_t other, index;
+		__uint128_t hash;
+		int hash_len;
+		RAND_bytes((unsigned char *)&other, sizeof(other));
+		if (qf_query128(&qf, key128(other), &index, &hash, &hash_len, 0) == 0 ||
+				qf_get_payload(&qf, index) == other)
+			continue;
+		uint64_t key = qf_get_payload(&qf, index);
+		expect(qf_adapt128(&qf, index, key128(key), key128(other), &hash,
+											 QF_NO_LOCK) >= 0, "128-bit adapt failed", other);
+		expect(qf_query128(&qf, key128(other), &index, &hash, &hash_len, 0) == 0 ||
+					 qf_get_payload(&qf, index) != key,
+					 "128-bit adapt left a false positive", other);
+	}
+
+	for (uint64_t i = 0; i < n; i += 2) {
+		__uint128_t hash;
+		int hash_len;
+		expect(qf_remove_ret128(&qf, key128(keys[i]), 1, &hash, &hash_len,
+														QF_NO_LOCK) >= 0, "128-bit remove failed", keys[i]);
+	}
+	for (uint64_t i = 1; i < n; i += 2) {
+		uint64_t index;
+		__uint128_t hash;
+		int hash_len;
+		expect(qf_query128(&qf, key128(keys[i]), &index, &hash, &hash_len, 0) >
+					 0 && qf_get_payload(&qf, index) == keys[i],
+					 "128-bit key not found", keys[i]);
+	}
+
+	free(keys);
+	qf_free(&qf);
+}
+
+/* Keys stay countable while an incremental resize is under way and after
+ * it is done. */
+static void check_resize(uint64_t qbits)
+{
+	QF qf;
+	new_filter(&qf, qbits - 2, QF_HASH_DEFAULT);
+	qf_set_auto_resize(&qf, true);
+	uint64_t nslots = qf_get_nslots(&qf);
+	uint64_t n = 3 * nslots;
+	uint64_t *keys = random_keys(n, 0);
+	bool migrating = false;
+	for (uint64_t i = 0; i < n; i++) {
+		expect(qf_insert(&qf, keys[i], 0, 1, 0) >= 0, "insert failed", keys[i]);
+		if (!migrating && qf_get_nslots(&qf) != nslots) {
+			migrating = true;
+			for (uint64_t j = 0; j <= i; j++)
+				expect(qf_count_key_value(&qf, keys[j], 0, 0) > 0,
+							 "key lost during resize", keys[j]);
+			uint64_t count = qf_count_key_value(&qf, keys[0], 0, 0);
+			expect(qf_remove(&qf, keys[0], 0, 1, 0) >= 0 &&
+						 qf_count_key_value(&qf, keys[0], 0, 0) == count - 1,
+						 "remove during resize failed", keys[0]);
+			expect(qf_insert(&qf, keys[0], 0, 1, 0) >= 0, "insert failed", keys[0]);
+		}
+	}
+	expect(migrating, "filter wasn't resized", nslots);
+	for (uint64_t i = 0; i < n; i++)
+		expect(qf_count_key_value(&qf, keys[i], 0, 0) > 0,
+					 "key lost after resize", keys[i]);
+
+	free(keys);
+	qf_free(&qf);
+}
+
+/* key is still found, and the item it matched keeps its payload and its
+ * reverse map entry in step.  A later key can take the fingerprint of an
+ * extended item's remainder, so the match needn't be key's own item. */
+static void expect_carried(QF *qf, uint64_t key)
+{
+	uint64_t index, hash, mapped;
+	int hash_len;
+	expect(qf_query(qf, key, &index, &hash, &hash_len, 0) > 0,
+				 "key lost during adaptive resize", key);
+	expect(qf_reverse_lookup(qf, hash, hash_len, &mapped) &&
+				 mapped == qf_get_payload(qf, index),
+				 "payload and reverse map disagree after adaptive resize", key);
+}
+
+/* qf_insert_ret on a full auto-resizing filter starts an incremental
+ * resize too, and payloads, the reverse map and the extensions that tell
+ * keys apart come along. */
+static void check_resize_adaptive(uint64_t qbits)
+{
+	QF qf;
+	new_filter(&qf, qbits - 2, QF_HASH_DEFAULT);
+	qf_set_auto_resize(&qf, true);
+	expect(qf_enable_payloads(&qf) && qf_enable_reverse_map(&qf),
+				 "couldn't enable payloads and the reverse map", 0);
+	uint64_t n = 3 * qf_get_nslots(&qf);
+	uint64_t *keys = random_keys(n, 0);
+	bool migrating = false;
+	for (uint64_t i = 0; i < n; i++) {
+		adaptive_insert(&qf, keys[i], 0);
+		if (!migrating && qf.runtimedata->resize_next != NULL) {
+			migrating = true;
+			for (uint64_t j = 0; j <= i; j++)
+				expect_carried(&qf, keys[j]);
+		}
+	}
+	expect(migrating, "qf_insert_ret didn't resize incrementally", n);
+	for (uint64_t i = 0; i < n; i++)
+		expect_carried(&qf, keys[i]);
+
+	free(keys);
+	qf_free(&qf);
+}
+
 int main(int argc, char **argv)
 {
 	if (argc < 4) {
@@ -128,22 +593,78 @@ int main(int argc, char **argv)
 	}
 
 	QFi cfir;
+	uint64_t nitems = 0, sum = 0;
 	/* Initialize an iterator */
 	qf_iterator_from_position(&cfr, &cfir, 0);
 	do {
 		uint64_t key, value, count;
 		qfi_get_key(&cfir, &key, &value, &count);
 		qfi_next(&cfir);
-		if (qf_count_key_value(&cfr, key, 0, 0) < freq) {
-			fprintf(stderr, "Failed lookup during iteration for: %lx. Returned count: %ld\n",
-							key, count);
+		uint64_t lookup = qf_count_key_value(&cfr, key, 0, 0);
+		if (lookup < freq || count != lookup) {
+			fprintf(stderr, "Failed lookup during iteration for: %lx. Returned count: %ld, lookup count: %ld\n",
+							key, count, lookup);
 			abort();
 		}
+		nitems++;
+		sum += count;
 	} while(!qfi_end(&cfir));
 
+	/* Every item is visited once, with its whole count */
+	if (nitems != qf_get_num_distinct_key_value_pairs(&cfr) || sum !=
+			qf_get_sum_of_counts(&cfr)) {
+		fprintf(stderr, "Iteration saw %ld items with total count %ld, expected %ld and %ld\n",
+						nitems, sum, qf_get_num_distinct_key_value_pairs(&cfr),
+						qf_get_sum_of_counts(&cfr));
+		abort();
+	}
+
 	fprintf(stdout, "Total num of distinct items in the CQF %ld\n",
 					cfr.metadata->ndistinct_elts);
 	fprintf(stdout, "Verified all items: %ld\n", args[tcnt-1].end);
 
+	/* The same insertions with small lock regions, so that the threads
+	 * lock different regions */
+	QF striped;
+	new_filter(&striped, qbits, QF_HASH_INVERTIBLE);
+	expect(!qf_set_lock_regions(&striped, 100, 1ULL << 14),
+				 "accepted a lock region size that isn't a power of 2", 100);
+	expect(qf_set_lock_regions(&striped, 4 * QF_SLOTS_PER_BLOCK, 1ULL << 14) &&
+				 qf_get_slots_per_lock(&striped) == 4 * QF_SLOTS_PER_BLOCK,
+				 "couldn't set lock regions", 4 * QF_SLOTS_PER_BLOCK);
+	for (uint32_t i = 0; i < tcnt; i++)
+		args[i].cf = &striped;
+	multi_threaded_insertion(args, tcnt);
+	for (uint64_t i = 0; i < args[tcnt-1].end; i++)
+		expect(qf_count_key_value(&striped, vals[i], 0, 0) ==
+					 qf_count_key_value(&cfr, vals[i], 0, 0),
+					 "count differs with small lock regions", vals[i]);
+	qf_free(&striped);
+	fprintf(stdout, "Verified small lock regions\n");
+
+	check_insert_batch(qbits);
+	fprintf(stdout, "Verified batch insert and remove\n");
+	check_query_batch(qbits);
+	fprintf(stdout, "Verified batch query\n");
+	check_bulk_build(qbits);
+	fprintf(stdout, "Verified bulk build\n");
+	check_bulk_load(qbits);
+	fprintf(stdout, "Verified bulk load\n");
+	check_remove_compact(qbits);
+	fprintf(stdout, "Verified remove and compaction\n");
+	check_adapt_batch(qbits);
+	fprintf(stdout, "Verified batch adapt\n");
+	check_128(qbits);
+	fprintf(stdout, "Verified 128-bit calls\n");
+	// a resize moves a bit from the remainders to the quotient, which a
+	// fixed slot width doesn't allow
+	if (QF_BITS_PER_SLOT == 0) {
+		check_resize(qbits);
+		fprintf(stdout, "Verified incremental resize\n");
+		check_resize_adaptive(qbits);
+		fprintf(stdout, "Verified incremental resize through qf_insert_ret\n");
+	} else
+		fprintf(stdout, "Skipped incremental resize with %d-bit slots\n",
+						QF_BITS_PER_SLOT);
 	return 0;
 }